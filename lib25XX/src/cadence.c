@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "cadence.h"
+#include "utility.h"
+
+//Every poll and decision goes to the test log only, the screen would be flooded
+#define log_cadence(fmt, ...) log_format_line(FDM_TEST_LOG, "CADENCE|" fmt, ##__VA_ARGS__)
+
+//the fixed interval the control loops used before, savings are reported against it
+#define CADENCE_FIXED_MS 5000
+
+static inline uint64_t cadence_clamp(const double interval_ms);
+static inline double cadence_channel_eta(const double value, const double last, const double dt_ms, const bool have_last, const double target, const double rate_per_min);
+
+ControlTarget *ControlTarget_construct(ControlTarget *instance, const char *ps, const char *ps_rate, const char *pt, const char *pt_rate)
+{
+    instance->valid = ((ps != NULL) && (ps_rate != NULL) && (pt != NULL) && (pt_rate != NULL));
+    if(!instance->valid)
+        return instance;
+
+    instance->ps = strtod(ps, NULL);
+    instance->ps_rate = strtod(ps_rate, NULL);
+    instance->pt = strtod(pt, NULL);
+    instance->pt_rate = strtod(pt_rate, NULL);
+    return instance;
+}
+
+void cadence_init(PollCadence *pc, const char *name, const ControlTarget *target)
+{
+    pc->target = ((target != NULL) && target->valid) ? target : NULL;
+    pc->name = name;
+    pc->start_ms = time_in_ms();
+    pc->last_ms = pc->start_ms;
+    pc->have_last = false;
+    pc->polls = 0;
+    pc->slept_ms = 0;
+}
+
+uint64_t cadence_clamp(const double interval_ms)
+{
+    if(!(interval_ms > CADENCE_MIN_MS)) //also catches NaN
+        return CADENCE_MIN_MS;
+    if(interval_ms > CADENCE_MAX_MS)
+        return CADENCE_MAX_MS;
+    return (uint64_t)interval_ms;
+}
+
+//Estimated ms until a channel arrives, INFINITY if it can't be estimated
+double cadence_channel_eta(const double value, const double last, const double dt_ms, const bool have_last, const double target, const double rate_per_min)
+{
+    const double distance = fabs(target - value);
+    const double commanded = fabs(rate_per_min) / 60000.0;
+    double approach = commanded;
+
+    //prefer the measured approach rate once it is moving toward the target
+    if(have_last && (dt_ms > 0))
+    {
+        const double measured = (fabs(target - last) - distance) / dt_ms;
+        if(measured > (0.1 * commanded))
+            approach = measured;
+    }
+
+    if(distance == 0)
+        return 0;
+    if(approach <= 0)
+        return INFINITY;
+    return distance / approach;
+}
+
+//Poll about twice per remaining ETA, so a setpoint is noticed within CADENCE_MIN_MS of arriving
+//while long ramps are only checked every CADENCE_MAX_MS
+uint64_t cadence_next_interval(PollCadence *pc, const StatusSnapshot *snapshot)
+{
+    const uint64_t now = snapshot->time_ms;
+    const uint64_t elapsed = now - pc->start_ms;
+    const double dt_ms = (double)(now - pc->last_ms);
+    uint64_t interval;
+    double eta = INFINITY;
+
+    if(!snapshot->succeed || !snapshot->has_pressure)
+    {
+        interval = CADENCE_MIN_MS;
+        log_cadence("%s|t=%llu|no pressure data|next=%llu", pc->name, (long long unsigned)elapsed, (long long unsigned)interval);
+        return interval;
+    }
+
+    if(pc->target != NULL)
+    {
+        const double ps_eta = cadence_channel_eta(snapshot->ps, pc->last_ps, dt_ms, pc->have_last, pc->target->ps, pc->target->ps_rate);
+        const double pt_eta = cadence_channel_eta(snapshot->pt, pc->last_pt, dt_ms, pc->have_last, pc->target->pt, pc->target->pt_rate);
+        eta = fmax(ps_eta, pt_eta);
+        interval = cadence_clamp(eta / 2);
+    }
+    else if(pc->have_last)
+    {
+        //no target, back off while the pressure moves and tighten once it stops
+        const double ps_moved = fabs(snapshot->ps - pc->last_ps);
+        const double pt_moved = fabs(snapshot->pt - pc->last_pt);
+        const bool settled = (ps_moved <= (0.0005 * fabs(snapshot->ps))) && (pt_moved <= (0.0005 * fabs(snapshot->pt)));
+        interval = settled ? CADENCE_MIN_MS : cadence_clamp(2 * dt_ms);
+    }
+    else
+        interval = CADENCE_MIN_MS;
+
+    log_cadence("%s|t=%llu|ps=%f|pt=%f|stb=%d|opr=%d|eta=%.0f|next=%llu", pc->name, (long long unsigned)elapsed, snapshot->ps, snapshot->pt, (int)snapshot->stb, (int)snapshot->opr, eta, (long long unsigned)interval);
+
+    pc->last_ms = now;
+    pc->last_ps = snapshot->ps;
+    pc->last_pt = snapshot->pt;
+    pc->have_last = true;
+    return interval;
+}
+
+//For waits of a known length, check every CADENCE_MAX_MS and land on the expected end
+uint64_t cadence_deadline_interval(PollCadence *pc, const uint64_t expected_ms)
+{
+    const uint64_t now = time_in_ms();
+    const uint64_t elapsed = now - pc->start_ms;
+    const uint64_t interval = (elapsed < expected_ms) ? cadence_clamp((double)(expected_ms - elapsed)) : CADENCE_MIN_MS;
+    log_cadence("%s|t=%llu|expected=%llu|next=%llu", pc->name, (long long unsigned)elapsed, (long long unsigned)expected_ms, (long long unsigned)interval);
+    pc->last_ms = now;
+    return interval;
+}
+
+void cadence_sleep(PollCadence *pc, const uint64_t interval_ms)
+{
+    struct timespec ts;
+    SLEEP_MS(&ts, interval_ms);
+    pc->polls++;
+    pc->slept_ms += interval_ms;
+}
+
+//For callers that don't block, counts the poll and gives the time it is due
+uint64_t cadence_schedule(PollCadence *pc, const uint64_t interval_ms)
+{
+    pc->polls++;
+    pc->slept_ms += interval_ms;
+    return time_in_ms() + interval_ms;
+}
+
+void cadence_report(const PollCadence *pc, const bool reached)
+{
+    //called as soon as the goal is seen, a fixed schedule would only have seen it on its next tick
+    const uint64_t elapsed = time_in_ms() - pc->start_ms;
+    const uint64_t fixed = ((elapsed + CADENCE_FIXED_MS - 1) / CADENCE_FIXED_MS) * CADENCE_FIXED_MS;
+    log_cadence("%s|done|reached=%d|polls=%u|elapsed=%llu|fixed_estimate=%llu|saved=%llu", pc->name, (int)reached, pc->polls + 1,
+        (long long unsigned)elapsed, (long long unsigned)fixed, (long long unsigned)(reached ? (fixed - elapsed) : 0));
+}
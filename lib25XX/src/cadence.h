@@ -0,0 +1,38 @@
+#pragma once
+//Adaptive polling intervals for control loops
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "command.h"
+
+#define CADENCE_MIN_MS   500
+#define CADENCE_MAX_MS   5000
+
+//Setpoints and rates of a control test, rates are in units per minute
+typedef struct ControlTarget {
+    bool   valid;
+    double ps;
+    double ps_rate;
+    double pt;
+    double pt_rate;
+} ControlTarget;
+ControlTarget *ControlTarget_construct(ControlTarget *instance, const char *ps, const char *ps_rate, const char *pt, const char *pt_rate);
+
+typedef struct PollCadence {
+    const ControlTarget *target;
+    const char *name;
+    uint64_t start_ms;
+    uint64_t last_ms;
+    double   last_ps;
+    double   last_pt;
+    bool     have_last;
+    uint32_t polls;
+    uint64_t slept_ms;
+} PollCadence;
+
+void cadence_init(PollCadence *pc, const char *name, const ControlTarget *target);
+uint64_t cadence_next_interval(PollCadence *pc, const StatusSnapshot *snapshot);
+uint64_t cadence_deadline_interval(PollCadence *pc, const uint64_t expected_ms);
+void cadence_sleep(PollCadence *pc, const uint64_t interval_ms);
+uint64_t cadence_schedule(PollCadence *pc, const uint64_t interval_ms);
+void cadence_report(const PollCadence *pc, const bool reached);
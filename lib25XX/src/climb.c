@@ -0,0 +1,149 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "climb.h"
+#include "utility.h"
+
+#define log_climb(fmt, ...) log_format_line(FDM_TEST_LOG, "CLIMB|" fmt, ##__VA_ARGS__)
+
+//one rate per CLIMB_BLOCK_MS of samples
+#define CLIMB_BLOCK_MS      1000
+#define CLIMB_BLOCK_SAMPLES 3
+//the ramp has started once a block climbs at CLIMB_ONSET of the expected rate and no longer accelerates by more than the tolerance.
+//It is ending CLIMB_END_MS of climbing away from the setpoint
+#define CLIMB_ONSET         0.5
+#define CLIMB_END_MS        5000
+//no decision before CLIMB_MIN_BLOCKS, after that blocks CLIMB_OUTLIER standard deviations from the mean are dropped
+#define CLIMB_MIN_BLOCKS    5
+#define CLIMB_OUTLIER       4.0
+#define CLIMB_CONFIDENCE    3.0
+
+static inline void climb_block_add(ClimbBlock *block, const TelemetrySample *sample);
+static inline bool climb_block_rate(const ClimbBlock *block, double *rate);
+
+void climb_init(ClimbMeter *cm, const double expected, const double tolerance, const double setpoint)
+{
+    memset(cm, 0, sizeof(*cm));
+    cm->start_ms = time_in_ms();
+    cm->expected = expected;
+    cm->tolerance = tolerance;
+    cm->setpoint = setpoint;
+    cm->ci = INFINITY;
+}
+
+void climb_block_add(ClimbBlock *block, const TelemetrySample *sample)
+{
+    if(block->n == 0)
+    {
+        block->t0 = sample->time_ms;
+        block->y0 = sample->ps;
+    }
+    const double dt = (double)(sample->time_ms - block->t0);
+    const double dy = sample->ps - block->y0;
+    block->n++;
+    block->st += dt;
+    block->sy += dy;
+    block->stt += dt * dt;
+    block->sty += dt * dy;
+}
+
+//Slope of the block in units per minute
+bool climb_block_rate(const ClimbBlock *block, double *rate)
+{
+    if(block->n < CLIMB_BLOCK_SAMPLES)
+        return false;
+
+    const double Stt = block->stt - (block->st * block->st) / block->n;
+    const double Sty = block->sty - (block->st * block->sy) / block->n;
+    if(Stt <= 0)
+        return false;
+    *rate = (Sty / Stt) * 60000.0;
+    return true;
+}
+
+void climb_add(ClimbMeter *cm, const TelemetrySample *sample)
+{
+    if(cm->ending || (sample->time_ms < cm->start_ms))
+        return;
+
+    //slowing down for the setpoint, the block in progress is dropped too
+    if(fabs(cm->setpoint - sample->ps) <= (fabs(cm->expected) * CLIMB_END_MS / 60000.0))
+    {
+        cm->ending = true;
+        return;
+    }
+
+    if((cm->block.n > 0) && ((sample->time_ms - cm->block.t0) >= CLIMB_BLOCK_MS))
+    {
+        double rate;
+        if(climb_block_rate(&cm->block, &rate))
+            climb_add_rate(cm, rate);
+        memset(&cm->block, 0, sizeof(cm->block));
+    }
+    climb_block_add(&cm->block, sample);
+}
+
+//A rate from a block of samples or read from the unit
+void climb_add_rate(ClimbMeter *cm, const double rate)
+{
+    if(!cm->ramping)
+    {
+        const bool steady = (fabs(rate) >= (CLIMB_ONSET * fabs(cm->expected))) && (fabs(rate - cm->last_rate) <= cm->tolerance);
+        cm->last_rate = rate;
+        if(!steady)
+        {
+            cm->rejected++;
+            return;
+        }
+        cm->ramping = true;
+    }
+
+    if(cm->n >= CLIMB_MIN_BLOCKS)
+    {
+        const double sd = sqrt(cm->m2 / (cm->n - 1));
+        if((sd > 0) && (fabs(rate - cm->mean) > (CLIMB_OUTLIER * sd)))
+        {
+            cm->rejected++;
+            return;
+        }
+    }
+
+    cm->n++;
+    const double delta = rate - cm->mean;
+    cm->mean += delta / cm->n;
+    cm->m2 += delta * (rate - cm->mean);
+}
+
+//Passes once the interval is inside the tolerance, fails as soon as it is outside.
+//On the final evaluation the mean decides
+CLIMB climb_evaluate(ClimbMeter *cm, const bool final)
+{
+    if(cm->result != CLIMB_PENDING)
+        return cm->result;
+
+    cm->sd = (cm->n > 1) ? sqrt(cm->m2 / (cm->n - 1)) : 0;
+    cm->ci = (cm->n > 1) ? (CLIMB_CONFIDENCE * cm->sd / sqrt(cm->n)) : INFINITY;
+    const double error = fabs(cm->mean - cm->expected);
+    log_climb("t=%llu|n=%u|rejected=%u|mean=%f|sd=%f|ci=%f|final=%d", (long long unsigned)(time_in_ms() - cm->start_ms), cm->n, cm->rejected,
+        cm->mean, cm->sd, cm->ci, final);
+
+    if(cm->n >= CLIMB_MIN_BLOCKS)
+    {
+        if((error - cm->ci) > cm->tolerance)
+            cm->result = CLIMB_FAIL;
+        else if((error + cm->ci) <= cm->tolerance)
+            cm->result = CLIMB_PASS;
+    }
+    if(final && (cm->result == CLIMB_PENDING))
+        cm->result = ((cm->n > 0) && (error <= cm->tolerance)) ? CLIMB_PASS : CLIMB_FAIL;
+    return cm->result;
+}
+
+void climb_report(const ClimbMeter *cm, const char *units)
+{
+    OUTPUT_PRINT("CLIMB RATE - %f +/- %f %s/MIN, expected %f +/- %f, %u blocks (%u rejected) over %llu s", cm->mean, cm->ci, units,
+        cm->expected, cm->tolerance, cm->n, cm->rejected, (long long unsigned)((time_in_ms() - cm->start_ms) / 1000));
+}
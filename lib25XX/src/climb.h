@@ -0,0 +1,50 @@
+#pragma once
+//Climb rate of the measuring unit while the controlling unit ramps, from a straight line fit of each block of samples
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "telemetry.h"
+
+typedef enum {
+    CLIMB_PENDING = 0,
+    CLIMB_PASS    = 1 << 0,
+    CLIMB_FAIL    = 1 << 1
+} CLIMB;
+
+//Running sums of one block, t (ms) and altitude relative to its first sample
+typedef struct ClimbBlock {
+    uint32_t n;
+    uint64_t t0;
+    double   y0;
+    double   st;
+    double   sy;
+    double   stt;
+    double   sty;
+} ClimbBlock;
+
+typedef struct ClimbMeter {
+    uint64_t start_ms;
+    double   expected;    //units per minute
+    double   tolerance;
+    double   setpoint;
+    //transient rejection
+    bool     ramping;     //a block climbed steadily at the onset rate, it and the next ones are measured
+    bool     ending;      //close enough to the setpoint to be slowing down, nothing more is measured
+    double   last_rate;
+    uint32_t rejected;
+    ClimbBlock block;
+    //accepted block rates, Welford's mean and sum of squares
+    uint32_t n;
+    double   mean;
+    double   m2;
+    //last evaluation
+    double   sd;
+    double   ci;          //half width of the confidence interval of mean
+    CLIMB    result;
+} ClimbMeter;
+
+void climb_init(ClimbMeter *cm, const double expected, const double tolerance, const double setpoint);
+void climb_add(ClimbMeter *cm, const TelemetrySample *sample);
+void climb_add_rate(ClimbMeter *cm, const double rate);
+CLIMB climb_evaluate(ClimbMeter *cm, const bool final);
+void climb_report(const ClimbMeter *cm, const char *units);
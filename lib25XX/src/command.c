@@ -145,12 +145,48 @@ inline STBCommand command_STB(const int adts_fd)
   
 }
 
+bool command_status_snapshot(const int adts_fd, const char *ps_units, const char *pt_units, StatusSnapshot *snapshot)
+{
+    char ps_query[32], pt_query[32];
+    const char *queries[6] = {"*STB?", ":STAT:QUES:EVEN?", "*ESR?", ":STAT:OPER:EVEN?", ps_query, pt_query};
+    int num_queries = 4;
+    snapshot->has_pressure = ((ps_units != NULL) && (pt_units != NULL));
+    if(snapshot->has_pressure)
+    {
+        snprintf(ps_query, sizeof(ps_query), ":MEAS:PS? %s", ps_units);
+        snprintf(pt_query, sizeof(pt_query), ":MEAS:PT? %s", pt_units);
+        num_queries = 6;
+    }
+
+    char buf[256];
+    char *fields[6];
+    snapshot->succeed = (serial_fd_query_compound(adts_fd, queries, num_queries, buf, sizeof(buf), fields) == num_queries);
+    snapshot->time_ms = time_in_ms();
+    if(!snapshot->succeed)
+        return false;
+
+    snapshot->stb = (STB)atoi(fields[0]);
+    snapshot->que = (QUE)atoi(fields[1]);
+    snapshot->esb = (ESB)atoi(fields[2]);
+    snapshot->opr = (OPR)atoi(fields[3]);
+    if(snapshot->has_pressure)
+    {
+        snapshot->ps = strtod(fields[4], NULL);
+        snapshot->pt = strtod(fields[5], NULL);
+    }
+    return true;
+}
+
+//how long to wait for EXEC to be carried out before :CONT:GTGR
+#define GTG_EXEC_COMPLETE_MS 5000
+//GTGR only works once EXEC has been carried out, false if it wasn't and GTGR wasn't sent
 bool command_gtg(const int fd)
 {       
     serial_fd_do(fd, ":SYST:MODE CTRL", NULL, 0, NULL);
     serial_fd_do(fd, ":CONT:MODE DUAL", NULL, 0, NULL);
     serial_fd_do(fd, ":CONT:EXEC", NULL, 0, NULL);
-    sleep(3); // 9-13-18 attempt to fix this working intermittently 
+    if(!serial_fd_wait_complete(fd, GTG_EXEC_COMPLETE_MS))
+        return false;
     serial_fd_do(fd, ":CONT:GTGR", NULL, 0, NULL);     
     return true;
 }
@@ -158,7 +194,11 @@ bool command_gtg(const int fd)
 bool command_gtg_on_error(const int fd)
 {
     serial_fd_do(fd, ":CONT:EXEC", NULL, 0, NULL); 
-    sleep(3);  // 9-13-18 attempt to fix this working intermittently 
+    if(!serial_fd_wait_complete(fd, GTG_EXEC_COMPLETE_MS))
+    {
+        serial_fd_do(fd, "*CLS", NULL, 0, NULL);
+        return false;
+    }
     serial_fd_do(fd, ":CONT:GTGR", NULL, 0, NULL);    
     serial_fd_do(fd, "*CLS", NULL, 0, NULL);         
     return true;
@@ -171,7 +211,7 @@ bool command_GTG_eventually(const int fd)
     {
         return true;
     }
-    return control(0, "INHG", "INHG", OPR_GTG, command_gtg, command_gtg_on_error, NULL, fd);
+    return control(0, "INHG", "INHG", NULL, NULL, OPR_GTG, command_gtg, command_gtg_on_error, NULL, NULL, fd);
 }
 
 /*
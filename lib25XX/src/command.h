@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "serial.h"
 
@@ -159,6 +160,20 @@ typedef struct ESR {
 } ESR;
 
 
+//Every status register plus PS/PT read in one compound query
+typedef struct StatusSnapshot {
+    uint64_t time_ms;      //time_in_ms() when the reply was received
+    bool     succeed;
+    bool     has_pressure; //ps and pt are only read if units were passed in
+    STB      stb;
+    QUE      que;
+    ESB      esb;
+    OPR      opr;
+    double   ps;
+    double   pt;
+} StatusSnapshot;
+bool command_status_snapshot(const int adts_fd, const char *ps_units, const char *pt_units, StatusSnapshot *snapshot);
+
 StatOperEven command_StatOperEven(const int adts_fd);
 StatQuesEven command_StatQuesEven(const int adts_fd);
 ESR command_ESR(const int adts_fd);
@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "compare.h"
+#include "utility.h"
+
+#define log_compare(fmt, ...) log_format_line(FDM_TEST_LOG, "COMPARE|" fmt, ##__VA_ARGS__)
+
+//master samples further apart than this can't be interpolated to the slave's time
+#define COMPARE_MAX_GAP_MS  2000
+//the tolerance widens by how far the master moves in COMPARE_LAG_MS, for the plumbing between the units while ramping
+#define COMPARE_LAG_MS      250
+//consecutive pairs beyond the tolerance before it counts as a disagreement
+#define COMPARE_PERSIST     3
+
+typedef struct UnitsTolerance {
+    const char *units;
+    double tolerance;
+} UnitsTolerance;
+
+//Allowed difference between two units in agreement
+static const UnitsTolerance Default_Tolerances[] = {
+    {"FT",   25.0},
+    {"KTS",  2.0},
+    {"INHG", 0.01},
+};
+
+static inline bool compare_channel_init(CompareChannel *channel, const char *units);
+static inline void compare_channel_add(CompareChannel *channel, const char *name, const double diff, const double slope, const uint64_t t);
+static inline void compare_channel_report(const CompareChannel *channel, const char *name, const char *units);
+
+bool compare_channel_init(CompareChannel *channel, const char *units)
+{
+    memset(channel, 0, sizeof(*channel));
+    for(uint i = 0; i < LENGTH_2D(Default_Tolerances); i++)
+    {
+        if(strcmp(units, Default_Tolerances[i].units) == 0)
+        {
+            channel->tolerance = Default_Tolerances[i].tolerance;
+            channel->enabled = true;
+        }
+    }
+    return channel->enabled;
+}
+
+//Both units have to be sampling, false if there is nothing to compare
+bool compare_init(CrossCompare *cc, TelemetrySampler *master, TelemetrySampler *slave, const char *ps_units, const char *pt_units)
+{
+    memset(cc, 0, sizeof(*cc));
+    cc->start_ms = time_in_ms();
+    telemetry_reader_init(&cc->master, master);
+    telemetry_reader_init(&cc->slave, slave);
+    compare_channel_init(&cc->ps, ps_units);
+    compare_channel_init(&cc->pt, pt_units);
+    return (master != NULL) && (slave != NULL) && (cc->ps.enabled || cc->pt.enabled);
+}
+
+//slope is how fast the master moves, units per ms
+void compare_channel_add(CompareChannel *channel, const char *name, const double diff, const double slope, const uint64_t t)
+{
+    if(!channel->enabled)
+        return;
+
+    channel->n++;
+    const double delta = diff - channel->mean;
+    channel->mean += delta / channel->n;
+    channel->m2 += delta * (diff - channel->mean);
+    if(fabs(diff) > channel->max_abs)
+        channel->max_abs = fabs(diff);
+
+    const double tolerance = channel->tolerance + fabs(slope) * COMPARE_LAG_MS;
+    if(fabs(diff) <= tolerance)
+    {
+        channel->over = 0;
+        return;
+    }
+    if(++channel->over == COMPARE_PERSIST)
+    {
+        channel->disagreements++;
+        log_compare("%s|disagree|diff=%f|tolerance=%f|t=%llu", name, diff, tolerance, (long long unsigned)t);
+    }
+}
+
+//Pairs every new slave sample with the master interpolated to the same time. A slave sample newer than the last master
+//sample waits for the next update
+void compare_update(CrossCompare *cc)
+{
+    TelemetrySample sample;
+    for(;;)
+    {
+        if(!cc->have_slave)
+        {
+            if(!telemetry_read(&cc->slave, &cc->slave_sample))
+                return;
+            cc->have_slave = true;
+        }
+
+        while((cc->master_count == 0) || (cc->master_last.time_ms < cc->slave_sample.time_ms))
+        {
+            if(!telemetry_read(&cc->master, &sample))
+                return;
+            cc->master_prev = cc->master_last;
+            cc->master_last = sample;
+            cc->master_count++;
+        }
+        cc->have_slave = false;
+
+        const TelemetrySample *a = &cc->master_prev;
+        const TelemetrySample *b = &cc->master_last;
+        const uint64_t gap = b->time_ms - a->time_ms;
+        if((cc->master_count < 2) || (a->time_ms > cc->slave_sample.time_ms) || (gap == 0) || (gap > COMPARE_MAX_GAP_MS))
+        {
+            cc->unaligned++;
+            continue;
+        }
+
+        const double f = (double)(cc->slave_sample.time_ms - a->time_ms) / gap;
+        const double ps_slope = (b->ps - a->ps) / gap;
+        const double pt_slope = (b->pt - a->pt) / gap;
+        const uint64_t t = cc->slave_sample.time_ms - cc->start_ms;
+        compare_channel_add(&cc->ps, "PS", cc->slave_sample.ps - (a->ps + f * (b->ps - a->ps)), ps_slope, t);
+        compare_channel_add(&cc->pt, "PT", cc->slave_sample.pt - (a->pt + f * (b->pt - a->pt)), pt_slope, t);
+    }
+}
+
+bool compare_agrees(const CrossCompare *cc)
+{
+    return (cc->ps.disagreements == 0) && (cc->pt.disagreements == 0);
+}
+
+void compare_channel_report(const CompareChannel *channel, const char *name, const char *units)
+{
+    if(!channel->enabled || (channel->n == 0))
+        return;
+
+    const double sd = (channel->n > 1) ? sqrt(channel->m2 / (channel->n - 1)) : 0;
+    OUTPUT_PRINT("CROSS CHECK %s - slave minus master %f +/- %f %s, max %f, %u disagreements beyond %f over %u pairs", name, channel->mean, sd, units,
+        channel->max_abs, channel->disagreements, channel->tolerance, channel->n);
+    log_compare("%s|n=%u|mean=%f|sd=%f|max=%f|disagreements=%u", name, channel->n, channel->mean, sd, channel->max_abs, channel->disagreements);
+}
+
+void compare_report(const CrossCompare *cc, const char *ps_units, const char *pt_units)
+{
+    compare_channel_report(&cc->ps, "PS", ps_units);
+    compare_channel_report(&cc->pt, "PT", pt_units);
+    if(cc->unaligned > 0)
+        log_compare("unaligned=%u", cc->unaligned);
+}
@@ -0,0 +1,40 @@
+#pragma once
+//Cross check of the controlling unit against the measuring unit, from both units' samples aligned in time
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "telemetry.h"
+
+//Difference of one channel, slave minus master
+typedef struct CompareChannel {
+    bool     enabled;
+    double   tolerance;
+    //Welford's mean and sum of squares of the difference
+    uint32_t n;
+    double   mean;
+    double   m2;
+    double   max_abs;
+    //a disagreement is a run of pairs beyond the tolerance
+    uint32_t over;
+    uint32_t disagreements;
+} CompareChannel;
+
+typedef struct CrossCompare {
+    uint64_t start_ms;
+    TelemetryReader master;
+    TelemetryReader slave;
+    //the two master samples around the slave sample being aligned
+    uint32_t master_count;
+    TelemetrySample master_prev;
+    TelemetrySample master_last;
+    bool have_slave;
+    TelemetrySample slave_sample;
+    uint32_t unaligned;
+    CompareChannel ps;
+    CompareChannel pt;
+} CrossCompare;
+
+bool compare_init(CrossCompare *cc, TelemetrySampler *master, TelemetrySampler *slave, const char *ps_units, const char *pt_units);
+void compare_update(CrossCompare *cc);
+bool compare_agrees(const CrossCompare *cc);
+void compare_report(const CrossCompare *cc, const char *ps_units, const char *pt_units);
@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "command.h"
 #include "control.h"
@@ -12,13 +14,24 @@
 #include "utility.h"
 #include "status.h"
 #include "test.h"
+#include "telemetry.h"
+#include "leak.h"
+#include "climb.h"
+#include "machine.h"
+#include "compare.h"
 
 static bool control_set_units(const CTRL_UNITS units, const char **ps_units, const char **pt_units, const char **ps_rate_units_part, const char **pt_rate_units_part);
 static bool control_setup(const CTRL_OP op, const char *ps_units, const char *pt_units, const char *ps, const char *ps_rate, const char *pt, const char *pt_rate, const int adts_fd);
 static bool measure_setup(const ADTS *adts, const CTRL_OP op);
 static bool leak_test_set_tolerances(const ADTS *adts, const char *set_cmd, const char *query_cmd, const double tolerance);
 static bool measure_rate(const ADTS *adts, const CTRL_OP op, double *rate);
-static bool control_run_test_full(const ControlTest *test, const int adts_fd);
+static bool control_run_test_full(ControlTest *test, const int adts_fd, CrossCompare *compare);
+static void control_compare_report(const CrossCompare *compare, const char *ps_units, const char *pt_units);
+static bool control_single_channel_test_full(SingleChannelTest *test);
+static bool control_run_leak_test_full(LeakTest *test, const ADTS *adts);
+static void *control_leak_test_thread(void *_args);
+static bool control_read_leak_rates(const LeakTest *test, const ADTS *adts);
+static bool control_estimate_leak(const LeakTest *test, TelemetrySampler *sampler, const char *ps_units, const char *pt_units, bool *starved);
 
 bool control_set_units(const CTRL_UNITS units, const char **ps_units, const char **pt_units, const char **ps_rate_units_part, const char **pt_rate_units_part)
 {
@@ -47,14 +60,179 @@ bool control_set_units(const CTRL_UNITS units, const char **ps_units, const char
 #define PT_FMT_PART           "PT TARGET: %s %s PT RATE %s %sPM"
 #define SETTING_UP_ADTS_TEXT  "Setting up ADTS Control:\n"
 #define CONTROL_NOW_TEXT      "System is NOW Controlling"
-#define SETPOINT_REACHED_TEXT "Setpoint reached, verifying it remains STABLE for 30 seconds, checking every 5 seconds"
 
-bool control_run_test(const ControlTest *test)
+//Leak readings stop after LEAK_READINGS_MS
+#define LEAK_READINGS_MS      390000
+#define LEAK_CHECK_MS         1000
+#define LEAK_UPDATE_MS        10000
+
+//Off while other tests may be using the slave
+static atomic_bool Control_Cross_Check = true;
+
+//Settings of control_setup that don't move pressure, in the order of its commands
+typedef struct PrepareSetting {
+    const char *set;
+    const char *query;
+} PrepareSetting;
+
+static const PrepareSetting Prepare_Settings[] = {
+    {":SYST:MODE",     ":SYST:MODE?"},
+    {":CONT:MODE",     ":CONT:MODE?"},
+    {":CONT:PS:UNITS", ":CONT:PS:UNITS?"},
+    {":CONT:PT:UNITS", ":CONT:PT:UNITS?"},
+};
+#define PREPARE_NUM_SETTINGS 4
+
+//A unit set up ahead of its test, with what it had before in case the test doesn't run
+typedef struct ControlPrepared {
+    bool valid;
+    int adts_fd;
+    const char *ps_units;
+    const char *pt_units;
+    bool changed[PREPARE_NUM_SETTINGS];
+    char previous[PREPARE_NUM_SETTINGS][32];
+} ControlPrepared;
+
+//control_setup on other threads checks it while tests run in parallel
+static ControlPrepared Prepared;
+static pthread_mutex_t Prepared_Lock = PTHREAD_MUTEX_INITIALIZER;
+static void control_prepare_rollback(const ControlPrepared *prep);
+
+void control_set_cross_check(const bool enable)
+{
+    atomic_store(&Control_Cross_Check, enable);
+}
+
+//Queries the settings into fields, buf holds the replies
+static bool control_prepare_query(const int adts_fd, char *buf, const size_t bufsize, char **fields)
+{
+    const char *queries[PREPARE_NUM_SETTINGS];
+    for(uint i = 0; i < PREPARE_NUM_SETTINGS; i++)
+        queries[i] = Prepare_Settings[i].query;
+    return serial_fd_query_compound(adts_fd, queries, PREPARE_NUM_SETTINGS, buf, bufsize, fields) == PREPARE_NUM_SETTINGS;
+}
+
+//The settings in values that are flagged as one command, in reverse to undo them
+static bool control_prepare_set(const int adts_fd, const char *const *values, const bool *flags, const bool reverse)
+{
+    char cmd[256];
+    size_t used = 0;
+    for(uint n = 0; n < PREPARE_NUM_SETTINGS; n++)
+    {
+        const uint i = reverse ? (PREPARE_NUM_SETTINGS - 1 - n) : n;
+        if(flags[i])
+            used += (size_t)snprintf(&cmd[used], sizeof(cmd) - used, "%s%s %s", (used > 0) ? ";" : "", Prepare_Settings[i].set, values[i]);
+    }
+    return (used == 0) || serial_fd_do(adts_fd, cmd, NULL, 0, NULL);
+}
+
+//The part of control_setup that doesn't move pressure, done while the operator reads the prompt of the test. Only
+//settings that differ are sent, and only to a unit at ground. One still holding the last test's setpoint is left to
+//control_setup after Run
+bool control_prepare(const int adts_fd, const CTRL_UNITS units)
+{
+    const char *ps_units, *pt_units, *ps_rate_units_part, *pt_rate_units_part;
+    const uint64_t start_ms = time_in_ms();
+    pthread_mutex_lock(&Prepared_Lock);
+    Prepared.valid = false;
+    pthread_mutex_unlock(&Prepared_Lock);
+    if(!control_set_units(units, &ps_units, &pt_units, &ps_rate_units_part, &pt_rate_units_part))
+        return false;
+    if(!serial_fd_do(adts_fd, "*CLS", NULL, 0, NULL))
+        return false;
+    const bool at_ground = (status_check_event_registers(OPR_GTG, adts_fd) == ST_AT_GOAL);
+
+    const char *wanted[PREPARE_NUM_SETTINGS] = {"CTRL", "DUAL", ps_units, pt_units};
+    char buf[256];
+    char *fields[PREPARE_NUM_SETTINGS];
+    if(!control_prepare_query(adts_fd, buf, sizeof(buf), fields))
+        return false;
+    ControlPrepared prep = {.valid = true, .adts_fd = adts_fd, .ps_units = ps_units, .pt_units = pt_units};
+    uint num_changed = 0;
+    for(uint i = 0; i < PREPARE_NUM_SETTINGS; i++)
+    {
+        prep.changed[i] = (strcmp(fields[i], wanted[i]) != 0);
+        snprintf(prep.previous[i], sizeof(prep.previous[i]), "%s", fields[i]);
+        num_changed += prep.changed[i];
+    }
+    if(!at_ground && (num_changed > 0))
+    {
+        log_format_line(FDM_TEST_LOG, "PREP|%s|ground=0|changed=%u|deferred=1|t=%llu", control_adts_sn(adts_fd), num_changed,
+            (long long unsigned)(time_in_ms() - start_ms));
+        return false;
+    }
+    if(!control_prepare_set(adts_fd, wanted, prep.changed, false))
+    {
+        control_prepare_rollback(&prep);
+        return false;
+    }
+
+    //verified the same way control_setup does it
+    bool bRet = control_prepare_query(adts_fd, buf, sizeof(buf), fields);
+    for(uint i = 0; bRet && (i < PREPARE_NUM_SETTINGS); i++)
+        bRet = (strcmp(fields[i], wanted[i]) == 0);
+    if(bRet)
+    {
+        pthread_mutex_lock(&Prepared_Lock);
+        Prepared = prep;
+        pthread_mutex_unlock(&Prepared_Lock);
+    }
+    else
+        control_prepare_rollback(&prep);
+    log_format_line(FDM_TEST_LOG, "PREP|%s|ground=%d|changed=%u|verified=%d|t=%llu", control_adts_sn(adts_fd), at_ground, num_changed, bRet,
+        (long long unsigned)(time_in_ms() - start_ms));
+    return bRet;
+}
+
+//Done with the preparation, undo puts back what control_prepare changed for a test that is skipped
+void control_prepare_end(const bool undo)
 {
-    return control_run_test_full(test, serial_get_SDM()->master.fd);
+    pthread_mutex_lock(&Prepared_Lock);
+    const ControlPrepared prep = Prepared;
+    Prepared.valid = false;
+    pthread_mutex_unlock(&Prepared_Lock);
+    if(prep.valid && undo)
+        control_prepare_rollback(&prep);
 }
 
-bool control_run_test_full(const ControlTest *test, const int adts_fd)
+//the units go back while the unit is still in control mode
+void control_prepare_rollback(const ControlPrepared *prep)
+{
+    const char *previous[PREPARE_NUM_SETTINGS];
+    for(uint i = 0; i < PREPARE_NUM_SETTINGS; i++)
+        previous[i] = prep->previous[i];
+    const bool bRet = control_prepare_set(prep->adts_fd, previous, prep->changed, true);
+    log_format_line(FDM_TEST_LOG, "PREP|%s|rollback=%d", control_adts_sn(prep->adts_fd), bRet);
+}
+
+bool control_run_test(ControlTest *test)
+{
+    const char *ps_units, *pt_units, *ps_rate_units_part, *pt_rate_units_part;
+    if(!control_set_units(test->units, &ps_units, &pt_units, &ps_rate_units_part, &pt_rate_units_part))
+        return false;
+
+    //the slave is sampled alongside to cross check the master while it controls
+    TelemetrySampler *sampler = telemetry_start(serial_get_SDM()->master.fd, "master", ps_units, pt_units);
+    TelemetrySampler *slave_sampler = atomic_load(&Control_Cross_Check) ? telemetry_start(serial_get_SDM()->slave.fd, "slave", ps_units, pt_units) : NULL;
+    CrossCompare compare;
+    const bool comparing = compare_init(&compare, sampler, slave_sampler, ps_units, pt_units);
+    bool bRet = control_run_test_full(test, serial_get_SDM()->master.fd, comparing ? &compare : NULL);
+    telemetry_stop(slave_sampler);
+    telemetry_stop(sampler);
+    if(comparing)
+        control_compare_report(&compare, ps_units, pt_units);
+    return bRet;
+}
+
+//The cross check doesn't decide the test, disagreements are flagged for whoever reads the results
+void control_compare_report(const CrossCompare *compare, const char *ps_units, const char *pt_units)
+{
+    compare_report(compare, ps_units, pt_units);
+    if(!compare_agrees(compare))
+        OUTPUT_PRINT("WARNING - master and slave units disagree beyond tolerance, check the plumbing and calibration of both units");
+}
+
+bool control_run_test_full(ControlTest *test, const int adts_fd, CrossCompare *compare)
 {
     const char *ps_units;
     const char *ps_rate_units_part;
@@ -69,36 +247,76 @@ bool control_run_test_full(const ControlTest *test, const int adts_fd)
         return false;
     
     OUTPUT_PRINT("ADTS Control setup complete, " CONTROL_NOW_TEXT);    
-    if(!control(test->duration, ps_units, pt_units, OPR_STABLE, NULL, NULL, NULL, adts_fd))
-        return false;
+    ControlTarget target;
+    ControlTarget_construct(&target, test->ps, test->ps_rate, test->pt, test->pt_rate);
+    step_response_init(&test->response, &target, true, true, ps_units, pt_units);
+    ControlMachine cm;
+    machine_init(&cm, adts_fd, test->duration, ps_units, pt_units, &target, &test->response, OPR_STABLE, NULL);
+    machine_verify(&cm, OPR_STABLE, CTRL_OP_DUAL);
+    machine_compare(&cm, compare);
+    ControlMachine *machines[1] = {&cm};
+    bool bRet = machine_run(machines, 1);
+    step_response_finish(&test->response);
+    step_response_report(&test->response, control_adts_sn(adts_fd), test->test_name, ps_units, pt_units);
+    return bRet;
+
+
+}
 
-    OUTPUT_PRINT(SETPOINT_REACHED_TEXT);  
-    for(uint64_t start = time_in_ms(); (time_in_ms() - start) < 30000; )
+//Climb rate of the measuring unit, from its own samples when it has a sampler or from its rate reading every cycle
+typedef struct ClimbCycle {
+    ClimbMeter meter;
+    TelemetrySampler *sampler;
+    TelemetryReader reader;
+    const ADTS *adts;
+    CTRL_OP op;
+    const char *units;
+} ClimbCycle;
+
+static CYCLE control_measure_climb(void *ctx, const bool final)
+{
+    ClimbCycle *cc = (ClimbCycle*)ctx;
+    if(cc->sampler != NULL)
     {
-        if(status_check_event_registers(OPR_STABLE, adts_fd) != ST_AT_GOAL)
-            return false;
-        sleep(5);
+        TelemetrySample sample;
+        while(telemetry_read(&cc->reader, &sample))
+            climb_add(&cc->meter, &sample);
+    }
+    else
+    {
+        double result;
+        if(!measure_rate(cc->adts, cc->op, &result))
+            return CYCLE_FAIL;
+        climb_add_rate(&cc->meter, result);
     }
-    return true;
-
 
+    const CLIMB climb = climb_evaluate(&cc->meter, final);
+    if(climb == CLIMB_PENDING)
+        return CYCLE_CONTINUE;
+    climb_report(&cc->meter, cc->units);
+    if(climb == CLIMB_FAIL)
+    {
+        OUTPUT_PRINT("Failure, climb rate was not close enough to expected value");
+        return CYCLE_FAIL;
+    }
+    return CYCLE_DONE;
 }
 
-static bool measure_ps_test1(bool *within_range)
+bool control_single_channel_test(SingleChannelTest *test)
 {
-    double result;
-    static const double expected = 50000;
-    static const double error = 0.06 * 50000;
-    if(!measure_rate(&serial_get_SDM()->slave, CTRL_OP_PS, &result))
+    const char *ps_units, *pt_units, *ps_rate_units_part, *pt_rate_units_part;
+    if(!control_set_units(test->units, &ps_units, &pt_units, &ps_rate_units_part, &pt_rate_units_part))
         return false;
 
-    if(fabs(expected - result) <= error)
-        *within_range = true;
-
-    return true;
+    TelemetrySampler *sampler = telemetry_start(serial_get_SDM()->master.fd, "master", ps_units, pt_units);
+    TelemetrySampler *slave_sampler = telemetry_start(serial_get_SDM()->slave.fd, "slave", ps_units, pt_units);
+    bool bRet = control_single_channel_test_full(test);
+    telemetry_stop(slave_sampler);
+    telemetry_stop(sampler);
+    return bRet;
 }
 
-bool control_single_channel_test(const SingleChannelTest *test)
+bool control_single_channel_test_full(SingleChannelTest *test)
 {
     const char *ps_units;
     const char *ps_rate_units_part;
@@ -137,17 +355,39 @@ bool control_single_channel_test(const SingleChannelTest *test)
     
     //Start controling
     OUTPUT_PRINT("ADTS Single Channel Control setup complete, " CONTROL_NOW_TEXT);    
-    if(!control(test->duration, ps_units, pt_units, opr, NULL, NULL, measure_ps_test1, serial_get_SDM()->master.fd))
-        return false;
+    ControlTarget target;
+    ControlTarget_construct(&target, test->ps, test->ps_rate, "0", "0");
+    step_response_init(&test->response, &target, test->op & CTRL_OP_PS, test->op & CTRL_OP_PT, ps_units, pt_units);
+    ClimbCycle climb = {.sampler = control_get_sampler(serial_get_SDM()->slave.fd, ps_units, pt_units), .adts = &serial_get_SDM()->slave, .op = test->op, .units = ps_units};
+    climb_init(&climb.meter, test->expected_rate, test->rate_tolerance, target.ps);
+    telemetry_reader_init(&climb.reader, climb.sampler);
+    //the climb rate is what is tested, when it is decided during the ramp the setpoint isn't verified
+    const ControlHooks hooks = {NULL, NULL, control_measure_climb, &climb};
+    ControlMachine cm;
+    machine_init(&cm, serial_get_SDM()->master.fd, test->duration, ps_units, pt_units, &target, &test->response, opr, &hooks);
+    machine_verify(&cm, opr, test->op);
+    CrossCompare compare;
+    if(compare_init(&compare, control_get_sampler(serial_get_SDM()->master.fd, ps_units, pt_units), climb.sampler, ps_units, pt_units))
+        machine_compare(&cm, &compare);
+    ControlMachine *machines[1] = {&cm};
+    bool bRet = machine_run(machines, 1);
+    step_response_finish(&test->response);
+    step_response_report(&test->response, serial_get_SDM()->master.sn, test->test_name, ps_units, pt_units);
+    if(cm.compare != NULL)
+        control_compare_report(&compare, ps_units, pt_units);
+    return bRet;
+}
 
-    OUTPUT_PRINT(SETPOINT_REACHED_TEXT);  
-    for(uint64_t start = time_in_ms(); (time_in_ms() - start) < 30000; )
-    {
-        if(status_check_event_registers(opr, serial_get_SDM()->master.fd) != ST_AT_GOAL)
-            return false;
-        sleep(5);
-    }
-    return true;
+//True if the unit was prepared for these settings. Whatever control_setup does next replaces the preparation
+static bool control_prepared_for(const int adts_fd, const CTRL_OP op, const char *ps_units, const char *pt_units)
+{
+    pthread_mutex_lock(&Prepared_Lock);
+    const bool prepared = Prepared.valid && (Prepared.adts_fd == adts_fd) && (op == CTRL_OP_DUAL) &&
+                          (strcmp(Prepared.ps_units, ps_units) == 0) && (strcmp(Prepared.pt_units, pt_units) == 0);
+    if(Prepared.valid && (Prepared.adts_fd == adts_fd))
+        Prepared.valid = false;
+    pthread_mutex_unlock(&Prepared_Lock);
+    return prepared;
 }
 
 bool control_setup(const CTRL_OP op, const char *ps_units, const char *pt_units, const char *ps, const char *ps_rate, const char *pt, const char *pt_rate, const int adts_fd)
@@ -247,9 +487,12 @@ bool control_setup(const CTRL_OP op, const char *ps_units, const char *pt_units,
     else if(commands[1] == NULL) //unknown channel
         return false;    
    
+    //the mode and units commands come first, control_prepare may have done them already
+    const int first = control_prepared_for(adts_fd, op, ps_units, pt_units) ? PREPARE_NUM_SETTINGS : 0;
+
     //loop through all of the commands and make sure they turn out as expected
     const SetCommand *currentCommand;
-    for(int i = 0; i < command_index; i++)
+    for(int i = first; i < command_index; i++)
     {
         currentCommand = (SetCommand*)commands[i];        
         if(!serial_fd_do(adts_fd, currentCommand->cmd, NULL, 0, NULL))
@@ -274,54 +517,40 @@ bool control_setup(const CTRL_OP op, const char *ps_units, const char *pt_units,
 }
 
 
-bool control(uint64_t exp_time, const char *ps_units, const char *pt_units, OPR success_mask, Control_Start_Func start_func, Control_On_Error on_error, Control_EachCycle cycle_func, const int adts_fd)
+//The background sampler of adts_fd, if one is running in the same units
+TelemetrySampler *control_get_sampler(const int adts_fd, const char *ps_units, const char *pt_units)
 {
-    if(exp_time == 0)
-        exp_time = UINT64_MAX;    
-    
-    //EXECUTE
-    if(start_func == NULL)
-        serial_fd_do(adts_fd, ":CONT:EXEC", NULL, 0, NULL); 
-    else
-        start_func(adts_fd);   
-    uint64_t start = time_in_ms();
-    STATUS st;
-    bool achieved = false;
-    //While we are not stable, check every 5 seconds    
-    for(;;)
-    {
-        if((st = status_check_event_registers(success_mask, adts_fd)) == ST_ERR)
-        {
-            if((on_error == NULL) || (!on_error(adts_fd)))
-                return false; 
-         
-        }      
- 
-        status_dump_pressure_data_if_different(ps_units, pt_units, adts_fd);
-
-        if(st == ST_AT_GOAL)
-            break;
-
-        if((time_in_ms()- start) > exp_time)
-        {
-            OUTPUT_PRINT("Timeout, control not performed in %llu\n", (long long unsigned)exp_time);
-            return false;
-        } 
+    TelemetrySampler *sampler = telemetry_get(adts_fd);
+    if((sampler == NULL) || (strcmp(sampler->ps_units, ps_units) != 0) || (strcmp(sampler->pt_units, pt_units) != 0))
+        return NULL;
+    return sampler;
+}
 
-        if(cycle_func != NULL)
-            if(!cycle_func(&achieved))
-                return false;   
-               
-        sleep(5);
-    }
+const char *control_adts_sn(const int adts_fd)
+{
+    if(adts_fd == serial_get_SDM()->slave.fd)
+        return serial_get_SDM()->slave.sn;
+    return serial_get_SDM()->master.sn;
+}
 
-    if((cycle_func != NULL) && (!achieved))
-    {
-        OUTPUT_PRINT("Failure, was not close enough to expected value");
-        return false;
-    }
+//Pressure comes from the background sampler when one is running in the same units and its latest sample is recent,
+//the unit is asked otherwise
+void control_take_snapshot(const int adts_fd, const char *ps_units, const char *pt_units, StatusSnapshot *snapshot)
+{
+    TelemetrySampler *sampler = control_get_sampler(adts_fd, ps_units, pt_units);
+    if((sampler != NULL) && command_status_snapshot(adts_fd, NULL, NULL, snapshot) && telemetry_fill_snapshot(sampler, snapshot))
+        return;
+    command_status_snapshot(adts_fd, ps_units, pt_units, snapshot);
+}
 
-    return true;
+//A single machine run by the scheduler on this thread
+bool control(uint64_t exp_time, const char *ps_units, const char *pt_units, const ControlTarget *target, StepResponse *response, OPR success_mask, Control_Start_Func start_func, Control_On_Error on_error, Control_EachCycle cycle_func, void *cycle_ctx, const int adts_fd)
+{
+    const ControlHooks hooks = {start_func, on_error, cycle_func, cycle_ctx};
+    ControlMachine cm;
+    machine_init(&cm, adts_fd, exp_time, ps_units, pt_units, target, response, success_mask, &hooks);
+    ControlMachine *machines[1] = {&cm};
+    return machine_run(machines, 1);
 }
 
 bool measure_setup(const ADTS *adts, const CTRL_OP op)
@@ -388,60 +617,107 @@ bool leak_test_set_tolerances(const ADTS *adts, const char *set_cmd, const char
     return true;
 }
 
-bool control_run_leak_test(const LeakTest *test)
+bool control_run_leak_test(LeakTest *test)
 {
+    const char *ps_units, *pt_units, *ps_rate_units_part, *pt_rate_units_part;
+    if(!control_set_units(test->units, &ps_units, &pt_units, &ps_rate_units_part, &pt_rate_units_part))
+        return false;
+
     //set unit
     ADTS *adts;
+    const char *name;
     if(test->testing_master_unit)
     {
         OUTPUT_PRINT("Running leak test on master");
         adts = &(serial_get_SDM()->master);
+        name = "master";
     }
     else
     {
         OUTPUT_PRINT("Running leak test on slave");
         adts = &(serial_get_SDM()->slave);
+        name = "slave";
     }
 
-    //assert we are at ground
-    command_GTG_eventually(adts->fd);
+    TelemetrySampler *sampler = telemetry_start(adts->fd, name, ps_units, pt_units);
+    bool bRet = control_run_leak_test_full(test, adts);
+    telemetry_stop(sampler);
+    return bRet;
+}
 
-    //get the unit controlling
-    if(!control_run_test_full((const ControlTest*)test, adts->fd))
-        return false;
+typedef struct LeakTestThread {
+    LeakTest   *test;
+    const ADTS *adts;
+    const char *name;
+    FD_MASK     unit_log;
+    bool        passed;
+} LeakTestThread;
 
-    OUTPUT_PRINT("System is stable, start leak test stabilizing for %s minutes %s seconds", test->delay_minutes, test->delay_seconds);
+void *control_leak_test_thread(void *_args)
+{
+    LeakTestThread *args = (LeakTestThread*)_args;
+    log_set_unit(args->name, args->unit_log);
+    args->passed = control_run_leak_test_full(args->test, args->adts);
+    log_set_unit(NULL, FDM_INVALID);
+    return NULL;
+}
 
-    //set the tolerances for display
-    if(!leak_test_set_tolerances(adts, ":LEAK:PSTOL", ":LEAK:PSTOL?", test->ps_tolerance))
-        return false;
-    if(!leak_test_set_tolerances(adts, ":LEAK:PTTOL", ":LEAK:PTTOL?", test->pt_tolerance))
+//The units have their own ports and pneumatic paths, so each leak test runs on its own thread
+bool control_run_leak_test_pair(LeakPairTest *test)
+{
+    if(!test->master_test->testing_master_unit || test->slave_test->testing_master_unit)
+    {
+        ERROR_PRINT("%s: the first test must be a master unit test and the second a slave unit test", test->test_name);
         return false;
+    }
 
-    //set the delay
-    char delay[32];
-    snprintf(delay, sizeof(delay), "%s, %s", test->delay_minutes, test->delay_seconds);
-    char delay_cmd[64];
-    snprintf(delay_cmd, sizeof(delay_cmd), ":LEAK:DELAY %s", delay);
-    if(!serial_fd_do(adts->fd, delay_cmd, NULL, 0, NULL))
-        return false;
-    if(!command_and_check_result_str_fd(adts->fd, ":LEAK:DELAY?", delay))
-        return false;
+    LeakTestThread args[2] = {
+        {test->master_test, &(serial_get_SDM()->master), "master", FDM_INVALID, false},
+        {test->slave_test,  &(serial_get_SDM()->slave),  "slave",  FDM_INVALID, false}
+    };
+    const char *ps_units[2], *pt_units[2];
+    for(uint i = 0; i < 2; i++)
+    {
+        const char *ps_rate_units_part, *pt_rate_units_part;
+        if(!control_set_units(args[i].test->units, &ps_units[i], &pt_units[i], &ps_rate_units_part, &pt_rate_units_part))
+            return false;
+    }
 
-    //start running the leak test
-    if(!serial_fd_do(adts->fd, ":LEAK:RUN ON", NULL, 0, NULL))
-        return false;
-    if((!command_and_check_result_str_fd(adts->fd, ":LEAK:RUN?", "DELAY"))&&(!command_and_check_result_str_fd(adts->fd, ":LEAK:RUN?", "ON")))
-        return false;
+    TelemetrySampler *samplers[2];
+    pthread_t threads[2];
+    bool started[2];
+    for(uint i = 0; i < 2; i++)
+    {
+        OUTPUT_PRINT("Running %s on %s", args[i].test->test_name, args[i].name);
+        if((args[i].unit_log = log_open_unit(args[i].adts->sn)) == FDM_INVALID)
+            ERROR_PRINT("Could not open the log for %s S/N %s, its lines only go to the main log", args[i].name, args[i].adts->sn);
+        samplers[i] = telemetry_start(args[i].adts->fd, args[i].name, ps_units[i], pt_units[i]);
+    }
 
-    //wait for the delay period
-    while(!command_and_check_result_str_fd(adts->fd, ":LEAK:RUN?", "ON"))
+    for(uint i = 0; i < 2; i++)
     {
-        sleep(5);
+        if(!(started[i] = (pthread_create(&threads[i], NULL, &control_leak_test_thread, &args[i]) == 0)))
+        {
+            ERROR_PRINT("Could not start the leak test thread for %s, running it here", args[i].name);
+            control_leak_test_thread(&args[i]);
+        }
     }
 
+    bool bRet = true;
+    for(uint i = 0; i < 2; i++)
+    {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+        telemetry_stop(samplers[i]);
+        OUTPUT_PRINT("%s on %s %s", args[i].test->test_name, args[i].name, args[i].passed ? "PASSED" : "FAILED");
+        bRet = bRet && args[i].passed;
+    }
+    return bRet;
+}
 
-    //start reading 
+//The ADTS leak rates, read once a minute
+bool control_read_leak_rates(const LeakTest *test, const ADTS *adts)
+{
     OUTPUT_PRINT("Beginning leak rate readings, updates every minute");    
     uint64_t start = time_in_ms();
     bool bRet = false;
@@ -489,6 +765,105 @@ bool control_run_leak_test(const LeakTest *test)
             }
         }        
     }
+    return bRet;
+}
+
+//Fit the sampled pressures, decided as soon as the confidence intervals clear the tolerances. starved if the sampler
+//doesn't deliver enough samples to fit
+bool control_estimate_leak(const LeakTest *test, TelemetrySampler *sampler, const char *ps_units, const char *pt_units, bool *starved)
+{
+    OUTPUT_PRINT("Beginning leak rate estimation from pressure samples, updates every %d seconds", LEAK_UPDATE_MS / 1000);
+    LeakEstimator le;
+    TelemetryReader reader;
+    TelemetrySample sample;
+    struct timespec ts;
+    leak_init(&le, test->ps_tolerance, test->pt_tolerance);
+    telemetry_reader_init(&reader, sampler);
+
+    LEAK result = LEAK_PENDING;
+    uint64_t last_update = le.start_ms;
+    while(((time_in_ms() - le.start_ms) < LEAK_READINGS_MS) && (result == LEAK_PENDING))
+    {
+        SLEEP_MS(&ts, LEAK_CHECK_MS);
+        while(telemetry_read(&reader, &sample))
+            leak_add(&le, &sample);
+        if((*starved = leak_starved(&le)))
+        {
+            ERROR_PRINT("Only %u pressure samples in %d seconds, reading the ADTS leak rates instead", le.ps.n, (int)((time_in_ms() - le.start_ms) / 1000));
+            return false;
+        }
+        result = leak_evaluate(&le);
+
+        if((result == LEAK_PENDING) && ((time_in_ms() - last_update) >= LEAK_UPDATE_MS))
+        {
+            leak_report(&le, ps_units, pt_units);
+            last_update = time_in_ms();
+        }
+    }
+
+    leak_report(&le, ps_units, pt_units);
+    if(result == LEAK_PASS)
+        OUTPUT_PRINT("PS and PT LEAK RATE within tolerance");
+    else if(result == LEAK_FAIL)
+        OUTPUT_PRINT("LEAK RATE not within tolerance");
+    else
+        OUTPUT_PRINT("LEAK RATE could not be decided in %d seconds", LEAK_READINGS_MS / 1000);
+    return result == LEAK_PASS;
+}
+
+bool control_run_leak_test_full(LeakTest *test, const ADTS *adts)
+{
+
+    //assert we are at ground
+    command_GTG_eventually(adts->fd);
+
+    //get the unit controlling
+    if(!control_run_test_full((ControlTest*)test, adts->fd, NULL))
+        return false;
+
+    OUTPUT_PRINT("System is stable, start leak test stabilizing for %s minutes %s seconds", test->delay_minutes, test->delay_seconds);
+
+    //set the tolerances for display
+    if(!leak_test_set_tolerances(adts, ":LEAK:PSTOL", ":LEAK:PSTOL?", test->ps_tolerance))
+        return false;
+    if(!leak_test_set_tolerances(adts, ":LEAK:PTTOL", ":LEAK:PTTOL?", test->pt_tolerance))
+        return false;
+
+    //set the delay
+    char delay[32];
+    snprintf(delay, sizeof(delay), "%s, %s", test->delay_minutes, test->delay_seconds);
+    char delay_cmd[64];
+    snprintf(delay_cmd, sizeof(delay_cmd), ":LEAK:DELAY %s", delay);
+    if(!serial_fd_do(adts->fd, delay_cmd, NULL, 0, NULL))
+        return false;
+    if(!command_and_check_result_str_fd(adts->fd, ":LEAK:DELAY?", delay))
+        return false;
+
+    //start running the leak test
+    if(!serial_fd_do(adts->fd, ":LEAK:RUN ON", NULL, 0, NULL))
+        return false;
+    if((!command_and_check_result_str_fd(adts->fd, ":LEAK:RUN?", "DELAY"))&&(!command_and_check_result_str_fd(adts->fd, ":LEAK:RUN?", "ON")))
+        return false;
+
+    //wait for the delay period, there is no need to check before it should be over
+    PollCadence cadence;
+    cadence_init(&cadence, "leak delay", NULL);
+    const uint64_t delay_ms = (strtoull(test->delay_minutes, NULL, 10) * 60 + strtoull(test->delay_seconds, NULL, 10)) * 1000;
+    while(!command_and_check_result_str_fd(adts->fd, ":LEAK:RUN?", "ON"))
+    {
+        cadence_sleep(&cadence, cadence_deadline_interval(&cadence, delay_ms));
+    }
+    cadence_report(&cadence, true);
+
+
+    //start reading 
+    const char *ps_units, *pt_units, *ps_rate_units_part, *pt_rate_units_part;
+    control_set_units(test->units, &ps_units, &pt_units, &ps_rate_units_part, &pt_rate_units_part);
+    TelemetrySampler *sampler = control_get_sampler(adts->fd, ps_units, pt_units);
+    bool starved = false;
+    bool bRet = (sampler != NULL) && control_estimate_leak(test, sampler, ps_units, pt_units, &starved);
+    if((sampler == NULL) || starved)
+        bRet = control_read_leak_rates(test, adts);
 
     //stop leak testing
     if(!serial_fd_do(adts->fd, ":LEAK:RUN OFF", NULL, 0, NULL))
@@ -2,6 +2,9 @@
 //Controlling
 #include <stdint.h>
 #include "test.h"
+#include "cadence.h"
+#include "response.h"
+#include "telemetry.h"
 
 typedef enum {
     CTRL_UNITS_FK   = 1 << 0,
@@ -22,9 +25,14 @@ typedef enum {
     const char *ps_rate; \
     const char *pt; \
     const char *pt_rate; \
+    StepResponse response; \
 }
 typedef _ControlTest ControlTest;
-bool control_run_test(const ControlTest *test);
+bool control_run_test(ControlTest *test);
+void control_set_cross_check(const bool enable);
+//The mode and units of a test's control_setup, ahead of the test and undone if it doesn't run
+bool control_prepare(const int adts_fd, const CTRL_UNITS units);
+void control_prepare_end(const bool undo);
 
 
 typedef struct LeakTest {
@@ -35,7 +43,15 @@ typedef struct LeakTest {
     const char *delay_seconds;
     bool testing_master_unit;
 } LeakTest;
-bool control_run_leak_test(const LeakTest *test);
+bool control_run_leak_test(LeakTest *test);
+
+//Two leak tests run at the same time, one on each unit
+typedef struct LeakPairTest {
+    _TEST;
+    LeakTest *master_test;
+    LeakTest *slave_test;
+} LeakPairTest;
+bool control_run_leak_test_pair(LeakPairTest *test);
 
 
 typedef struct SingleChannelTest {
@@ -51,13 +67,27 @@ typedef struct SingleChannelTest {
         const char *ps_rate;
         const char *pt_rate;
     };    
+    const double expected_rate;   //measured by the other unit, units per minute
+    const double rate_tolerance;
+    StepResponse response;
 } SingleChannelTest;
-bool control_single_channel_test(const SingleChannelTest *test);
+bool control_single_channel_test(SingleChannelTest *test);
 
 
 typedef bool (*Control_On_Error)(const int fd);
 typedef bool (*Control_Start_Func)(const int fd);
-typedef bool (*Control_EachCycle)(bool *result);
+//What the cycle function made of the run so far, it is called one final time at the setpoint
+typedef enum {
+    CYCLE_CONTINUE = 0,
+    CYCLE_DONE     = 1 << 0,
+    CYCLE_FAIL     = 1 << 1
+} CYCLE;
+typedef CYCLE (*Control_EachCycle)(void *ctx, const bool final);
+
+//Shared with the control state machine
+TelemetrySampler *control_get_sampler(const int adts_fd, const char *ps_units, const char *pt_units);
+const char *control_adts_sn(const int adts_fd);
+void control_take_snapshot(const int adts_fd, const char *ps_units, const char *pt_units, StatusSnapshot *snapshot);
 
-bool control(const uint64_t exp_time, const char *ps_units, const char *pt_units, OPR success_mask, Control_Start_Func start_func, Control_On_Error on_error, Control_EachCycle cycle_func, const int adts_fd);
+bool control(const uint64_t exp_time, const char *ps_units, const char *pt_units, const ControlTarget *target, StepResponse *response, OPR success_mask, Control_Start_Func start_func, Control_On_Error on_error, Control_EachCycle cycle_func, void *cycle_ctx, const int adts_fd);
 
@@ -0,0 +1,103 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "leak.h"
+#include "utility.h"
+
+#define log_leak(fmt, ...) log_format_line(FDM_TEST_LOG, "LEAK|" fmt, ##__VA_ARGS__)
+
+//no decision before LEAK_MIN_MS and LEAK_MIN_SAMPLES, the interval is LEAK_CONFIDENCE standard errors wide on each side.
+//Consecutive samples are correlated, so it is wider than a textbook 95% interval
+#define LEAK_MIN_MS         20000
+#define LEAK_MIN_SAMPLES    30
+#define LEAK_CONFIDENCE     3.0
+
+static inline void leak_fit_add(LeakFit *fit, const double t, const double y);
+static inline bool leak_fit_evaluate(LeakFit *fit);
+
+void leak_init(LeakEstimator *le, const double ps_tolerance, const double pt_tolerance)
+{
+    memset(le, 0, sizeof(*le));
+    le->start_ms = time_in_ms();
+    le->ps_tolerance = ps_tolerance;
+    le->pt_tolerance = pt_tolerance;
+}
+
+void leak_fit_add(LeakFit *fit, const double t, const double y)
+{
+    if(fit->n == 0)
+    {
+        fit->t0 = t;
+        fit->y0 = y;
+    }
+    const double dt = t - fit->t0;
+    const double dy = y - fit->y0;
+    fit->n++;
+    fit->st += dt;
+    fit->sy += dy;
+    fit->stt += dt * dt;
+    fit->sty += dt * dy;
+    fit->syy += dy * dy;
+}
+
+void leak_add(LeakEstimator *le, const TelemetrySample *sample)
+{
+    if(sample->time_ms < le->start_ms)
+        return;
+    const double t = (double)(sample->time_ms - le->start_ms) / 60000.0;
+    leak_fit_add(&le->ps, t, sample->ps);
+    leak_fit_add(&le->pt, t, sample->pt);
+}
+
+//Slope and its standard error from the running sums
+bool leak_fit_evaluate(LeakFit *fit)
+{
+    if(fit->n < 3)
+        return false;
+
+    const double n = fit->n;
+    const double Stt = fit->stt - (fit->st * fit->st) / n;
+    const double Sty = fit->sty - (fit->st * fit->sy) / n;
+    const double Syy = fit->syy - (fit->sy * fit->sy) / n;
+    if(Stt <= 0)
+        return false;
+
+    fit->rate = Sty / Stt;
+    const double sse = fmax(Syy - fit->rate * Sty, 0);
+    fit->ci = LEAK_CONFIDENCE * sqrt((sse / (n - 2)) / Stt);
+    return true;
+}
+
+//Passes once both intervals are inside their tolerance, fails as soon as one is outside
+LEAK leak_evaluate(LeakEstimator *le)
+{
+    const uint64_t elapsed = time_in_ms() - le->start_ms;
+    if(!leak_fit_evaluate(&le->ps) || !leak_fit_evaluate(&le->pt))
+        return LEAK_PENDING;
+
+    log_leak("t=%llu|n=%u|ps rate=%f ci=%f|pt rate=%f ci=%f", (long long unsigned)elapsed, le->ps.n, le->ps.rate, le->ps.ci, le->pt.rate, le->pt.ci);
+    if((elapsed < LEAK_MIN_MS) || (le->ps.n < LEAK_MIN_SAMPLES))
+        return LEAK_PENDING;
+
+    if(((fabs(le->ps.rate) - le->ps.ci) > le->ps_tolerance) || ((fabs(le->pt.rate) - le->pt.ci) > le->pt_tolerance))
+        return LEAK_FAIL;
+    if(((fabs(le->ps.rate) + le->ps.ci) <= le->ps_tolerance) && ((fabs(le->pt.rate) + le->pt.ci) <= le->pt_tolerance))
+        return LEAK_PASS;
+    return LEAK_PENDING;
+}
+
+//Past the time it needs, still too few samples to fit, the sampler has stalled
+bool leak_starved(const LeakEstimator *le)
+{
+    return ((time_in_ms() - le->start_ms) >= LEAK_MIN_MS) && (le->ps.n < LEAK_MIN_SAMPLES);
+}
+
+void leak_report(const LeakEstimator *le, const char *ps_units, const char *pt_units)
+{
+    OUTPUT_PRINT("LEAK RATE - PS: %f +/- %f %s/MIN (tolerance %f) PT: %f +/- %f %s/MIN (tolerance %f), %u samples over %llu s",
+        le->ps.rate, le->ps.ci, ps_units, le->ps_tolerance, le->pt.rate, le->pt.ci, pt_units, le->pt_tolerance,
+        le->ps.n, (long long unsigned)((time_in_ms() - le->start_ms) / 1000));
+}
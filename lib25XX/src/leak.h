@@ -0,0 +1,41 @@
+#pragma once
+//Leak rate from a straight line fit of the sampled pressures, updated with every sample
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "telemetry.h"
+
+typedef enum {
+    LEAK_PENDING = 0,
+    LEAK_PASS    = 1 << 0,
+    LEAK_FAIL    = 1 << 1
+} LEAK;
+
+//Running sums of t (minutes) and pressure, both relative to the first sample to keep the sums small
+typedef struct LeakFit {
+    uint32_t n;
+    double   t0;
+    double   y0;
+    double   st;
+    double   sy;
+    double   stt;
+    double   sty;
+    double   syy;
+    //last evaluation, units per minute
+    double   rate;
+    double   ci;    //half width of the confidence interval of rate
+} LeakFit;
+
+typedef struct LeakEstimator {
+    uint64_t start_ms;
+    double   ps_tolerance;
+    double   pt_tolerance;
+    LeakFit  ps;
+    LeakFit  pt;
+} LeakEstimator;
+
+void leak_init(LeakEstimator *le, const double ps_tolerance, const double pt_tolerance);
+void leak_add(LeakEstimator *le, const TelemetrySample *sample);
+LEAK leak_evaluate(LeakEstimator *le);
+bool leak_starved(const LeakEstimator *le);
+void leak_report(const LeakEstimator *le, const char *ps_units, const char *pt_units);
@@ -1,5 +1,8 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
 
 #include "utility.h"
 #include "test.h"
@@ -7,6 +10,31 @@
 #include "command.h"
 #include "lsu.h"
 
+#define log_lsu(fmt, ...) log_format_line(FDM_TEST_LOG, "LSU|" fmt, ##__VA_ARGS__)
+
+#define LSU_NUM_VALVES 8
+#define LSU_NOT_FITTED "*** Not Fitted***"
+
+//Valves the last batch exercised with the operator confirming the lights, their own test only reads them back once.
+//Forgotten when the run ends or the table is loaded again
+static bool LSU_Batch_Verified[LSU_NUM_VALVES];
+
+//The checks of the valve tests that need no operator, done in the background while a unit ramps
+typedef struct LSUPrecheck {
+    uint64_t done_ms;   //0 until the checks are done
+    bool post;
+    bool num_valves;
+    bool selftest;
+    bool fitted[LSU_NUM_VALVES];
+    bool no_error[LSU_NUM_VALVES];
+} LSUPrecheck;
+//older results are checked again
+#define LSU_PRECHECK_MAX_AGE_MS 600000
+
+static LSUPrecheck LSU_Precheck;
+static pthread_t   LSU_Precheck_Thread;
+static bool        LSU_Precheck_Started; //a thread to join, only touched by the thread running the tests
+
 static inline bool lsu_check_valve_state(const char *valve, const char *expected_state)
 {
     char valve_state_cmd[32];
@@ -37,9 +65,11 @@ static inline bool lsu_check_POST()
     snprintf(cmd, sizeof(cmd), "*TST?");
     if(!command_and_check_result_str_fd(serial_get_SDM()->lsu.fd, cmd, "1"))
     {
-         char buf[256];
-         serial_fd_do(serial_get_SDM()->lsu.fd, "SYST:ERR?", buf, sizeof(buf), NULL);
-         ERROR_PRINT("LSU POST failed with: %s", buf);
+         SCPIErrorQueue errq;
+         serial_drain_error_queue(serial_get_SDM()->lsu.fd, &errq);
+         ERROR_PRINT("LSU POST failed with %d queued errors", errq.count);
+         for(int i = 0; i < errq.count; i++)
+             ERROR_PRINT("LSU POST error: %d,\"%s\"", errq.errors[i].code, errq.errors[i].message);
          return false;
     }
     return true;
@@ -77,54 +107,266 @@ static inline bool lsu_set_valve_state(const char *valve, const char *state)
     return lsu_check_valve_state(valve, state);
 }
 
+//One query per valve for each of the queries in one compound exchange, fields[q*LSU_NUM_VALVES + v] is valve v+1
+static bool lsu_query_all_valves(const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields)
+{
+    char cmds[SERIAL_COMPOUND_MAX][32];
+    const char *cmd_ptrs[SERIAL_COMPOUND_MAX];
+    const int num_cmds = num_queries * LSU_NUM_VALVES;
+    assert(num_cmds <= SERIAL_COMPOUND_MAX);
+    for(int i = 0; i < num_cmds; i++)
+    {
+        snprintf(cmds[i], sizeof(cmds[i]), "%s %d", queries[i / LSU_NUM_VALVES], (i % LSU_NUM_VALVES) + 1);
+        cmd_ptrs[i] = cmds[i];
+    }
+    if(serial_fd_query_compound(serial_get_SDM()->lsu.fd, cmd_ptrs, num_cmds, buf, bufsize, fields) != num_cmds)
+    {
+        ERROR_PRINT("Unable to read the state of all the valves");
+        return false;
+    }
+    return true;
+}
+
+//Configuration and error of every valve in one exchange
+static bool lsu_read_valves(LSUPrecheck *pc)
+{
+    static const char *const queries[] = {"OUTP:VALV:CONF?", "OUTP:VALV:ERR?"};
+    char buf[512];
+    char *fields[SERIAL_COMPOUND_MAX];
+    if(!lsu_query_all_valves(queries, LENGTH_2D(queries), buf, sizeof(buf), fields))
+        return false;
+    for(int v = 0; v < LSU_NUM_VALVES; v++)
+    {
+        pc->fitted[v] = strcmp(fields[v], LSU_NOT_FITTED) != 0;
+        pc->no_error[v] = strcmp(fields[LSU_NUM_VALVES + v], "0") == 0;
+    }
+    return true;
+}
+
+static void *lsu_precheck_thread(void *arg)
+{
+    (void)arg;
+    LSUPrecheck *pc = &LSU_Precheck;
+    const uint64_t start_ms = time_in_ms();
+    log_set_unit("LSU", FDM_INVALID);
+    pc->post = serial_fd_do(serial_get_SDM()->lsu.fd, "*CLS", NULL, 0, NULL) && lsu_check_POST();
+    pc->num_valves = lsu_check_num_valves();
+    pc->selftest = lsu_run_selftest();
+    if(lsu_read_valves(pc))
+        pc->done_ms = time_in_ms();
+    log_lsu("precheck|post=%d|valves=%d|selftest=%d|read=%d|t=%llu", pc->post, pc->num_valves, pc->selftest, pc->done_ms != 0,
+        (long long unsigned)(time_in_ms() - start_ms));
+    log_set_unit(NULL, FDM_INVALID);
+    return NULL;
+}
+
+//Starts the checks on their own thread, unless recent results are there already
+void lsu_precheck_start(void)
+{
+    if(LSU_Precheck_Started || ((LSU_Precheck.done_ms != 0) && ((time_in_ms() - LSU_Precheck.done_ms) < LSU_PRECHECK_MAX_AGE_MS)))
+        return;
+    memset(&LSU_Precheck, 0, sizeof(LSU_Precheck));
+    LSU_Precheck_Started = (pthread_create(&LSU_Precheck_Thread, NULL, &lsu_precheck_thread, NULL) == 0);
+}
+
+void lsu_batch_forget(void)
+{
+    memset(LSU_Batch_Verified, 0, sizeof(LSU_Batch_Verified));
+}
+
+void lsu_precheck_wait(void)
+{
+    if(!LSU_Precheck_Started)
+        return;
+    pthread_join(LSU_Precheck_Thread, NULL);
+    LSU_Precheck_Started = false;
+}
+
+//The background results if they are recent, NULL to check now
+static const LSUPrecheck *lsu_precheck_get(void)
+{
+    lsu_precheck_wait();
+    if((LSU_Precheck.done_ms == 0) || ((time_in_ms() - LSU_Precheck.done_ms) >= LSU_PRECHECK_MAX_AGE_MS))
+        return NULL;
+    return &LSU_Precheck;
+}
+
+static inline void lsu_precheck_report(const LSUPrecheck *pc)
+{
+    OUTPUT_PRINT("Using the LSU checks done %llu s ago while the unit ramped", (long long unsigned)((time_in_ms() - pc->done_ms) / 1000));
+}
+
+//State and error of every valve in one exchange, a valve that doesn't match is marked in ok
+static bool lsu_check_all_valves(const char *expected_state, bool *ok)
+{
+    static const char *const queries[] = {"OUTP:VALV:STAT?", "OUTP:VALV:ERR?"};
+    char buf[512];
+    char *fields[SERIAL_COMPOUND_MAX];
+    if(!lsu_query_all_valves(queries, LENGTH_2D(queries), buf, sizeof(buf), fields))
+        return false;
+
+    bool bRet = true;
+    for(int v = 0; v < LSU_NUM_VALVES; v++)
+    {
+        if(strcmp(fields[v], expected_state) != 0)
+        {
+            ERROR_PRINT("Valve %d is in unexpected state %s", v+1, fields[v]);
+            ok[v] = false;
+        }
+        if(strcmp(fields[LSU_NUM_VALVES + v], "0") != 0)
+        {
+            ERROR_PRINT("Valve %d has a possible error", v+1);
+            ok[v] = false;
+        }
+        bRet &= ok[v];
+    }
+    return bRet;
+}
+
+//Fitted, closed and working correctly, in one exchange
+static bool lsu_check_valve_ready(const char *valve)
+{
+    char cmds[3][32], buf[128];
+    char *fields[3];
+    snprintf(cmds[0], sizeof(cmds[0]), "OUTP:VALV:CONF? %s", valve);
+    snprintf(cmds[1], sizeof(cmds[1]), "OUTP:VALV:STAT? %s", valve);
+    snprintf(cmds[2], sizeof(cmds[2]), "OUTP:VALV:ERR? %s", valve);
+    const char *const queries[3] = {cmds[0], cmds[1], cmds[2]};
+    if(serial_fd_query_compound(serial_get_SDM()->lsu.fd, queries, 3, buf, sizeof(buf), fields) != 3)
+        return false;
+    if(strcmp(fields[0], LSU_NOT_FITTED) == 0)
+    {
+        ERROR_PRINT("Valve %s is not fitted",  valve);
+        return false;
+    }   
+    if(strcmp(fields[1], "CLOSE") != 0)
+    {
+        ERROR_PRINT("Valve %s is in unexpected state",  valve);
+        return false;
+    }
+    if(strcmp(fields[2], "0") != 0)
+    {
+        ERROR_PRINT("Valve %s has a possible error",  valve);
+        return false;
+    }
+    return true;
+}
+
+//Cycle all the valves together, the operator is only asked about the lights once for open and once for closed
+static bool lsu_batch_valve_test(const LSUPrecheck *pc)
+{
+    const int fd = serial_get_SDM()->lsu.fd;
+    const uint64_t start_ms = time_in_ms();
+    bool ok[LSU_NUM_VALVES];
+    memset(LSU_Batch_Verified, 0, sizeof(LSU_Batch_Verified));
+    for(int v = 0; v < LSU_NUM_VALVES; v++)
+        ok[v] = true;
+
+    if(!serial_fd_do(fd, "OUTP:ALL CLOSE", NULL, 0, NULL))
+        return false;
+
+    //fitted and working
+    LSUPrecheck now;
+    if(pc == NULL)
+    {
+        if(!lsu_read_valves(&now))
+            return false;
+        pc = &now;
+    }
+    for(int v = 0; v < LSU_NUM_VALVES; v++)
+    {
+        if(!pc->fitted[v])
+        {
+            ERROR_PRINT("Valve %d is not fitted", v+1);
+            ok[v] = false;
+        }
+        if(!pc->no_error[v])
+        {
+            ERROR_PRINT("Valve %d has a possible error", v+1);
+            ok[v] = false;
+        }
+    }
+
+    OUTPUT_PRINT("Opening all the valves");
+    if(!serial_fd_do(fd, "OUTP:ALL OPEN", NULL, 0, NULL))
+        return false;
+    lsu_check_all_valves("OPEN", ok);
+    const bool lights_on = operator_confirm("Are the indicator lights for all the valves turned on? ");
+
+    OUTPUT_PRINT("Closing all the valves");
+    if(!serial_fd_do(fd, "OUTP:ALL CLOSE", NULL, 0, NULL))
+        return false;
+    bool bRet = lsu_check_all_valves("CLOSE", ok);
+    const bool lights_off = lights_on && operator_confirm("Are the indicator lights for all the valves turned off? ");
+
+    //the lights are confirmed for all or none, a valve that failed gets its own test to find out more
+    int verified = 0;
+    for(int v = 0; v < LSU_NUM_VALVES; v++)
+    {
+        LSU_Batch_Verified[v] = ok[v] && lights_off;
+        verified += LSU_Batch_Verified[v];
+    }
+    log_lsu("batch|verified=%d/%d|lights=%d|t=%llu", verified, LSU_NUM_VALVES, lights_off, (long long unsigned)(time_in_ms() - start_ms));
+    return bRet && lights_off;
+}
+
 bool lsu_valve_test(const LSUValveTest *lsu_valve_test)
 {
     if(!serial_fd_do(serial_get_SDM()->lsu.fd, "*CLS", NULL, 0, NULL))
         return false;
 
+    const LSUPrecheck *pc = lsu_precheck_get();
+
     //If valve_number is ALL, check values pertaining to all valves
     if(strncmp("ALL", lsu_valve_test->valve_number, strlen("ALL")+1) == 0)
     {
-        if(!lsu_check_POST())
+        //the precheck reported its own failures
+        if(pc != NULL)
+            lsu_precheck_report(pc);
+        if((pc != NULL) && !(pc->post && pc->num_valves && pc->selftest))
             return false;
 
-        if(!lsu_check_num_valves())
+        if((pc == NULL) && !lsu_check_POST())
             return false;
-        
-        if(!lsu_run_selftest())
-            return false;
-        
-        //open all the valves
-        if(!serial_fd_do(serial_get_SDM()->lsu.fd, "OUTP:ALL OPEN", NULL, 0, NULL))
+
+        if((pc == NULL) && !lsu_check_num_valves())
             return false;
         
-        //close all the valves
-        if(!serial_fd_do(serial_get_SDM()->lsu.fd, "OUTP:ALL CLOSE", NULL, 0, NULL))
+        if((pc == NULL) && !lsu_run_selftest())
             return false;
         
-        
-        return true;
+        return lsu_batch_valve_test(pc);
+    }
+
+    const int valve = atoi(lsu_valve_test->valve_number);
+    if((valve >= 1) && (valve <= LSU_NUM_VALVES) && LSU_Batch_Verified[valve-1])
+    {
+        //run again with Previous it is tested on its own
+        LSU_Batch_Verified[valve-1] = false;
+        OUTPUT_PRINT("Valve %s was verified with all the valves, reading it back", lsu_valve_test->valve_number);
+        return lsu_check_valve_ready(lsu_valve_test->valve_number);
     }
     
     OUTPUT_PRINT("Verifying valve %s status", lsu_valve_test->valve_number);    
 
-    char cmd[32], result[32];
-    //check to see if the valve is fitted
-    snprintf(cmd, sizeof(cmd), "OUTP:VALV:CONF? %s", lsu_valve_test->valve_number);
-    if(!serial_fd_do(serial_get_SDM()->lsu.fd, cmd, result, sizeof(result), NULL))
-        return false;
-    if(strncmp(result, "*** Not Fitted***", strlen("*** Not Fitted***")+1) == 0)
+    //fitted, closed because we closed all the valves to start, and working correctly
+    if((pc != NULL) && (valve >= 1) && (valve <= LSU_NUM_VALVES))
     {
-        ERROR_PRINT("Valve %s is not fitted",  lsu_valve_test->valve_number);
-        return false;
-    }   
-    
-    //assert it reports that it is closed because we closed all the valves to start
-    if(!lsu_check_valve_state(lsu_valve_test->valve_number, "CLOSE"))
-        return false;
- 
-    //check if the valve is working correctly
-    if(!lsu_check_err(lsu_valve_test->valve_number))
+        lsu_precheck_report(pc);
+        if(!pc->fitted[valve-1])
+        {
+            ERROR_PRINT("Valve %s is not fitted",  lsu_valve_test->valve_number);
+            return false;
+        }
+        if(!pc->no_error[valve-1])
+        {
+            ERROR_PRINT("Valve %s has a possible error",  lsu_valve_test->valve_number);
+            return false;
+        }
+        if(!lsu_check_valve_state(lsu_valve_test->valve_number, "CLOSE"))
+            return false;
+    }
+    else if(!lsu_check_valve_ready(lsu_valve_test->valve_number))
         return false;
 
     //Attempt to open the valve
@@ -137,13 +379,8 @@ bool lsu_valve_test(const LSUValveTest *lsu_valve_test)
         return false;
 
     //Confirm it actually opened
-    OUTPUT_PRINT("Is the indicator light for valve %s turned on? ", lsu_valve_test->valve_number);    
-    if(!Yes_No())
-    {
-        OUTPUT_PRINT("No");
+    if(!operator_confirm("Is the indicator light for valve %s turned on? ", lsu_valve_test->valve_number))
         return false;
-    }    
-    OUTPUT_PRINT("Yes");
 
 
     //Attempt to close the valve
@@ -156,13 +393,8 @@ bool lsu_valve_test(const LSUValveTest *lsu_valve_test)
         return false;
 
     //Confirm it actually closed
-    OUTPUT_PRINT("Is the indicator light for valve %s turned off? ", lsu_valve_test->valve_number);    
-    if(!Yes_No())
-    {
-        OUTPUT_PRINT("No");
+    if(!operator_confirm("Is the indicator light for valve %s turned off? ", lsu_valve_test->valve_number))
         return false;
-    }    
-    OUTPUT_PRINT("Yes");
 
     return true;
 }
\ No newline at end of file
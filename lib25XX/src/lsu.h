@@ -5,4 +5,10 @@ typedef struct LSUValveTest {
     _TEST;
     const char *valve_number;    
 } LSUValveTest;
-bool lsu_valve_test(const LSUValveTest *lsu_valve_test);
\ No newline at end of file
+bool lsu_valve_test(const LSUValveTest *lsu_valve_test);
+//The valves the ALL test verified are tested in full again
+void lsu_batch_forget(void);
+
+//The checks of the valve tests that need no operator, on their own thread while a unit ramps
+void lsu_precheck_start(void);
+void lsu_precheck_wait(void);
@@ -0,0 +1,329 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "machine.h"
+#include "status.h"
+#include "serial.h"
+#include "utility.h"
+
+#define log_machine(fmt, ...) log_format_line(FDM_TEST_LOG, "MACHINE|" fmt, ##__VA_ARGS__)
+
+#define SETPOINT_REACHED_TEXT "Setpoint reached, verifying it remains STABLE for up to 30 seconds"
+
+//Stability is checked on the sampled pressure over a sliding window, the ADTS status is still checked every second
+#define VERIFY_STABLE_MS      30000
+#define VERIFY_WINDOW_MS      10000
+#define VERIFY_CHECK_MS       1000
+
+//polls at least this often when there is a cycle hook
+#define CYCLE_MAX_MS          1000
+
+static inline void machine_enter(ControlMachine *cm, const CM_STATE state, const uint64_t due_ms);
+static inline void machine_drain(ControlMachine *cm);
+static void machine_execute(ControlMachine *cm);
+static void machine_ramp(ControlMachine *cm);
+static void machine_at_goal(ControlMachine *cm);
+static void machine_verify_start(ControlMachine *cm);
+static void machine_verify_step(ControlMachine *cm);
+static void machine_verify_finish(ControlMachine *cm, const bool lost);
+
+static const char *State_Names[] = {"IDLE", "EXECUTING", "RAMPING", "AT_GOAL", "VERIFY_STABLE", "ERROR_RECOVERY", "TIMEOUT", "DONE", "FAILED"};
+
+void machine_init(ControlMachine *cm, const int adts_fd, const uint64_t exp_time, const char *ps_units, const char *pt_units, const ControlTarget *target,
+    StepResponse *response, const OPR success_mask, const ControlHooks *hooks)
+{
+    memset(cm, 0, sizeof(*cm));
+    cm->adts_fd = adts_fd;
+    cm->name = control_adts_sn(adts_fd);
+    cm->exp_time = (exp_time == 0) ? UINT64_MAX : exp_time;
+    cm->ps_units = ps_units;
+    cm->pt_units = pt_units;
+    cm->target = target;
+    cm->response = response;
+    cm->success_mask = success_mask;
+    if(hooks != NULL)
+        cm->hooks = *hooks;
+    cm->cycle = CYCLE_CONTINUE;
+    cm->state = CM_EXECUTING;
+    cm->due_ms = time_in_ms();
+}
+
+//Once at the goal, verify the setpoint stays stable before the machine is done
+void machine_verify(ControlMachine *cm, const OPR opr, const CTRL_OP channels)
+{
+    cm->verify_opr = opr;
+    cm->verify_channels = channels;
+}
+
+//Keep compare up to date while the machine runs, NULL for none
+void machine_compare(ControlMachine *cm, CrossCompare *compare)
+{
+    cm->compare = compare;
+}
+
+bool machine_finished(const ControlMachine *cm)
+{
+    return (cm->state == CM_DONE) || (cm->state == CM_FAILED);
+}
+
+void machine_enter(ControlMachine *cm, const CM_STATE state, const uint64_t due_ms)
+{
+    if(state != cm->state)
+        log_machine("%s|%s->%s|t=%llu", cm->name, State_Names[cm->state], State_Names[state], (long long unsigned)(time_in_ms() - cm->start_ms));
+    //the operator isn't asked anything in the middle of a ramp
+    if((state == CM_RAMPING) && (cm->state != CM_RAMPING))
+        operator_queue_hold();
+    else if((state != CM_RAMPING) && (cm->state == CM_RAMPING))
+        operator_queue_release();
+    cm->state = state;
+    cm->due_ms = due_ms;
+}
+
+void machine_drain(ControlMachine *cm)
+{
+    TelemetrySample sample;
+    while(telemetry_read(&cm->reader, &sample))
+    {
+        if(cm->response != NULL)
+            step_response_add(cm->response, &sample);
+        if(cm->predict && (cm->state == CM_RAMPING))
+            predict_add(&cm->predictor, &sample);
+        if(cm->stability != NULL)
+            stability_add(cm->stability, &sample);
+    }
+    if(cm->compare != NULL)
+        compare_update(cm->compare);
+}
+
+//Everything is set up before EXEC, it blocks for a while and the response starts with the command
+void machine_execute(ControlMachine *cm)
+{
+    TelemetrySample sample;
+    TelemetrySampler *sampler = control_get_sampler(cm->adts_fd, cm->ps_units, cm->pt_units);
+    const bool have_initial = (sampler != NULL) && telemetry_latest(sampler, TELEMETRY_MAX_AGE_MS, &sample);
+    telemetry_reader_init(&cm->reader, sampler);
+    cm->predict = (sampler != NULL) && predict_init(&cm->predictor, cm->target, cm->exp_time, cm->ps_units, cm->pt_units);
+
+    if(cm->response != NULL)
+        step_response_start(cm->response, have_initial ? &sample : NULL);
+
+    bool started = true;
+    if(cm->hooks.start == NULL)
+        serial_fd_do(cm->adts_fd, ":CONT:EXEC", NULL, 0, NULL);
+    else
+        started = cm->hooks.start(cm->adts_fd);
+    cm->start_ms = time_in_ms();
+    cadence_init(&cm->cadence, "control", cm->target);
+    //a start that didn't go through gets the error recovery, or fails without one
+    machine_enter(cm, started ? CM_RAMPING : CM_ERROR_RECOVERY, cm->start_ms);
+}
+
+//One poll, status and pressure in one round trip. While not at the goal, poll more often the closer it is to the setpoint
+void machine_ramp(ControlMachine *cm)
+{
+    StatusSnapshot snapshot;
+    control_take_snapshot(cm->adts_fd, cm->ps_units, cm->pt_units, &snapshot);
+    machine_drain(cm);
+
+    const STATUS st = status_check_snapshot(cm->success_mask, &snapshot, cm->adts_fd);
+    if(st == ST_ERR)
+    {
+        machine_enter(cm, CM_ERROR_RECOVERY, time_in_ms());
+        return;
+    }
+    status_dump_pressure_data_if_different(&snapshot, cm->ps_units, cm->pt_units, cm->adts_fd);
+
+    if(st == ST_AT_GOAL)
+    {
+        machine_enter(cm, CM_AT_GOAL, time_in_ms());
+        return;
+    }
+
+    if((time_in_ms() - cm->start_ms) > cm->exp_time)
+    {
+        machine_enter(cm, CM_TIMEOUT, time_in_ms());
+        return;
+    }
+
+    //don't wait out the whole duration for a unit that can't make it
+    if(cm->predict && (predict_evaluate(&cm->predictor) == PREDICT_LATE))
+    {
+        predict_report(&cm->predictor, cm->ps_units, cm->pt_units);
+        cadence_report(&cm->cadence, false);
+        machine_enter(cm, CM_FAILED, time_in_ms());
+        return;
+    }
+
+    //the cycle hook can decide the run before the goal
+    if(cm->hooks.cycle != NULL)
+    {
+        cm->cycle = cm->hooks.cycle(cm->hooks.cycle_ctx, false);
+        if(cm->cycle != CYCLE_CONTINUE)
+        {
+            cadence_report(&cm->cadence, cm->cycle == CYCLE_DONE);
+            machine_enter(cm, (cm->cycle == CYCLE_DONE) ? CM_DONE : CM_FAILED, time_in_ms());
+            return;
+        }
+    }
+
+    uint64_t interval = cadence_next_interval(&cm->cadence, &snapshot);
+    if((cm->hooks.cycle != NULL) && (interval > CYCLE_MAX_MS))
+        interval = CYCLE_MAX_MS;
+    machine_enter(cm, CM_RAMPING, cadence_schedule(&cm->cadence, interval));
+}
+
+void machine_at_goal(ControlMachine *cm)
+{
+    cadence_report(&cm->cadence, true);
+    if((cm->hooks.cycle != NULL) && (cm->hooks.cycle(cm->hooks.cycle_ctx, true) != CYCLE_DONE))
+        machine_enter(cm, CM_FAILED, time_in_ms());
+    else if(cm->verify_channels != 0)
+        machine_verify_start(cm);
+    else
+        machine_enter(cm, CM_DONE, time_in_ms());
+}
+
+//Passes early once the sampled pressure meets the stability criteria, fails on drift or if the ADTS drops out of opr.
+//Without samples or criteria it falls back to the ADTS staying stable for the whole VERIFY_STABLE_MS
+void machine_verify_start(ControlMachine *cm)
+{
+    OUTPUT_PRINT(SETPOINT_REACHED_TEXT);
+    if((cm->stability = malloc(sizeof(StabilityDetector))) == NULL)
+    {
+        machine_enter(cm, CM_FAILED, time_in_ms());
+        return;
+    }
+    stability_init(cm->stability, VERIFY_WINDOW_MS);
+
+    StabilityCriteria criteria;
+    cm->use_samples = (cm->target != NULL) && cm->target->valid;
+    if((cm->verify_channels & CTRL_OP_PS) && cm->use_samples && (cm->use_samples = stability_default_criteria(&criteria, cm->ps_units)))
+        stability_set_channel(&cm->stability->ps_channel, cm->target->ps, &criteria);
+    if((cm->verify_channels & CTRL_OP_PT) && cm->use_samples && (cm->use_samples = stability_default_criteria(&criteria, cm->pt_units)))
+        stability_set_channel(&cm->stability->pt_channel, cm->target->pt, &criteria);
+
+    TelemetrySampler *sampler = control_get_sampler(cm->adts_fd, cm->ps_units, cm->pt_units);
+    if(sampler == NULL)
+        cm->use_samples = false;
+    telemetry_reader_init(&cm->reader, sampler);
+
+    cm->stability_result = STABILITY_PENDING;
+    cadence_init(&cm->cadence, "verify stable", NULL);
+    machine_enter(cm, CM_VERIFY_STABLE, time_in_ms());
+}
+
+void machine_verify_step(ControlMachine *cm)
+{
+    if((time_in_ms() - cm->stability->start_ms) >= VERIFY_STABLE_MS)
+    {
+        machine_verify_finish(cm, false);
+        return;
+    }
+
+    if(status_check_event_registers(cm->verify_opr, cm->adts_fd) != ST_AT_GOAL)
+    {
+        machine_verify_finish(cm, true);
+        return;
+    }
+
+    machine_drain(cm);
+    if(cm->use_samples && ((cm->stability_result = stability_evaluate(cm->stability)) != STABILITY_PENDING))
+    {
+        machine_verify_finish(cm, false);
+        return;
+    }
+
+    const uint64_t interval = cm->use_samples ? VERIFY_CHECK_MS : cadence_deadline_interval(&cm->cadence, VERIFY_STABLE_MS);
+    cm->due_ms = cadence_schedule(&cm->cadence, interval);
+}
+
+void machine_verify_finish(ControlMachine *cm, const bool lost)
+{
+    bool bRet = !lost;
+    const STABILITY result = cm->stability_result;
+    if(result == STABILITY_DRIFT)
+    {
+        OUTPUT_PRINT("Failure, pressure is drifting from the setpoint");
+        bRet = false;
+    }
+    else if(result == STABILITY_STABLE)
+        OUTPUT_PRINT("Pressure is STABLE");
+
+    log_format_line(FDM_TEST_LOG, "STABILITY|%s|samples=%d|elapsed=%llu", (result == STABILITY_STABLE) ? "stable" : (result == STABILITY_DRIFT) ? "drift" : (bRet ? "timeout" : "lost"),
+        cm->stability->count, (long long unsigned)(time_in_ms() - cm->stability->start_ms));
+    cadence_report(&cm->cadence, bRet);
+    free(cm->stability);
+    cm->stability = NULL;
+    machine_enter(cm, bRet ? CM_DONE : CM_FAILED, time_in_ms());
+}
+
+//Advance the machine by one event, the caller steps it again at due_ms
+void machine_step(ControlMachine *cm)
+{
+    switch(cm->state)
+    {
+        case CM_EXECUTING:
+            machine_execute(cm);
+            break;
+        case CM_RAMPING:
+            machine_ramp(cm);
+            break;
+        case CM_AT_GOAL:
+            machine_at_goal(cm);
+            break;
+        case CM_VERIFY_STABLE:
+            machine_verify_step(cm);
+            break;
+        case CM_ERROR_RECOVERY:
+            if((cm->hooks.on_error != NULL) && cm->hooks.on_error(cm->adts_fd))
+                machine_enter(cm, CM_RAMPING, time_in_ms() + CADENCE_MIN_MS);
+            else
+                machine_enter(cm, CM_FAILED, time_in_ms());
+            break;
+        case CM_TIMEOUT:
+            OUTPUT_PRINT("Timeout, control not performed in %llu\n", (long long unsigned)cm->exp_time);
+            cadence_report(&cm->cadence, false);
+            machine_enter(cm, CM_FAILED, time_in_ms());
+            break;
+        default:
+            ERROR_PRINT("Control machine %s stepped in state %s", cm->name, State_Names[cm->state]);
+            machine_enter(cm, CM_FAILED, time_in_ms());
+            break;
+    }
+}
+
+//The scheduler, steps every machine that is due and sleeps until the next one is. True if they all finished DONE
+bool machine_run(ControlMachine **machines, const int count)
+{
+    struct timespec ts;
+    for(;;)
+    {
+        bool all_finished = true;
+        uint64_t next_ms = UINT64_MAX;
+        for(int i = 0; i < count; i++)
+        {
+            if(machine_finished(machines[i]))
+                continue;
+            if(time_in_ms() >= machines[i]->due_ms)
+                machine_step(machines[i]);
+            if(machine_finished(machines[i]))
+                continue;
+            all_finished = false;
+            if(machines[i]->due_ms < next_ms)
+                next_ms = machines[i]->due_ms;
+        }
+        if(all_finished)
+            break;
+
+        const uint64_t now = time_in_ms();
+        if(next_ms > now)
+            SLEEP_MS(&ts, next_ms - now);
+    }
+
+    bool bRet = true;
+    for(int i = 0; i < count; i++)
+        bRet = bRet && (machines[i]->state == CM_DONE);
+    return bRet;
+}
@@ -0,0 +1,68 @@
+#pragma once
+//Control of one ADTS as a resumable state machine, so one thread can advance control on several units at once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "control.h"
+#include "telemetry.h"
+#include "predict.h"
+#include "stability.h"
+#include "compare.h"
+
+typedef enum {
+    CM_IDLE = 0,
+    CM_EXECUTING,        //start hook or :CONT:EXEC
+    CM_RAMPING,          //status and telemetry until the goal
+    CM_AT_GOAL,
+    CM_VERIFY_STABLE,
+    CM_ERROR_RECOVERY,   //on error hook, back to ramping if it recovers
+    CM_TIMEOUT,
+    CM_DONE,
+    CM_FAILED
+} CM_STATE;
+
+//The callbacks of control() are the hooks of the machine
+typedef struct ControlHooks {
+    Control_Start_Func start;     //entering CM_EXECUTING, NULL sends :CONT:EXEC, false goes to CM_ERROR_RECOVERY
+    Control_On_Error on_error;    //entering CM_ERROR_RECOVERY, NULL fails
+    Control_EachCycle cycle;      //every poll while ramping, and a final time at the goal
+    void *cycle_ctx;
+} ControlHooks;
+
+typedef struct ControlMachine {
+    CM_STATE state;
+    int adts_fd;
+    const char *name;
+    //the run
+    uint64_t exp_time;
+    const char *ps_units;
+    const char *pt_units;
+    const ControlTarget *target;
+    StepResponse *response;
+    OPR success_mask;
+    ControlHooks hooks;
+    //verifying the setpoint after the goal, only when verify_channels is set
+    OPR verify_opr;
+    CTRL_OP verify_channels;
+    //cross check against the other unit, updated with every drain of samples
+    CrossCompare *compare;
+    //progress
+    uint64_t start_ms;
+    uint64_t due_ms;      //when the machine next needs a step
+    CYCLE cycle;
+    TelemetryReader reader;
+    bool predict;
+    RampPredictor predictor;
+    PollCadence cadence;
+    StabilityDetector *stability;
+    bool use_samples;
+    STABILITY stability_result;
+} ControlMachine;
+
+void machine_init(ControlMachine *cm, const int adts_fd, const uint64_t exp_time, const char *ps_units, const char *pt_units, const ControlTarget *target,
+    StepResponse *response, const OPR success_mask, const ControlHooks *hooks);
+void machine_verify(ControlMachine *cm, const OPR opr, const CTRL_OP channels);
+void machine_compare(ControlMachine *cm, CrossCompare *compare);
+bool machine_finished(const ControlMachine *cm);
+void machine_step(ControlMachine *cm);
+bool machine_run(ControlMachine **machines, const int count);
@@ -0,0 +1,218 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "predict.h"
+#include "stability.h"
+#include "utility.h"
+
+#define log_predict(fmt, ...) log_format_line(FDM_TEST_LOG, "PREDICT|" fmt, ##__VA_ARGS__)
+
+//fit over the last PREDICT_WINDOW_MS, and don't judge before PREDICT_MIN_MS so the pumps can spin up
+#define PREDICT_WINDOW_MS   15000
+#define PREDICT_MIN_MS      20000
+#define PREDICT_MIN_SAMPLES 16
+//fail once the projected arrival is PREDICT_LATE_FACTOR times the duration PREDICT_STRIKES evaluations in a row
+#define PREDICT_LATE_FACTOR 1.5
+#define PREDICT_STRIKES     3
+//this many bands from the setpoint it is only settling, the ADTS decides when it is stable
+#define PREDICT_NEAR_BANDS  10
+
+typedef struct LineFit {
+    double intercept;
+    double slope;
+    double r2;
+} LineFit;
+
+static inline bool predict_fit(const double *t, const double *y, const int n, LineFit *fit);
+static inline void predict_channel_init(PredictChannel *channel, const double setpoint, const double rate_per_min, const char *units);
+static inline void predict_channel_evaluate(PredictChannel *channel, const double *t, const double *values, const int n);
+
+static const char *Model_Names[] = {"none", "ramp", "settle"};
+
+void predict_channel_init(PredictChannel *channel, const double setpoint, const double rate_per_min, const char *units)
+{
+    StabilityCriteria criteria;
+    memset(channel, 0, sizeof(*channel));
+    channel->enabled = (rate_per_min != 0);
+    channel->setpoint = setpoint;
+    channel->commanded = fabs(rate_per_min) / 60000.0;
+    channel->band = stability_default_criteria(&criteria, units) ? criteria.max_offset : 0;
+    channel->eta_ms = channel->enabled ? INFINITY : 0;
+}
+
+//Only predicts with a target, a duration and a channel that is commanded to move
+bool predict_init(RampPredictor *rp, const ControlTarget *target, const uint64_t limit_ms, const char *ps_units, const char *pt_units)
+{
+    if((target == NULL) || !target->valid || (limit_ms == 0))
+        return false;
+
+    rp->start_ms = time_in_ms();
+    rp->limit_ms = limit_ms;
+    rp->first = 0;
+    rp->count = 0;
+    rp->strikes = 0;
+    rp->projected_ms = INFINITY;
+    predict_channel_init(&rp->ps_channel, target->ps, target->ps_rate, ps_units);
+    predict_channel_init(&rp->pt_channel, target->pt, target->pt_rate, pt_units);
+    return rp->ps_channel.enabled || rp->pt_channel.enabled;
+}
+
+void predict_add(RampPredictor *rp, const TelemetrySample *sample)
+{
+    if(sample->time_ms < rp->start_ms)
+        return;
+
+    const double now = (double)(sample->time_ms - rp->start_ms);
+    while((rp->count > 0) && ((now - rp->t[rp->first]) > PREDICT_WINDOW_MS))
+    {
+        rp->first++;
+        rp->count--;
+    }
+
+    if((rp->first + rp->count) == PREDICT_MAX_SAMPLES)
+    {
+        if(rp->count == PREDICT_MAX_SAMPLES)
+        {
+            rp->first++;
+            rp->count--;
+        }
+        memmove(rp->t, &rp->t[rp->first], rp->count * sizeof(double));
+        memmove(rp->ps, &rp->ps[rp->first], rp->count * sizeof(double));
+        memmove(rp->pt, &rp->pt[rp->first], rp->count * sizeof(double));
+        rp->first = 0;
+    }
+
+    const int i = rp->first + rp->count++;
+    rp->t[i] = now;
+    rp->ps[i] = sample->ps;
+    rp->pt[i] = sample->pt;
+}
+
+//Least squares line and its coefficient of determination
+bool predict_fit(const double *t, const double *y, const int n, LineFit *fit)
+{
+    double sum_t = 0, sum_y = 0;
+    for(int i = 0; i < n; i++)
+    {
+        sum_t += t[i];
+        sum_y += y[i];
+    }
+    const double mean_t = sum_t / n;
+    const double mean_y = sum_y / n;
+
+    double stt = 0, sty = 0, syy = 0;
+    for(int i = 0; i < n; i++)
+    {
+        stt += (t[i] - mean_t) * (t[i] - mean_t);
+        sty += (t[i] - mean_t) * (y[i] - mean_y);
+        syy += (y[i] - mean_y) * (y[i] - mean_y);
+    }
+    if(stt <= 0)
+        return false;
+
+    fit->slope = sty / stt;
+    fit->intercept = mean_y - fit->slope * mean_t;
+    fit->r2 = (syy > 0) ? ((sty * sty) / (stt * syy)) : 1.0;
+    return true;
+}
+
+//Fits the distance to the setpoint as a ramp and as a first order settle, the better fit gives the ETA.
+//The ETA is never shorter than the commanded rate allows
+void predict_channel_evaluate(PredictChannel *channel, const double *t, const double *values, const int n)
+{
+    double distance[PREDICT_MAX_SAMPLES];
+    double log_distance[PREDICT_MAX_SAMPLES];
+    bool can_log = true;
+    for(int i = 0; i < n; i++)
+    {
+        distance[i] = fabs(channel->setpoint - values[i]);
+        can_log = can_log && (distance[i] > channel->band) && (channel->band > 0);
+        log_distance[i] = can_log ? log(distance[i]) : 0;
+    }
+
+    const double now = t[n-1];
+    channel->model = PREDICT_MODEL_NONE;
+    channel->distance = distance[n-1];
+    channel->approach = 0;
+    channel->eta_ms = INFINITY;
+    if(channel->distance <= (PREDICT_NEAR_BANDS * channel->band))
+    {
+        channel->eta_ms = 0;
+        return;
+    }
+
+    LineFit ramp, settle;
+    const bool have_ramp = predict_fit(t, distance, n, &ramp) && (ramp.slope < 0);
+    const bool have_settle = can_log && predict_fit(t, log_distance, n, &settle) && (settle.slope < 0);
+
+    if(have_settle && (!have_ramp || (settle.r2 > ramp.r2)))
+    {
+        channel->model = PREDICT_MODEL_SETTLE;
+        channel->approach = -settle.slope * channel->distance;
+        channel->eta_ms = log(channel->distance / channel->band) / -settle.slope;
+    }
+    else if(have_ramp)
+    {
+        channel->model = PREDICT_MODEL_RAMP;
+        channel->approach = -ramp.slope;
+        channel->eta_ms = fmax(ramp.intercept + ramp.slope * now - channel->band, 0) / -ramp.slope;
+    }
+
+    if(channel->commanded > 0)
+        channel->eta_ms = fmax(channel->eta_ms, (channel->distance - channel->band) / channel->commanded);
+}
+
+PREDICT predict_evaluate(RampPredictor *rp)
+{
+    if(rp->count < PREDICT_MIN_SAMPLES)
+        return PREDICT_UNKNOWN;
+
+    const double *t = &rp->t[rp->first];
+    const double elapsed = t[rp->count - 1];
+    rp->projected_ms = elapsed;
+    if(rp->ps_channel.enabled)
+    {
+        predict_channel_evaluate(&rp->ps_channel, t, &rp->ps[rp->first], rp->count);
+        rp->projected_ms = fmax(rp->projected_ms, elapsed + rp->ps_channel.eta_ms);
+    }
+    if(rp->pt_channel.enabled)
+    {
+        predict_channel_evaluate(&rp->pt_channel, t, &rp->pt[rp->first], rp->count);
+        rp->projected_ms = fmax(rp->projected_ms, elapsed + rp->pt_channel.eta_ms);
+    }
+
+    log_predict("t=%.0f|projected=%.0f|limit=%llu|ps %s eta=%.0f|pt %s eta=%.0f", elapsed, rp->projected_ms, (long long unsigned)rp->limit_ms,
+        Model_Names[rp->ps_channel.model], rp->ps_channel.eta_ms, Model_Names[rp->pt_channel.model], rp->pt_channel.eta_ms);
+
+    if((elapsed < PREDICT_MIN_MS) || ((t[rp->count - 1] - t[0]) < (PREDICT_WINDOW_MS / 2)))
+        return PREDICT_UNKNOWN;
+
+    if(rp->projected_ms > (PREDICT_LATE_FACTOR * rp->limit_ms))
+        rp->strikes++;
+    else
+        rp->strikes = 0;
+    return (rp->strikes >= PREDICT_STRIKES) ? PREDICT_LATE : PREDICT_ON_TIME;
+}
+
+void predict_report(const RampPredictor *rp, const char *ps_units, const char *pt_units)
+{
+    if(isinf(rp->projected_ms))
+        OUTPUT_PRINT("Failure, the setpoint is not being approached, the test allows %.0f s", rp->limit_ms / 1000.0);
+    else
+        OUTPUT_PRINT("Failure, projected to reach the setpoint after %.0f s, the test allows %.0f s", rp->projected_ms / 1000.0, rp->limit_ms / 1000.0);
+
+    const PredictChannel *channels[2] = {&rp->ps_channel, &rp->pt_channel};
+    const char *names[2] = {"PS", "PT"};
+    const char *units[2] = {ps_units, pt_units};
+    for(int i = 0; i < 2; i++)
+    {
+        if(!channels[i]->enabled)
+            continue;
+        OUTPUT_PRINT("%s: %f %s from setpoint %f, approaching at %f %s/min (commanded %f), %s model, %.0f s to go", names[i],
+            channels[i]->distance, units[i], channels[i]->setpoint, channels[i]->approach * 60000.0, units[i], channels[i]->commanded * 60000.0,
+            Model_Names[channels[i]->model], channels[i]->eta_ms / 1000.0);
+    }
+}
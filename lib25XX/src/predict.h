@@ -0,0 +1,52 @@
+#pragma once
+//Projects when a ramp will arrive at its setpoint, so a unit that can't make its duration fails early
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "telemetry.h"
+#include "cadence.h"
+
+#define PREDICT_MAX_SAMPLES 128
+
+typedef enum {
+    PREDICT_UNKNOWN = 0,
+    PREDICT_ON_TIME = 1 << 0,
+    PREDICT_LATE    = 1 << 1
+} PREDICT;
+
+typedef enum {
+    PREDICT_MODEL_NONE = 0,
+    PREDICT_MODEL_RAMP,     //distance falls linearly, rate limited
+    PREDICT_MODEL_SETTLE    //distance decays exponentially, first order plant
+} PREDICT_MODEL;
+
+typedef struct PredictChannel {
+    bool   enabled;
+    double setpoint;
+    double commanded;     //units per ms
+    double band;          //arrived once the distance is within this
+    //last evaluation
+    PREDICT_MODEL model;
+    double distance;
+    double approach;      //units per ms, measured at the latest sample
+    double eta_ms;
+} PredictChannel;
+
+typedef struct RampPredictor {
+    uint64_t start_ms;
+    uint64_t limit_ms;
+    int      first;
+    int      count;
+    int      strikes;     //consecutive evaluations projecting too late
+    double   projected_ms;
+    double   t[PREDICT_MAX_SAMPLES]; //ms since start_ms
+    double   ps[PREDICT_MAX_SAMPLES];
+    double   pt[PREDICT_MAX_SAMPLES];
+    PredictChannel ps_channel;
+    PredictChannel pt_channel;
+} RampPredictor;
+
+bool predict_init(RampPredictor *rp, const ControlTarget *target, const uint64_t limit_ms, const char *ps_units, const char *pt_units);
+void predict_add(RampPredictor *rp, const TelemetrySample *sample);
+PREDICT predict_evaluate(RampPredictor *rp);
+void predict_report(const RampPredictor *rp, const char *ps_units, const char *pt_units);
@@ -0,0 +1,356 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+#include "telemetry.h"
+#include "utility.h"
+
+//the file is grown by this much at a time and trimmed to the used size when closed
+#define RECORDER_GROW_BYTES (1024 * 1024)
+//how often the recorder thread drains the samplers
+#define RECORDER_PERIOD_MS  250
+
+static_assert((sizeof(RecorderFileHeader) % 8) == 0, "RecorderFileHeader must keep blocks 8 byte aligned");
+static_assert((sizeof(RecorderBlockHeader) % 8) == 0, "RecorderBlockHeader must keep columns aligned");
+
+static const char *const Recorder_Units[] = {"FT", "KTS", "INHG", "MBAR", "KPA", "PSI", "M", "KMH", "MACH"};
+
+typedef struct Recorder {
+    int      fd;
+    uint8_t *map;
+    size_t   mapped;
+    size_t   used;          //end of the completed blocks
+    size_t   block;         //offset of the open data block, 0 if none
+    pthread_mutex_t lock;
+    pthread_t thread;
+    atomic_bool running;
+    int device_fds[REC_DEVICE_MAX];
+    TelemetryReader readers[REC_DEVICE_MAX];
+    uint64_t reader_started[REC_DEVICE_MAX];
+} Recorder;
+
+static Recorder Rec = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static inline size_t recorder_block_size(const uint32_t capacity);
+static inline uint8_t recorder_units_code(const char *units);
+static bool recorder_reserve(const size_t bytes);
+static void recorder_close_block();
+static void recorder_append(const REC_DEVICE device, const TelemetrySample *sample, const uint8_t ps_units, const uint8_t pt_units);
+static void recorder_drain();
+static void *recorder_thread(void *unused);
+
+size_t recorder_block_size(const uint32_t capacity)
+{
+    size_t size = sizeof(RecorderBlockHeader) + (size_t)capacity * (sizeof(uint32_t) + sizeof(float) + 3 * sizeof(uint8_t));
+    return (size + 7) & ~(size_t)7;
+}
+
+uint8_t recorder_units_code(const char *units)
+{
+    for(uint i = 0; i < LENGTH_2D(Recorder_Units); i++)
+    {
+        if(strcmp(units, Recorder_Units[i]) == 0)
+            return (uint8_t)i;
+    }
+    return RECORDER_UNITS_UNKNOWN;
+}
+
+const char *recorder_units_name(const uint8_t units)
+{
+    if(units >= LENGTH_2D(Recorder_Units))
+        return "?";
+    return Recorder_Units[units];
+}
+
+//Make sure bytes past used are mapped, growing the file if needed
+bool recorder_reserve(const size_t bytes)
+{
+    if((Rec.used + bytes) <= Rec.mapped)
+        return true;
+
+    size_t new_size = Rec.mapped + RECORDER_GROW_BYTES;
+    while(new_size < (Rec.used + bytes))
+        new_size += RECORDER_GROW_BYTES;
+
+    if(ftruncate(Rec.fd, new_size) != 0)
+        return false;
+    if(Rec.map != NULL)
+        munmap(Rec.map, Rec.mapped);
+    Rec.map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, Rec.fd, 0);
+    if(Rec.map == MAP_FAILED)
+    {
+        Rec.map = NULL;
+        Rec.mapped = 0;
+        return false;
+    }
+    Rec.mapped = new_size;
+    return true;
+}
+
+//Shrink the open block down to its rows so partially filled blocks don't waste space
+void recorder_close_block()
+{
+    if(Rec.block == 0)
+        return;
+
+    RecorderBlockHeader *header = (RecorderBlockHeader*)(Rec.map + Rec.block);
+    const uint32_t cap = header->capacity;
+    const uint32_t rows = header->rows;
+    uint8_t *columns = (uint8_t*)(header + 1);
+    if(rows < cap)
+    {
+        //each column moves toward the start and never past the previous one's new end
+        memmove(columns + rows * 4, columns + cap * 4, rows * sizeof(float));
+        memmove(columns + rows * 8, columns + cap * 8, rows);
+        memmove(columns + rows * 9, columns + cap * 9, rows);
+        memmove(columns + rows * 10, columns + cap * 10, rows);
+        header->capacity = rows;
+    }
+
+    Rec.used = Rec.block + recorder_block_size(header->capacity);
+    Rec.block = 0;
+    ((RecorderFileHeader*)Rec.map)->used = Rec.used;
+}
+
+void recorder_append(const REC_DEVICE device, const TelemetrySample *sample, const uint8_t ps_units, const uint8_t pt_units)
+{
+    RecorderBlockHeader *header = (Rec.block != 0) ? (RecorderBlockHeader*)(Rec.map + Rec.block) : NULL;
+    //two rows per sample, start a new block if they don't fit or the offset would overflow
+    if((header != NULL) && (((header->rows + 2) > header->capacity) || ((sample->time_ms - header->base_ms) > UINT32_MAX)))
+    {
+        recorder_close_block();
+        header = NULL;
+    }
+
+    if(header == NULL)
+    {
+        if(!recorder_reserve(recorder_block_size(RECORDER_BLOCK_ROWS)))
+            return;
+        Rec.block = Rec.used;
+        header = (RecorderBlockHeader*)(Rec.map + Rec.block);
+        memset(header, 0, sizeof(RecorderBlockHeader));
+        header->kind = REC_BLOCK_DATA;
+        header->capacity = RECORDER_BLOCK_ROWS;
+        header->base_ms = sample->time_ms;
+    }
+
+    const uint32_t cap = header->capacity;
+    uint8_t *columns = (uint8_t*)(header + 1);
+    uint32_t *time_offset = (uint32_t*)columns;
+    float *value = (float*)(columns + cap * 4);
+    uint8_t *device_col = columns + cap * 8;
+    uint8_t *channel = columns + cap * 9;
+    uint8_t *units = columns + cap * 10;
+
+    const uint32_t row = header->rows;
+    time_offset[row] = time_offset[row + 1] = (uint32_t)(sample->time_ms - header->base_ms);
+    device_col[row] = device_col[row + 1] = (uint8_t)device;
+    value[row] = (float)sample->ps;
+    channel[row] = REC_CHANNEL_PS;
+    units[row] = ps_units;
+    value[row + 1] = (float)sample->pt;
+    channel[row + 1] = REC_CHANNEL_PT;
+    units[row + 1] = pt_units;
+    header->rows = row + 2;
+}
+
+void recorder_begin_segment(const char *name)
+{
+    if(!atomic_load(&Rec.running))
+        return;
+
+    pthread_mutex_lock(&Rec.lock);
+    //samples still in the rings belong to the previous segment
+    recorder_drain();
+    recorder_close_block();
+    if(recorder_reserve(recorder_block_size(0)))
+    {
+        RecorderBlockHeader *header = (RecorderBlockHeader*)(Rec.map + Rec.used);
+        memset(header, 0, sizeof(RecorderBlockHeader));
+        header->kind = REC_BLOCK_SEGMENT;
+        header->base_ms = time_in_ms();
+        snprintf(header->name, sizeof(header->name), "%s", name);
+        Rec.used += recorder_block_size(0);
+        ((RecorderFileHeader*)Rec.map)->used = Rec.used;
+    }
+    pthread_mutex_unlock(&Rec.lock);
+}
+
+//Called with the lock held, moves everything the samplers have into the file
+void recorder_drain()
+{
+    for(uint i = 0; i < REC_DEVICE_MAX; i++)
+    {
+        TelemetryReader *reader = &Rec.readers[i];
+        TelemetrySample sample;
+        //a slot restarted since the last drain has reset its ring and may be sampling another unit, the old cursor is no use
+        if((reader->sampler != NULL) && (reader->sampler->started_ms != Rec.reader_started[i]))
+            telemetry_reader_init(reader, NULL);
+        //finish what a sampler that just stopped left behind before looking for a new one
+        if(reader->sampler != NULL)
+        {
+            const uint8_t ps_units = recorder_units_code(reader->sampler->ps_units);
+            const uint8_t pt_units = recorder_units_code(reader->sampler->pt_units);
+            while(telemetry_read(reader, &sample))
+                recorder_append((REC_DEVICE)i, &sample, ps_units, pt_units);
+        }
+
+        TelemetrySampler *sampler = telemetry_get(Rec.device_fds[i]);
+        if((sampler != NULL) && ((sampler != reader->sampler) || (sampler->started_ms != Rec.reader_started[i])))
+        {
+            //new sampler, take everything it has recorded so far
+            telemetry_reader_init(reader, sampler);
+            reader->tail = 0;
+            Rec.reader_started[i] = sampler->started_ms;
+        }
+    }
+}
+
+//The samplers never touch the file, this thread drains their rings into it
+void *recorder_thread(void *unused)
+{
+    (void)unused;
+    struct timespec ts;
+    while(atomic_load(&Rec.running))
+    {
+        SLEEP_MS(&ts, RECORDER_PERIOD_MS);
+        pthread_mutex_lock(&Rec.lock);
+        recorder_drain();
+        pthread_mutex_unlock(&Rec.lock);
+    }
+    return NULL;
+}
+
+bool recorder_start(const char *filepath, const int master_fd, const int slave_fd)
+{
+    if((Rec.fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+        return false;
+
+    Rec.map = NULL;
+    Rec.mapped = 0;
+    Rec.used = 0;
+    Rec.block = 0;
+    if(!recorder_reserve(sizeof(RecorderFileHeader)))
+    {
+        close(Rec.fd);
+        Rec.fd = -1;
+        return false;
+    }
+    RecorderFileHeader *header = (RecorderFileHeader*)Rec.map;
+    header->magic = RECORDER_MAGIC;
+    header->version = RECORDER_VERSION;
+    header->created = (uint64_t)time(NULL);
+    Rec.used = header->used = sizeof(RecorderFileHeader);
+
+    Rec.device_fds[REC_DEVICE_MASTER] = master_fd;
+    Rec.device_fds[REC_DEVICE_SLAVE] = slave_fd;
+    for(uint i = 0; i < REC_DEVICE_MAX; i++)
+        telemetry_reader_init(&Rec.readers[i], NULL);
+
+    atomic_store(&Rec.running, true);
+    if(pthread_create(&Rec.thread, NULL, &recorder_thread, NULL) != 0)
+    {
+        atomic_store(&Rec.running, false);
+        recorder_stop();
+        return false;
+    }
+    return true;
+}
+
+void recorder_stop()
+{
+    if(atomic_load(&Rec.running))
+    {
+        atomic_store(&Rec.running, false);
+        pthread_join(Rec.thread, NULL);
+    }
+    if(Rec.fd == -1)
+        return;
+
+    pthread_mutex_lock(&Rec.lock);
+    recorder_drain();
+    recorder_close_block();
+    const size_t used = Rec.used;
+    if(Rec.map != NULL)
+        munmap(Rec.map, Rec.mapped);
+    Rec.map = NULL;
+    Rec.mapped = 0;
+    if(ftruncate(Rec.fd, used) != 0)
+        ERROR_PRINT("Could not trim the telemetry file");
+    close(Rec.fd);
+    Rec.fd = -1;
+    pthread_mutex_unlock(&Rec.lock);
+}
+
+bool recorder_open(RecorderFile *file, const char *filepath)
+{
+    struct stat st;
+    file->map = NULL;
+    if((file->fd = open(filepath, O_RDONLY)) == -1)
+        return false;
+    if((fstat(file->fd, &st) != 0) || ((size_t)st.st_size < sizeof(RecorderFileHeader)))
+    {
+        close(file->fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if(map == MAP_FAILED)
+    {
+        close(file->fd);
+        return false;
+    }
+    file->map = map;
+    file->size = st.st_size;
+
+    const RecorderFileHeader *header = (const RecorderFileHeader*)file->map;
+    if((header->magic != RECORDER_MAGIC) || (header->version != RECORDER_VERSION))
+    {
+        recorder_close(file);
+        return false;
+    }
+    //a file that is still being written only has its completed blocks read
+    file->end = (header->used < file->size) ? header->used : file->size;
+    file->pos = sizeof(RecorderFileHeader);
+    return true;
+}
+
+bool recorder_next_block(RecorderFile *file, RecorderBlock *block)
+{
+    if((file->pos + sizeof(RecorderBlockHeader)) > file->end)
+        return false;
+
+    const RecorderBlockHeader *header = (const RecorderBlockHeader*)(file->map + file->pos);
+    const size_t size = recorder_block_size(header->capacity);
+    if(((file->pos + size) > file->end) || (header->rows > header->capacity))
+        return false;
+
+    const uint8_t *columns = (const uint8_t*)(header + 1);
+    const uint32_t cap = header->capacity;
+    block->header = header;
+    block->time_offset = (const uint32_t*)columns;
+    block->value = (const float*)(columns + cap * 4);
+    block->device = columns + cap * 8;
+    block->channel = columns + cap * 9;
+    block->units = columns + cap * 10;
+    file->pos += size;
+    return true;
+}
+
+void recorder_close(RecorderFile *file)
+{
+    if(file->map != NULL)
+        munmap((void*)file->map, file->size);
+    file->map = NULL;
+    close(file->fd);
+}
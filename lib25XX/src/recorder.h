@@ -0,0 +1,74 @@
+#pragma once
+//Append only columnar telemetry file, written and read through mmap
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RECORDER_MAGIC        0x4d4c5435 //"5TLM"
+#define RECORDER_VERSION      1
+#define RECORDER_BLOCK_ROWS   512
+#define RECORDER_SEGMENT_NAME 96
+#define RECORDER_UNITS_UNKNOWN 0xFF
+
+typedef enum {
+    REC_DEVICE_MASTER = 0,
+    REC_DEVICE_SLAVE  = 1,
+    REC_DEVICE_MAX
+} REC_DEVICE;
+
+typedef enum {
+    REC_CHANNEL_PS = 0,
+    REC_CHANNEL_PT = 1
+} REC_CHANNEL;
+
+typedef enum {
+    REC_BLOCK_DATA    = 1 << 0,
+    REC_BLOCK_SEGMENT = 1 << 1  //marks the start of a test, has no rows
+} REC_BLOCK;
+
+typedef struct RecorderFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t used;       //bytes of completed blocks, including this header
+    uint64_t created;    //unix time
+} RecorderFileHeader;
+
+//Followed by the columns of capacity rows each:
+//uint32_t time offset from base_ms, float value, uint8_t device, uint8_t channel, uint8_t units
+typedef struct RecorderBlockHeader {
+    uint32_t kind;
+    uint32_t rows;
+    uint32_t capacity;
+    uint32_t reserved;
+    uint64_t base_ms;
+    char     name[RECORDER_SEGMENT_NAME];
+} RecorderBlockHeader;
+
+//A block as seen by a reader, the column pointers point into the mapping
+typedef struct RecorderBlock {
+    const RecorderBlockHeader *header;
+    const uint32_t *time_offset;
+    const float    *value;
+    const uint8_t  *device;
+    const uint8_t  *channel;
+    const uint8_t  *units;
+} RecorderBlock;
+
+typedef struct RecorderFile {
+    int    fd;
+    const uint8_t *map;
+    size_t size;
+    size_t end;  //end of the completed blocks
+    size_t pos;
+} RecorderFile;
+
+//writing
+bool recorder_start(const char *filepath, const int master_fd, const int slave_fd);
+void recorder_begin_segment(const char *name);
+void recorder_stop();
+
+//reading
+bool recorder_open(RecorderFile *file, const char *filepath);
+bool recorder_next_block(RecorderFile *file, RecorderBlock *block);
+void recorder_close(RecorderFile *file);
+const char *recorder_units_name(const uint8_t units);
@@ -0,0 +1,162 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "response.h"
+#include "stability.h"
+#include "utility.h"
+
+#define log_response(fmt, ...) log_format_line(FDM_TEST_LOG, "RESPONSE|" fmt, ##__VA_ARGS__)
+
+//settled means within this part of the step, or the stability offset for small steps
+#define STEP_BAND 0.02
+
+static inline void step_channel_init(StepChannel *channel, const double setpoint, const char *units);
+static inline void step_channel_set_initial(StepChannel *channel, const double value);
+static inline void step_channel_add(StepChannel *channel, const uint64_t time_ms, const double value);
+static inline void step_channel_finish(StepChannel *channel, const uint64_t start_ms, const uint64_t last_ms);
+static inline void step_channel_report(const StepChannel *channel, const char *channel_name, const char *sn, const char *test_name, const char *units);
+
+void step_channel_init(StepChannel *channel, const double setpoint, const char *units)
+{
+    memset(channel, 0, sizeof(*channel));
+    StabilityCriteria criteria;
+    channel->enabled = true;
+    channel->setpoint = setpoint;
+    channel->band = stability_default_criteria(&criteria, units) ? criteria.max_offset : 0;
+}
+
+void step_response_init(StepResponse *sr, const ControlTarget *target, const bool ps, const bool pt, const char *ps_units, const char *pt_units)
+{
+    memset(sr, 0, sizeof(*sr));
+    sr->start_ms = time_in_ms();
+    if((target == NULL) || !target->valid)
+        return;
+
+    if(ps)
+        step_channel_init(&sr->ps, target->ps, ps_units);
+    if(pt)
+        step_channel_init(&sr->pt, target->pt, pt_units);
+}
+
+void step_channel_set_initial(StepChannel *channel, const double value)
+{
+    channel->have_initial = true;
+    channel->initial = value;
+    channel->band = fmax(channel->band, STEP_BAND * fabs(channel->setpoint - value));
+}
+
+//Called when control is executed, initial is the last sample before it if there is one
+void step_response_start(StepResponse *sr, const TelemetrySample *initial)
+{
+    sr->start_ms = time_in_ms();
+    if(initial == NULL)
+        return;
+    if(sr->ps.enabled)
+        step_channel_set_initial(&sr->ps, initial->ps);
+    if(sr->pt.enabled)
+        step_channel_set_initial(&sr->pt, initial->pt);
+}
+
+void step_channel_add(StepChannel *channel, const uint64_t time_ms, const double value)
+{
+    if(!channel->enabled)
+        return;
+
+    if(!channel->have_initial)
+        step_channel_set_initial(channel, value);
+
+    const double step = channel->setpoint - channel->initial;
+    if(fabs(step) > channel->band)
+    {
+        const double progress = (value - channel->initial) / step;
+        if((channel->t10_ms == 0) && (progress >= 0.1))
+            channel->t10_ms = time_ms;
+        if((channel->t90_ms == 0) && (progress >= 0.9))
+            channel->t90_ms = time_ms;
+        channel->peak = fmax(channel->peak, progress);
+    }
+
+    //the steady state error only counts from the last time it entered the band
+    const double error = value - channel->setpoint;
+    if(fabs(error) > channel->band)
+    {
+        channel->was_outside = true;
+        channel->last_outside_ms = time_ms;
+        channel->error_sum = 0;
+        channel->error_count = 0;
+    }
+    else
+    {
+        channel->error_sum += error;
+        channel->error_count++;
+    }
+}
+
+void step_response_add(StepResponse *sr, const TelemetrySample *sample)
+{
+    if(sample->time_ms < sr->start_ms)
+        return;
+    sr->num_samples++;
+    sr->last_ms = sample->time_ms;
+    step_channel_add(&sr->ps, sample->time_ms, sample->ps);
+    step_channel_add(&sr->pt, sample->time_ms, sample->pt);
+}
+
+void step_channel_finish(StepChannel *channel, const uint64_t start_ms, const uint64_t last_ms)
+{
+    StepMetrics *metrics = &channel->metrics;
+    memset(metrics, 0, sizeof(*metrics));
+    if(!channel->enabled || !channel->have_initial)
+        return;
+
+    //a step smaller than the band has nothing to rise through
+    const bool has_step = fabs(channel->setpoint - channel->initial) > channel->band;
+    metrics->risen = !has_step || (channel->t90_ms != 0);
+    if(has_step)
+        metrics->rise_ms = (metrics->risen ? channel->t90_ms : last_ms) - ((channel->t10_ms != 0) ? channel->t10_ms : start_ms);
+    metrics->overshoot = has_step ? (fmax(channel->peak - 1.0, 0) * 100.0) : 0;
+
+    metrics->settled = channel->error_count > 0;
+    if(metrics->settled)
+    {
+        metrics->settling_ms = channel->was_outside ? (channel->last_outside_ms - start_ms) : 0;
+        metrics->steady_error = channel->error_sum / channel->error_count;
+    }
+    else
+        metrics->settling_ms = last_ms - start_ms;
+}
+
+void step_response_finish(StepResponse *sr)
+{
+    step_channel_finish(&sr->ps, sr->start_ms, sr->last_ms);
+    step_channel_finish(&sr->pt, sr->start_ms, sr->last_ms);
+}
+
+void step_channel_report(const StepChannel *channel, const char *channel_name, const char *sn, const char *test_name, const char *units)
+{
+    if(!channel->enabled || !channel->have_initial)
+        return;
+
+    const StepMetrics *metrics = &channel->metrics;
+    OUTPUT_PRINT("%s step response: rise time %s%.1f s, overshoot %.2f%%, settling time %s%.1f s, steady state error %.4f %s", channel_name,
+        metrics->risen ? "" : "> ", metrics->rise_ms / 1000.0, metrics->overshoot,
+        metrics->settled ? "" : "> ", metrics->settling_ms / 1000.0, metrics->steady_error, units);
+    log_response("%s|%s|%s|from=%f|to=%f|%s|risen=%d|rise_ms=%llu|overshoot=%f|settled=%d|settling_ms=%llu|steady_error=%f", sn, test_name, channel_name,
+        channel->initial, channel->setpoint, units, metrics->risen, (long long unsigned)metrics->rise_ms, metrics->overshoot,
+        metrics->settled, (long long unsigned)metrics->settling_ms, metrics->steady_error);
+}
+
+//One line per channel, keyed by unit S/N so the pneumatic performance can be followed across runs
+void step_response_report(const StepResponse *sr, const char *sn, const char *test_name, const char *ps_units, const char *pt_units)
+{
+    if(sr->num_samples == 0)
+    {
+        log_response("%s|%s|no samples", sn, test_name);
+        return;
+    }
+    step_channel_report(&sr->ps, "PS", sn, test_name, ps_units);
+    step_channel_report(&sr->pt, "PT", sn, test_name, pt_units);
+}
@@ -0,0 +1,46 @@
+#pragma once
+//Step response of a control run, computed from telemetry samples as they arrive
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "telemetry.h"
+#include "cadence.h"
+
+typedef struct StepMetrics {
+    bool     risen;          //went through 90% of the step, else rise_ms is the time spent rising so far
+    bool     settled;        //the last samples were inside the band, else settling_ms is the whole run
+    uint64_t rise_ms;        //10% to 90% of the step
+    double   overshoot;      //percent of the step past the setpoint
+    uint64_t settling_ms;    //from the start until it stayed inside the band
+    double   steady_error;   //mean error since it entered the band for good, in units
+} StepMetrics;
+
+typedef struct StepChannel {
+    bool     enabled;
+    bool     have_initial;
+    double   setpoint;
+    double   initial;
+    double   band;
+    double   peak;           //furthest progress towards and past the setpoint, 1.0 is the setpoint
+    uint64_t t10_ms;
+    uint64_t t90_ms;
+    bool     was_outside;
+    uint64_t last_outside_ms;
+    double   error_sum;
+    uint32_t error_count;
+    StepMetrics metrics;
+} StepChannel;
+
+typedef struct StepResponse {
+    uint64_t start_ms;
+    uint64_t last_ms;
+    uint32_t num_samples;
+    StepChannel ps;
+    StepChannel pt;
+} StepResponse;
+
+void step_response_init(StepResponse *sr, const ControlTarget *target, const bool ps, const bool pt, const char *ps_units, const char *pt_units);
+void step_response_start(StepResponse *sr, const TelemetrySample *initial);
+void step_response_add(StepResponse *sr, const TelemetrySample *sample);
+void step_response_finish(StepResponse *sr);
+void step_response_report(const StepResponse *sr, const char *sn, const char *test_name, const char *ps_units, const char *pt_units);
@@ -0,0 +1,486 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "script.h"
+#include "serial.h"
+#include "status.h"
+#include "command.h"
+#include "utility.h"
+
+#define log_script(fmt, ...) log_format_line(FDM_TEST_LOG, "SCRIPT|" fmt, ##__VA_ARGS__)
+
+#define SCRIPT_ARENA_SIZE 8192
+//adjacent sends are joined with ; up to this length, adjacent expects go in one compound query. A joined command gets a
+//leading : if it has none, it would be relative to the header before it otherwise
+#define SCRIPT_BATCH_LEN  256
+#define SCRIPT_POLL_MS    250
+#define SCRIPT_SAMPLE_MS  100
+
+//every script is compiled into here, one after the other
+static uint8_t  Script_Arena[SCRIPT_ARENA_SIZE];
+static uint32_t Script_Used;
+
+//One decoded instruction, strings point into the bytecode
+typedef struct ScriptInsn {
+    SOP op;
+    const char *str[2];
+    double   num[2];
+    uint32_t u[2];
+} ScriptInsn;
+
+typedef struct Mnemonic {
+    const char *name;
+    SOP op;
+    int num_operands;
+} Mnemonic;
+
+static const Mnemonic Mnemonics[] = {
+    {"DEVICE",  SOP_DEVICE,     1},
+    {"SEND",    SOP_SEND,       1},
+    {"EXPECT",  SOP_EXPECT_STR, 2},
+    {"EXPECTF", SOP_EXPECT_FP,  3},
+    {"WAIT",    SOP_WAIT_OPR,   2},
+    {"SAMPLE",  SOP_SAMPLE,     2},
+    {"ASSERT",  SOP_ASSERT,     2},
+    {"PROMPT",  SOP_PROMPT,     1},
+};
+
+typedef struct OprName {
+    const char *name;
+    OPR opr;
+} OprName;
+
+static const OprName Opr_Names[] = {
+    {"STABLE",       OPR_STABLE},
+    {"LEAKT_STABLE", OPR_LEAKT_STABLE},
+    {"VOLUMET_DONE", OPR_VOLUMET_DONE},
+    {"PS_STABLE",    OPR_PS_STABLE},
+    {"PT_STABLE",    OPR_PT_STABLE},
+    {"SELFT_DONE",   OPR_SELFT_DONE},
+    {"GTG",          OPR_GTG},
+};
+
+static const char *Device_Names[] = {"MASTER", "SLAVE", "LSU"};
+
+static inline bool script_emit(Script *script, const void *data, const size_t size);
+static inline bool script_emit_str(Script *script, const char *str);
+static inline bool script_decode(const Script *script, uint32_t *pc, ScriptInsn *insn);
+static inline int script_device_fd(const uint8_t device);
+static inline bool script_rooted(const char *cmd);
+
+void script_clear(void)
+{
+    Script_Used = 0;
+}
+
+//Means the same on its own and after a ;, a common command or a header from the root
+bool script_rooted(const char *cmd)
+{
+    return (cmd[0] == ':') || (cmd[0] == '*');
+}
+
+//Appends at the end of the script, which has to be the last one in the arena, SOP_END is moved along
+bool script_emit(Script *script, const void *data, const size_t size)
+{
+    const uint32_t at = (uint32_t)(script->code - Script_Arena) + script->len - 1;
+    if((at + size + 1) > SCRIPT_ARENA_SIZE)
+        return false;
+    memcpy(&Script_Arena[at], data, size);
+    Script_Arena[at + size] = SOP_END;
+    script->len += size;
+    Script_Used = at + size + 1;
+    return true;
+}
+
+bool script_emit_str(Script *script, const char *str)
+{
+    const size_t len = strlen(str);
+    const uint8_t len8 = (uint8_t)len;
+    return (len <= UINT8_MAX) && script_emit(script, &len8, 1) && script_emit(script, str, len + 1);
+}
+
+static bool script_device(const char *name, uint8_t *device)
+{
+    for(uint i = 0; i < LENGTH_2D(Device_Names); i++)
+    {
+        if(strcmp(name, Device_Names[i]) == 0)
+        {
+            *device = (uint8_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+//A new empty script at the end of the arena, starting on device
+bool script_begin(Script *script, const char *device)
+{
+    uint8_t dev;
+    if((Script_Used + 3) > SCRIPT_ARENA_SIZE)
+        return false;
+    Script_Arena[Script_Used] = SOP_END;
+    script->code = &Script_Arena[Script_Used];
+    script->len = 1;
+    script->num_steps = 0;
+    Script_Used++;
+
+    const uint8_t op = SOP_DEVICE;
+    return script_device(device, &dev) && script_emit(script, &op, 1) && script_emit(script, &dev, 1);
+}
+
+static bool script_number(const char *field, double *value)
+{
+    char *end;
+    *value = strtod(field, &end);
+    return (end != field) && (*end == '\0');
+}
+
+static bool script_u32(const char *field, uint32_t *value)
+{
+    char *end;
+    const unsigned long long n = strtoull(field, &end, 10);
+    *value = (uint32_t)n;
+    return (end != field) && (*end == '\0') && (field[0] != '-') && (n <= UINT32_MAX);
+}
+
+static bool script_opr(const char *field, uint32_t *opr)
+{
+    for(uint i = 0; i < LENGTH_2D(Opr_Names); i++)
+    {
+        if(strcmp(field, Opr_Names[i].name) == 0)
+        {
+            *opr = Opr_Names[i].opr;
+            return true;
+        }
+    }
+    return false;
+}
+
+//fields are the mnemonic and its operands
+bool script_compile_step(Script *script, char **fields, const int num_fields, char *err, const size_t errsize)
+{
+    if((script->code + script->len) != &Script_Arena[Script_Used])
+    {
+        snprintf(err, errsize, "Steps have to follow their procedure");
+        return false;
+    }
+
+    const Mnemonic *mn = NULL;
+    for(uint i = 0; i < LENGTH_2D(Mnemonics); i++)
+    {
+        if(strcmp(fields[0], Mnemonics[i].name) == 0)
+            mn = &Mnemonics[i];
+    }
+    if(mn == NULL)
+    {
+        snprintf(err, errsize, "Unknown step %s", fields[0]);
+        return false;
+    }
+    if(num_fields != (mn->num_operands + 1))
+    {
+        snprintf(err, errsize, "%s takes %d operands, found %d", mn->name, mn->num_operands, num_fields - 1);
+        return false;
+    }
+
+    const uint8_t op = (uint8_t)mn->op;
+    const uint32_t len = script->len;
+    bool bRet = script_emit(script, &op, 1);
+    double num[2];
+    uint32_t u[2];
+    uint8_t dev;
+    switch(mn->op)
+    {
+        case SOP_DEVICE:
+            if(!script_device(fields[1], &dev))
+            {
+                snprintf(err, errsize, "Unknown device %s, expected MASTER, SLAVE or LSU", fields[1]);
+                return false;
+            }
+            bRet = bRet && script_emit(script, &dev, 1);
+            break;
+        case SOP_SEND:
+        case SOP_PROMPT:
+            bRet = bRet && script_emit_str(script, fields[1]);
+            break;
+        case SOP_EXPECT_STR:
+            bRet = bRet && script_emit_str(script, fields[1]) && script_emit_str(script, fields[2]);
+            break;
+        case SOP_EXPECT_FP:
+            if(!script_number(fields[2], &num[0]) || !script_number(fields[3], &num[1]) || (num[1] < 0))
+            {
+                snprintf(err, errsize, "Invalid expected value %s or tolerance %s", fields[2], fields[3]);
+                return false;
+            }
+            bRet = bRet && script_emit_str(script, fields[1]) && script_emit(script, num, sizeof(num));
+            break;
+        case SOP_WAIT_OPR:
+            if(!script_opr(fields[1], &u[0]) || !script_u32(fields[2], &u[1]))
+            {
+                snprintf(err, errsize, "Invalid OPR bit %s or timeout %s", fields[1], fields[2]);
+                return false;
+            }
+            bRet = bRet && script_emit(script, u, sizeof(u));
+            break;
+        case SOP_SAMPLE:
+            if(!script_u32(fields[2], &u[0]) || (u[0] == 0))
+            {
+                snprintf(err, errsize, "Invalid sample count %s", fields[2]);
+                return false;
+            }
+            bRet = bRet && script_emit_str(script, fields[1]) && script_emit(script, u, sizeof(u[0]));
+            break;
+        case SOP_ASSERT:
+            if(!script_number(fields[1], &num[0]) || !script_number(fields[2], &num[1]) || (num[1] < 0))
+            {
+                snprintf(err, errsize, "Invalid expected value %s or tolerance %s", fields[1], fields[2]);
+                return false;
+            }
+            bRet = bRet && script_emit(script, num, sizeof(num));
+            break;
+        default:
+            break;
+    }
+
+    if(!bRet)
+    {
+        //drop the partial instruction
+        script->len = len;
+        Script_Used = (uint32_t)(script->code - Script_Arena) + len;
+        Script_Arena[Script_Used - 1] = SOP_END;
+        snprintf(err, errsize, "Out of procedure space, or a string is longer than %d", UINT8_MAX);
+        return false;
+    }
+    script->num_steps++;
+    return true;
+}
+
+//The instruction at pc, pc is moved past it
+bool script_decode(const Script *script, uint32_t *pc, ScriptInsn *insn)
+{
+    const uint8_t *code = script->code;
+    if(*pc >= script->len)
+        return false;
+    insn->op = (SOP)code[(*pc)++];
+
+    int num_str = 0, num_num = 0, num_u = 0;
+    switch(insn->op)
+    {
+        case SOP_DEVICE:     insn->u[0] = code[(*pc)++]; return true;
+        case SOP_SEND:
+        case SOP_PROMPT:     num_str = 1; break;
+        case SOP_EXPECT_STR: num_str = 2; break;
+        case SOP_EXPECT_FP:  num_str = 1; num_num = 2; break;
+        case SOP_WAIT_OPR:   num_u = 2; break;
+        case SOP_SAMPLE:     num_str = 1; num_u = 1; break;
+        case SOP_ASSERT:     num_num = 2; break;
+        default:             return true;
+    }
+    for(int i = 0; i < num_str; i++)
+    {
+        const uint8_t len = code[(*pc)++];
+        insn->str[i] = (const char*)&code[*pc];
+        *pc += len + 1;
+    }
+    memcpy(insn->num, &code[*pc], num_num * sizeof(double));
+    *pc += num_num * sizeof(double);
+    memcpy(insn->u, &code[*pc], num_u * sizeof(uint32_t));
+    *pc += num_u * sizeof(uint32_t);
+    return true;
+}
+
+int script_device_fd(const uint8_t device)
+{
+    if(device == SCRIPT_DEV_SLAVE)
+        return serial_get_SDM()->slave.fd;
+    else if(device == SCRIPT_DEV_LSU)
+        return serial_get_SDM()->lsu.fd;
+    return serial_get_SDM()->master.fd;
+}
+
+static bool script_expect(const ScriptInsn *insn, const char *reply, const char *name, const uint step)
+{
+    if(insn->op == SOP_EXPECT_STR)
+    {
+        if(strcmp(reply, insn->str[1]) == 0)
+            return true;
+        ERROR_PRINT("%s step %u: %s returned %s instead of %s", name, step, insn->str[0], reply, insn->str[1]);
+        return false;
+    }
+
+    const double value = strtod(reply, NULL);
+    if(fabs(value - insn->num[0]) <= insn->num[1])
+        return true;
+    ERROR_PRINT("%s step %u: %s returned %f, expected %f +/- %f", name, step, insn->str[0], value, insn->num[0], insn->num[1]);
+    return false;
+}
+
+//Runs the script on the devices of the SDM. Adjacent sends go out as one command and adjacent expects as one
+//compound query, so a procedure takes as many round trips as the hand written equivalent
+bool script_run(const Script *script, const char *name)
+{
+    struct timespec ts;
+    const uint64_t start_ms = time_in_ms();
+    int fd = serial_get_SDM()->master.fd;
+    double reg = NAN;
+    uint step = 0, exchanges = 0;
+    uint32_t pc = 0;
+    bool bRet = true;
+    ScriptInsn insn;
+    while(bRet && script_decode(script, &pc, &insn) && (insn.op != SOP_END))
+    {
+        step++;
+        switch(insn.op)
+        {
+            case SOP_DEVICE:
+                fd = script_device_fd((uint8_t)insn.u[0]);
+                break;
+            case SOP_SEND:
+            {
+                char batch[SCRIPT_BATCH_LEN];
+                size_t used = (size_t)snprintf(batch, sizeof(batch), "%s", insn.str[0]);
+                uint32_t next = pc;
+                ScriptInsn peek;
+                while(script_decode(script, &next, &peek) && (peek.op == SOP_SEND) && ((used + 2 + strlen(peek.str[0])) < sizeof(batch)))
+                {
+                    used += (size_t)snprintf(&batch[used], sizeof(batch) - used, ";%s%s", script_rooted(peek.str[0]) ? "" : ":", peek.str[0]);
+                    pc = next;
+                    step++;
+                }
+                exchanges++;
+                if(!serial_fd_do(fd, batch, NULL, 0, NULL))
+                {
+                    ERROR_PRINT("%s step %u: %s failed", name, step, batch);
+                    bRet = false;
+                }
+                break;
+            }
+            case SOP_EXPECT_STR:
+            case SOP_EXPECT_FP:
+            {
+                ScriptInsn batch[SERIAL_COMPOUND_MAX];
+                const char *queries[SERIAL_COMPOUND_MAX];
+                char rooted[SERIAL_COMPOUND_MAX][UINT8_MAX + 2];
+                int count = 0;
+                batch[count] = insn;
+                queries[count++] = insn.str[0];
+                uint32_t next = pc;
+                while((count < SERIAL_COMPOUND_MAX) && script_decode(script, &next, &batch[count]) &&
+                      ((batch[count].op == SOP_EXPECT_STR) || (batch[count].op == SOP_EXPECT_FP)))
+                {
+                    queries[count] = batch[count].str[0];
+                    if(!script_rooted(queries[count]))
+                    {
+                        snprintf(rooted[count], sizeof(rooted[count]), ":%s", queries[count]);
+                        queries[count] = rooted[count];
+                    }
+                    count++;
+                    pc = next;
+                }
+
+                char buf[512];
+                char *fields[SERIAL_COMPOUND_MAX];
+                exchanges++;
+                const uint first = step;
+                step += count - 1;
+                if(serial_fd_query_compound(fd, queries, count, buf, sizeof(buf), fields) != count)
+                {
+                    ERROR_PRINT("%s step %u: %s... got no reply", name, first, queries[0]);
+                    bRet = false;
+                    break;
+                }
+                for(int i = 0; i < count; i++)
+                    bRet &= script_expect(&batch[i], fields[i], name, first + i);
+                break;
+            }
+            case SOP_WAIT_OPR:
+            {
+                const uint64_t deadline = time_in_ms() + insn.u[1];
+                STATUS st;
+                while(((st = status_check_event_registers((OPR)insn.u[0], fd)) != ST_AT_GOAL) && !(st & ST_ERR) && (time_in_ms() < deadline))
+                {
+                    exchanges++;
+                    SLEEP_MS(&ts, SCRIPT_POLL_MS);
+                }
+                exchanges++;
+                if(st != ST_AT_GOAL)
+                {
+                    ERROR_PRINT("%s step %u: %s waiting for OPR 0x%x", name, step, (st & ST_ERR) ? "error" : "timeout", (uint)insn.u[0]);
+                    bRet = false;
+                }
+                break;
+            }
+            case SOP_SAMPLE:
+            {
+                double sum = 0;
+                char buf[64];
+                for(uint32_t i = 0; bRet && (i < insn.u[0]); i++)
+                {
+                    if(i > 0)
+                        SLEEP_MS(&ts, SCRIPT_SAMPLE_MS);
+                    exchanges++;
+                    if(!serial_fd_do(fd, insn.str[0], buf, sizeof(buf), NULL))
+                    {
+                        ERROR_PRINT("%s step %u: %s failed", name, step, insn.str[0]);
+                        bRet = false;
+                        break;
+                    }
+                    sum += strtod(buf, NULL);
+                }
+                reg = sum / insn.u[0];
+                break;
+            }
+            case SOP_ASSERT:
+                if(!(fabs(reg - insn.num[0]) <= insn.num[1]))
+                {
+                    ERROR_PRINT("%s step %u: sampled %f, expected %f +/- %f", name, step, reg, insn.num[0], insn.num[1]);
+                    bRet = false;
+                }
+                break;
+            case SOP_PROMPT:
+                if(!operator_confirm("%s", insn.str[0]))
+                    bRet = false;
+                break;
+            default:
+                ERROR_PRINT("%s step %u: bad instruction %d", name, step, (int)insn.op);
+                bRet = false;
+                break;
+        }
+    }
+
+    log_script("%s|steps=%u|exchanges=%u|t=%llu|%s", name, step, exchanges, (long long unsigned)(time_in_ms() - start_ms), bRet ? "pass" : "fail");
+    return bRet;
+}
+
+//Which devices the script talks to, one bit per SCRIPT_DEV
+uint32_t script_devices(const Script *script)
+{
+    uint32_t devices = 0;
+    uint32_t pc = 0;
+    ScriptInsn insn;
+    while(script_decode(script, &pc, &insn) && (insn.op != SOP_END))
+    {
+        if(insn.op == SOP_DEVICE)
+            devices |= 1u << insn.u[0];
+    }
+    return devices;
+}
+
+bool script_asks_operator(const Script *script)
+{
+    uint32_t pc = 0;
+    ScriptInsn insn;
+    while(script_decode(script, &pc, &insn) && (insn.op != SOP_END))
+    {
+        if(insn.op == SOP_PROMPT)
+            return true;
+    }
+    return false;
+}
+
+bool script_run_test(const ProcTest *test)
+{
+    return script_run(&test->script, test->test_name);
+}
@@ -0,0 +1,47 @@
+#pragma once
+//Test procedures defined as data, compiled to bytecode and run by an interpreter on top of the serial layer
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "test.h"
+
+//Operands follow the opcode inline, strings as a length byte, the characters and a NUL, numbers in host order
+typedef enum {
+    SOP_END = 0,
+    SOP_DEVICE,      //u8 device
+    SOP_SEND,        //str command
+    SOP_EXPECT_STR,  //str query, str expected
+    SOP_EXPECT_FP,   //str query, f64 expected, f64 tolerance
+    SOP_WAIT_OPR,    //u32 OPR mask, u32 timeout ms
+    SOP_SAMPLE,      //str query, u32 count, the mean goes in the register
+    SOP_ASSERT,      //f64 expected, f64 tolerance, checked against the register
+    SOP_PROMPT,      //str question for the operator
+    NUM_SOP
+} SOP;
+
+typedef enum {
+    SCRIPT_DEV_MASTER = 0,
+    SCRIPT_DEV_SLAVE,
+    SCRIPT_DEV_LSU
+} SCRIPT_DEV;
+
+//A script is a run of the shared bytecode arena, always ending in SOP_END
+typedef struct Script {
+    const uint8_t *code;
+    uint32_t len;
+    uint32_t num_steps;
+} Script;
+
+void script_clear(void);
+bool script_begin(Script *script, const char *device);
+bool script_compile_step(Script *script, char **fields, const int num_fields, char *err, const size_t errsize);
+bool script_run(const Script *script, const char *name);
+uint32_t script_devices(const Script *script);
+bool script_asks_operator(const Script *script);
+
+typedef struct ProcTest {
+    _TEST;
+    Script script;
+} ProcTest;
+bool script_run_test(const ProcTest *test);
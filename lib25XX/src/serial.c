@@ -16,6 +16,7 @@
 
 #include "utility.h"
 #include "serial.h"
+#include "status.h"
 
 typedef enum {
     SCPIDeviceType_Master = 1 << 0,
@@ -56,7 +57,15 @@ static inline int serial_init_device(const char *path);
 static inline int serial_try_read(const int fd, char *buf, const size_t bufsize);
 static inline bool serial_write(const int fd, const char *str);
 static inline int serial_read_or_timeout(const int fd, char *buf, const size_t bufsize, const uint64_t timeout);
-static void *serial_check_device(void *_instance);
+static inline bool serial_wait_writable(const int fd, const uint64_t timeout);
+static int serial_query_sequential(const int fd, const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields);
+static int serial_fd_query_compound_locked(const int fd, const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields);
+static int serial_drain_error_queue_locked(const int fd, SCPIErrorQueue *errq);
+static bool serial_fd_transact_locked(const int fd, const char *cmd, void *result, size_t result_size, int *num_result_read, SCPIErrorQueue *errq);
+static void *serial_probe_device(void *_found);
+static bool serial_self_test(const int fd, int *result);
+static inline void serial_lock(const int fd);
+static inline void serial_unlock(const int fd);
 
 int serial_init_device(const char *path)
 {
@@ -112,154 +121,275 @@ SCPIDeviceManager *serial_get_SDM()
     return &SDM;
 }
 
-typedef struct SDevGlobal{
-    SCPIDeviceManager *sdm;
-    const char *master_sn;
-    const char *slave_sn;
-} SDevGlobal;
-
-typedef struct SDevInstance{
-    const SDevGlobal *sDev;
-    const char *device;
-} SDevInstance;
-
-void *serial_check_device(void *_instance)
+//The ports are probed from the moment the process starts, while the operator types, the serial numbers entered are
+//matched against what was found afterwards
+#define SERIAL_DISCOVER_MAX 32
+
+typedef struct SDevFound {
+    const char *path;
+    int fd;
+    bool idn_ok;
+    char idn[256];
+    bool has_sn;
+    char sn[32];
+    bool lsu;
+    int tst;            //*TST? reply, -1 if the device didn't answer
+    uint64_t done_ms;
+} SDevFound;
+
+typedef struct SDevDiscovery {
+    bool started;
+    bool globbed;
+    glob_t glob_results;
+    uint64_t start_ms;
+    uint num_devs;
+    pthread_t threads[SERIAL_DISCOVER_MAX];
+    bool threaded[SERIAL_DISCOVER_MAX];
+    SDevFound devs[SERIAL_DISCOVER_MAX];
+} SDevDiscovery;
+static SDevDiscovery Discovery;
+
+//Nothing is printed from here, the operator is still at the prompts and the log isn't open yet
+void *serial_probe_device(void *_found)
 {
-    SDevInstance *instance = (SDevInstance*)_instance;
-    SCPIDeviceManager *sdm = instance->sDev->sdm;
-    const char *master_sn = instance->sDev->master_sn;
-    const char *slave_sn = instance->sDev->slave_sn;
-    
-    bool bRet = true;
-    
-    debug_serial("glob | Device %s found", instance->device);
-    int fd = serial_init_device(instance->device);
-    if(fd == -1)
-    {                
-        error_serial("%s could not be initialized", instance->device);
-        return (void*)true;    
-    }
-    
-    
-    char buf[256];
-    if(!serial_fd_do(fd, "*IDN?", buf, sizeof(buf), 0))
-    {
-        debug_serial("*IDN? failed for device: %s", instance->device);
-    }
-    else
+    SDevFound *found = (SDevFound*)_found;
+    found->tst = -1;
+
+    debug_serial("glob | Device %s found", found->path);
+    found->fd = serial_init_device(found->path);
+    if(found->fd != -1)
     {
-        const char *device_name = "SCPI Unknown";
-        char sn[32];
-        if(parse_sn(sn, buf))
-        {
-            if(strncmp(sn, master_sn, strlen(master_sn)) == 0) 
-            {
-                sdm->master.fd = fd;
-                debug_serial("SCPI Master set to fd %d", fd); 
-                device_name = "SCPI Master";                       
-            }
-            else if(strncmp(sn, slave_sn, strlen(slave_sn)) == 0)
-            {
-                sdm->slave.fd = fd;
-                debug_serial("SCPI Slave set to fd %d", fd);
-                device_name = "SCPI Slave";
-            }
-            else
-            {
-                error_serial("SN %s not expected", sn);
-                bRet = false;
-            }
-        }
-        else if(strstr(buf, "LSU") != NULL)
+        found->idn_ok = serial_fd_do(found->fd, "*IDN?", found->idn, sizeof(found->idn), 0);
+        if(found->idn_ok)
         {
-            sdm->lsu.fd = fd;
-            debug_serial("LSU set to fd %d", fd);
-            device_name = "SCPI LSU";
+            found->has_sn = parse_sn(found->sn, found->idn);
+            found->lsu = !found->has_sn && (strstr(found->idn, "LSU") != NULL);
+            //self test of the ADTS, POST of the LSU
+            int tst;
+            if((found->has_sn || found->lsu) && serial_self_test(found->fd, &tst))
+                found->tst = tst;
+            serial_fd_do(found->fd, "*CLS", NULL, 0, NULL);
         }
-        else
-        {
-            error_serial("Unknown SCPI device connected");
-            bRet = false;
-        }
-        OUTPUT_PRINT("%s: %s", device_name, buf);
-        serial_fd_do(fd, "*CLS", NULL, 0, NULL);        
     }
-    
-    return (void*)bRet;
+    found->done_ms = time_in_ms();
+    return NULL;
+}
 
+//The self test can take longer than an ordinary reply, a missing answer is given one longer wait before it's reported
+#define SERIAL_SELF_TEST_MS 10000
+bool serial_self_test(const int fd, int *result)
+{
+    if(serial_integer_cmd(fd, "*TST?", result))
+        return true;
+
+    char buf[64];
+    bool bRet = false;
+    serial_lock(fd);
+    tcflush(fd, TCIFLUSH);
+    if(serial_write(fd, "*TST?") && (serial_read_or_timeout(fd, buf, sizeof(buf), SERIAL_SELF_TEST_MS) > 0))
+    {
+        bRet = (strncmp(buf, "ERROR", strlen("ERROR")) != 0);
+        if(bRet)
+            *result = atoi(buf);
+    }
+    if(!bRet)
+        tcflush(fd, TCIFLUSH);
+    serial_unlock(fd);
+    return bRet;
 }
 
-bool serial_init(SCPIDeviceManager *sdm, const char *master_sn, const char *slave_sn)
-{   
+bool serial_discover_start()
+{
+    if(Discovery.started)
+        return Discovery.globbed;
+    Discovery.started = true;
+    Discovery.start_ms = time_in_ms();
+
     #ifdef LOG_SERIAL
         int serial_com_log = open("com.log", O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if((serial_com_log == -1)||((FDM_SER_LOG = FDM_register_fd(serial_com_log)) == FDM_INVALID))
-            return false;        
+        if(serial_com_log != -1)
+            FDM_SER_LOG = FDM_register_fd(serial_com_log);
     #endif 
 
-    sdm->master.fd = -1;
-    sdm->slave.fd = -1;
-    sdm->lsu.fd = -1;
-    bool bRet = true;
-    glob_t glob_results;
-    
     #if (SERIAL_MODE & SERIAL_DEVICE_USB)
         const char *globstring = "/dev/ttyUSB*";
     #elif (SERIAL_MODE & SERIAL_DEVICE_COM)
         const char *globstring = "/dev/ttyS*";
     #elif (SERIAL_MODE & SERIAL_DEVICE_ETHERNET)
-        OUTPUT_PRINT("WARNING: Ethernet device not implemented, loading from /dev/ttyS*");
         const char *globstring = "/dev/ttyS*";
     #else
         #error "UNKNOWN SERIAL MODE"
     #endif
 
+    if(glob(globstring, 0, NULL, &Discovery.glob_results) != 0)
+        return false;
+    Discovery.globbed = true;
+
+    //check each possible device in parallel
+    Discovery.num_devs = (Discovery.glob_results.gl_pathc < SERIAL_DISCOVER_MAX) ? Discovery.glob_results.gl_pathc : SERIAL_DISCOVER_MAX;
+    for(uint i = 0; i < Discovery.num_devs; i++)
+    {
+        Discovery.devs[i].path = Discovery.glob_results.gl_pathv[i];
+        Discovery.threaded[i] = (pthread_create(&Discovery.threads[i], NULL, &serial_probe_device, &Discovery.devs[i]) == 0);
+        //out of threads, this port is probed here instead
+        if(!Discovery.threaded[i])
+            serial_probe_device(&Discovery.devs[i]);
+    }
+    return true;
+}
+
+bool serial_init(SCPIDeviceManager *sdm, const char *master_sn, const char *slave_sn)
+{   
+    #ifdef LOG_SERIAL
+        if(FDM_SER_LOG == FDM_INVALID)
+            return false;
+    #endif 
+
+    sdm->master.fd = -1;
+    sdm->slave.fd = -1;
+    sdm->lsu.fd = -1;
+    bool bRet = true;
+
+    #if (SERIAL_MODE & SERIAL_DEVICE_ETHERNET) && !(SERIAL_MODE & (SERIAL_DEVICE_USB | SERIAL_DEVICE_COM))
+        OUTPUT_PRINT("WARNING: Ethernet device not implemented, loading from /dev/ttyS*");
+    #endif
+
     #ifdef DEBUG
     OUTPUT_PRINT("ls /dev/");
     system("ls /dev/");
     #endif
 
-    if(glob(globstring, 0, NULL, &glob_results) == 0)
+    //started by lib_init before the prompts, here only if it wasn't
+    const uint64_t wait_start = time_in_ms();
+    if(!serial_discover_start())
     {
-        //check each possible device in parallel
-        SDevGlobal sdg;
-        sdg.sdm = sdm;
-        sdg.master_sn = master_sn;
-        sdg.slave_sn = slave_sn;
-        
-        SDevInstance sdi[glob_results.gl_pathc];
-        pthread_t threads[glob_results.gl_pathc];
-        for(uint i = 0; i < glob_results.gl_pathc; i++)
+        ERROR_PRINT("Error, No serial devices found");
+        return false;
+    }
+    uint64_t ready_ms = Discovery.start_ms;
+    for(uint i = 0; i < Discovery.num_devs; i++)
+    {
+        if(Discovery.threaded[i])
+            pthread_join(Discovery.threads[i], NULL);
+        if(Discovery.devs[i].done_ms > ready_ms)
+            ready_ms = Discovery.devs[i].done_ms;
+    }
+    const uint64_t waited_ms = time_in_ms() - wait_start;
+
+    for(uint i = 0; i < Discovery.num_devs; i++)
+    {
+        SDevFound *found = &Discovery.devs[i];
+        const char *device_name = "SCPI Unknown";
+        bool used = false;
+        if(found->fd == -1)
         {
-            sdi[i].sDev = &sdg;
-            sdi[i].device = glob_results.gl_pathv[i];
-            pthread_create(&threads[i], NULL, &serial_check_device, &sdi[i]);
-        }  
-        
-        for(uint i = 0; i < glob_results.gl_pathc; i++)
+            error_serial("%s could not be initialized", found->path);
+            continue;
+        }
+        if(!found->idn_ok)
         {
-            bool tempRet;
-            pthread_join(threads[i], (void**)&tempRet);
-            if(!tempRet)
+            debug_serial("*IDN? failed for device: %s", found->path);
+        }
+        else
+        {
+            if(found->has_sn)
+            {
+                if(strncmp(found->sn, master_sn, strlen(master_sn)) == 0) 
+                {
+                    sdm->master.fd = found->fd;
+                    snprintf(sdm->master.sn, sizeof(sdm->master.sn), "%s", found->sn);
+                    debug_serial("SCPI Master set to fd %d", found->fd); 
+                    device_name = "SCPI Master";                       
+                    used = true;
+                }
+                else if(strncmp(found->sn, slave_sn, strlen(slave_sn)) == 0)
+                {
+                    sdm->slave.fd = found->fd;
+                    snprintf(sdm->slave.sn, sizeof(sdm->slave.sn), "%s", found->sn);
+                    debug_serial("SCPI Slave set to fd %d", found->fd);
+                    device_name = "SCPI Slave";
+                    used = true;
+                }
+                else
+                {
+                    error_serial("SN %s not expected", found->sn);
+                    bRet = false;
+                }
+                //a unit under test that fails its own self test isn't worth testing, one that never answered isn't known to
+                if(used && (found->tst == -1))
+                {
+                    ERROR_PRINT("%s did not answer *TST?, self test not checked", device_name);
+                }
+                else if(used && (found->tst != 1))
+                {
+                    ERROR_PRINT("%s self test failed: %d", device_name, found->tst);
+                    bRet = false;
+                }
+            }
+            else if(found->lsu)
+            {
+                sdm->lsu.fd = found->fd;
+                debug_serial("LSU set to fd %d", found->fd);
+                device_name = "SCPI LSU";
+                used = true;
+                //the LSU tests check the POST again before they run
+                if(found->tst == -1)
+                    ERROR_PRINT("LSU did not answer *TST?, POST not checked");
+                else if(found->tst != 1)
+                    ERROR_PRINT("LSU POST failed: %d", found->tst);
+            }
+            else
+            {
+                error_serial("Unknown SCPI device connected");
                 bRet = false;
-        }    
-    }
-    else
-    {
-        ERROR_PRINT("Error, No serial devices found");
-        bRet = false;
+            }
+            OUTPUT_PRINT("%s: %s", device_name, found->idn);
+        }
+        log_format_line(FDM_TEST_LOG, "DISCOVER|%s|device=%s|tst=%d|t=%llu", found->path, device_name, found->tst,
+            (long long unsigned)(found->done_ms - Discovery.start_ms));
+        if(!used)
+            close(found->fd);
     }
-    globfree(&glob_results); 
+    log_format_line(FDM_TEST_LOG, "DISCOVER|ports=%u|ready=%llu|waited=%llu", Discovery.num_devs,
+        (long long unsigned)(ready_ms - Discovery.start_ms), (long long unsigned)waited_ms);
+    globfree(&Discovery.glob_results); 
     SDM = *sdm;
     
     return bRet;
 }
 
-//BAD HACK 
-static uint64 last_time;
-void update_last_time()
+//Each port gets a lock so the background samplers and the control thread don't interleave exchanges,
+//recursive because an exchange that gets ERROR drains the error queue while holding it
+#define SERIAL_PORTS 64
+static pthread_mutex_t Serial_Locks[SERIAL_PORTS];
+static pthread_once_t Serial_Locks_Once = PTHREAD_ONCE_INIT;
+
+static void serial_locks_init()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for(uint i = 0; i < SERIAL_PORTS; i++)
+        pthread_mutex_init(&Serial_Locks[i], &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static inline void serial_lock(const int fd)
+{
+    pthread_once(&Serial_Locks_Once, serial_locks_init);
+    pthread_mutex_lock(&Serial_Locks[fd & (SERIAL_PORTS-1)]);
+}
+
+static inline void serial_unlock(const int fd)
 {
-    last_time = time_in_ms();
+    pthread_mutex_unlock(&Serial_Locks[fd & (SERIAL_PORTS-1)]);
+}
+
+//BAD HACK, at least it is per port now
+static uint64 last_time[SERIAL_PORTS];
+void update_last_time(const int fd)
+{
+    last_time[fd & (SERIAL_PORTS-1)] = time_in_ms();
 }
 
 int serial_try_read(const int fd, char *buf, const size_t bufsize)
@@ -271,7 +401,7 @@ int serial_try_read(const int fd, char *buf, const size_t bufsize)
     #endif 
     if((n = read(fd, buf, bufsize)) > 0)
     {
-        update_last_time();
+        update_last_time(fd);
         buf[n-1] = '\0';
         log_serial("RECV|t=%llu|(%d): %s", time_in_ms(), n, buf);
         
@@ -310,10 +440,10 @@ bool serial_integer_cmd(const int fd, const char *cmd, int *result)
 
 
 #define TIME_TO_WAIT 100
-void wait_for_time_to_write()
+void wait_for_time_to_write(const int fd)
 {
     struct timespec ts;
-    uint64 time_elapsed = time_in_ms() - last_time;
+    uint64 time_elapsed = time_in_ms() - last_time[fd & (SERIAL_PORTS-1)];
     if(time_elapsed < TIME_TO_WAIT)
     {
         SLEEP_MS(&ts, TIME_TO_WAIT - time_elapsed);
@@ -323,12 +453,17 @@ void wait_for_time_to_write()
 bool serial_write(const int fd, const char *str)
 {   
     //store in writeable area, append message end character
-    char buf[256];
-    strcpy(buf, str);
-    size_t message_len = strlen(buf)+1; 
+    char buf[512];
+    size_t message_len = strlen(str)+1; 
+    if(message_len > sizeof(buf))
+    {
+        error_serial("Command too long to send (%lu): %.32s...", message_len, str);
+        return false;
+    }
+    memcpy(buf, str, message_len);
     buf[message_len-1] = '\n';
 
-    wait_for_time_to_write();
+    wait_for_time_to_write(fd);
     
     bool bRet = (write(fd, buf, message_len) > 0);
     
@@ -338,7 +473,25 @@ bool serial_write(const int fd, const char *str)
     return bRet;    
 }
 
-bool serial_fd_do(const int fd, const char *cmd, void *result, size_t result_size, int *num_result_read)
+//Wait for room in the output buffer instead of a fixed sleep, false if there is none by the timeout
+#define SERIAL_WRITE_RETRY_MS 4000
+bool serial_wait_writable(const int fd, const uint64_t timeout)
+{
+    fd_set wfds;
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    struct timeval tv = {.tv_sec = timeout / 1000, .tv_usec = (timeout % 1000) * 1000};
+    return (select(fd + 1, NULL, &wfds, NULL, &tv) > 0);
+}
+
+typedef enum {
+    XCHG_FAIL  = 0,
+    XCHG_OK    = 1 << 0,
+    XCHG_ERROR = 1 << 1  //device replied ERROR
+} XCHG;
+
+//One write and read, without any error queue handling
+static XCHG serial_fd_exchange(const int fd, const char *cmd, void *result, size_t result_size, int *num_result_read)
 {      
     //Setup some variables to store data if not provided by caller
     char buf[256];
@@ -351,34 +504,281 @@ bool serial_fd_do(const int fd, const char *cmd, void *result, size_t result_siz
     if(num_result_read == NULL)
         num_result_read = &n;
 
-    //DEBUG_PRINT("%p %p buf, &buf", buf, &buf);
     //Loop until confirmed success or failure
     for(int i = 0; i < 3; i++) {
-    //DEBUG_PRINT("%p result", result);
 
-    //Fail if a write fails and still fails after a sleep  
-    if(((!serial_write(fd, cmd)) && (sleep(4) >= 0))&&  (!serial_write(fd, cmd)))
-        return false;
+    //Fail if a write fails and still fails once the port can take data again
+    if((!serial_write(fd, cmd)) && ((!serial_wait_writable(fd, SERIAL_WRITE_RETRY_MS)) || (!serial_write(fd, cmd))))
+        return XCHG_FAIL;
 
     //Read for one second max
     if((*num_result_read = serial_read_or_timeout(fd, result, result_size, 1000)) > 0) 
     {
         //See if what we read was an ERROR 
         if(strncmp((const char*)result, "ERROR", strlen("ERROR")) == 0)
-        { 
-            //We recieved an error, get it and return false           
-            serial_fd_do(fd, ":SYST:ERR?", result, result_size, num_result_read); 
-            return false; 
-        }
+            return XCHG_ERROR; 
+        
         //We RECV non error data, success
-        return true; 
+        return XCHG_OK; 
     }
     else if(result == buf)
-        return true; //We weren't expecting a response and did not RECV ERROR, success 
+        return XCHG_OK; //We weren't expecting a response and did not RECV ERROR, success 
     
     }
  
-    return false; //We didnt recieve a response after a certain amount of attempts
+    return XCHG_FAIL; //We didnt recieve a response after a certain amount of attempts
+}
+
+bool serial_parse_error(SCPIError *error, const char *src)
+{
+    //expected form: -113,"Undefined header"
+    char *end;
+    error->code = (int)strtol(src, &end, 10);
+    if((end == src) || (*end != ','))
+        return false;
+    
+    const char *msg = end + 1;
+    while(*msg == ' ')
+        msg++;
+    if(*msg == '"')
+        msg++;
+    
+    size_t len = strcspn(msg, "\"");
+    if(len >= sizeof(error->message))
+        len = sizeof(error->message) - 1;
+    memcpy(error->message, msg, len);
+    error->message[len] = '\0';
+    return true;
+}
+
+//split a reply on ';' not inside a quoted string, returns number of fields
+static int serial_split_compound(char *buf, char **fields, const int max_fields)
+{
+    int num_fields = 0;
+    bool quoted = false;
+    fields[num_fields++] = buf;
+    for(char *c = buf; *c != '\0'; c++)
+    {
+        if(*c == '"')
+            quoted = !quoted;
+        else if((*c == ';') && !quoted)
+        {
+            if(num_fields == max_fields)
+                break;
+            *c = '\0';
+            fields[num_fields++] = c + 1;
+        }
+    }
+    return num_fields;
+}
+
+static int serial_query_compound_raw(const int fd, const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields, XCHG *xchg)
+{
+    char cmd[512];
+    size_t cmd_len = 0;
+    *xchg = XCHG_FAIL;
+    for(int i = 0; i < num_queries; i++)
+    {
+        int written = snprintf(cmd + cmd_len, sizeof(cmd) - cmd_len, "%s%s", (i == 0) ? "" : ";", queries[i]);
+        if((written < 0) || ((size_t)written >= (sizeof(cmd) - cmd_len)))
+            return -1;
+        cmd_len += written;
+    }
+
+    int n;
+    if((*xchg = serial_fd_exchange(fd, cmd, buf, bufsize, &n)) != XCHG_OK)
+        return -1;
+    return serial_split_compound(buf, fields, num_queries);
+}
+
+//Each query is issued on its own, fields point into consecutive parts of buf
+static int serial_query_sequential(const int fd, const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields)
+{
+    size_t used = 0;
+    for(int i = 0; i < num_queries; i++)
+    {
+        int n;
+        if((bufsize - used) < 2)
+            return -1;
+        fields[i] = buf + used;
+        if(!serial_fd_do(fd, queries[i], fields[i], bufsize - used, &n))
+            return -1;
+        used += strlen(fields[i]) + 1;
+    }
+    return num_queries;
+}
+
+int serial_fd_query_compound(const int fd, const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields)
+{
+    serial_lock(fd);
+    int num_fields = serial_fd_query_compound_locked(fd, queries, num_queries, buf, bufsize, fields);
+    serial_unlock(fd);
+    return num_fields;
+}
+
+static int serial_fd_query_compound_locked(const int fd, const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields)
+{
+    assert(num_queries <= SERIAL_COMPOUND_MAX);
+    #ifdef SERIAL_COMPOUND_QUERIES
+        XCHG xchg;
+        int num_fields = serial_query_compound_raw(fd, queries, num_queries, buf, bufsize, fields, &xchg);
+        if(xchg == XCHG_ERROR)
+        {
+            SCPIErrorQueue errq;
+            serial_drain_error_queue_locked(fd, &errq);
+            for(int i = 0; i < errq.count; i++)
+                error_serial("%s;... -> %d,\"%s\"", queries[0], errq.errors[i].code, errq.errors[i].message);
+            
+            //retry one at a time so the failing query is identified
+            return serial_query_sequential(fd, queries, num_queries, buf, bufsize, fields);
+        }
+        if(num_fields != num_queries)
+        {
+            error_serial("Compound query returned %d of %d fields", num_fields, num_queries);
+            return -1;
+        }
+        return num_fields;
+    #else
+        return serial_query_sequential(fd, queries, num_queries, buf, bufsize, fields);
+    #endif
+}
+
+int serial_drain_error_queue(const int fd, SCPIErrorQueue *errq)
+{
+    serial_lock(fd);
+    int count = serial_drain_error_queue_locked(fd, errq);
+    serial_unlock(fd);
+    return count;
+}
+
+static int serial_drain_error_queue_locked(const int fd, SCPIErrorQueue *errq)
+{
+    static const char *const err_queries[SCPI_ERROR_BATCH] = {[0 ... SCPI_ERROR_BATCH-1] = ":SYST:ERR?"};
+    errq->count = 0;
+    errq->truncated = false;
+
+    while(errq->count < SCPI_ERROR_QUEUE_DEPTH)
+    {
+        int batch = SCPI_ERROR_QUEUE_DEPTH - errq->count;
+        if(batch > SCPI_ERROR_BATCH)
+            batch = SCPI_ERROR_BATCH;
+
+        char buf[512];
+        char *fields[SCPI_ERROR_BATCH];
+        int num_fields = -1;
+        #ifdef SERIAL_COMPOUND_QUERIES
+            XCHG xchg;
+            num_fields = serial_query_compound_raw(fd, err_queries, batch, buf, sizeof(buf), fields, &xchg);
+        #endif
+        if(num_fields < 0)
+        {
+            //one at a time, this never recurses into another drain
+            int n;
+            if(serial_fd_exchange(fd, err_queries[0], buf, sizeof(buf), &n) != XCHG_OK)
+                break;
+            fields[0] = buf;
+            num_fields = 1;
+        }
+
+        for(int i = 0; i < num_fields; i++)
+        {
+            SCPIError *error = &errq->errors[errq->count];
+            if(!serial_parse_error(error, fields[i]))
+            {
+                error_serial("Could not parse error queue entry: %s", fields[i]);
+                return errq->count;
+            }
+            if(error->code == 0)
+                return errq->count;
+            errq->count++;
+        }
+    }
+
+    errq->truncated = (errq->count == SCPI_ERROR_QUEUE_DEPTH);
+    return errq->count;
+}
+
+bool serial_fd_transact(const int fd, const char *cmd, void *result, size_t result_size, int *num_result_read, SCPIErrorQueue *errq)
+{
+    serial_lock(fd);
+    bool bRet = serial_fd_transact_locked(fd, cmd, result, result_size, num_result_read, errq);
+    serial_unlock(fd);
+    return bRet;
+}
+
+static bool serial_fd_transact_locked(const int fd, const char *cmd, void *result, size_t result_size, int *num_result_read, SCPIErrorQueue *errq)
+{
+    if(errq != NULL)
+    {
+        errq->count = 0;
+        errq->truncated = false;
+    }
+
+    XCHG xchg = serial_fd_exchange(fd, cmd, result, result_size, num_result_read);
+    if(xchg != XCHG_ERROR)
+        return (xchg == XCHG_OK);
+
+    //We recieved an error, collect everything queued behind it so later polls don't see stale errors
+    SCPIErrorQueue local_errq;
+    if(errq == NULL)
+        errq = &local_errq;
+    serial_drain_error_queue_locked(fd, errq);
+    for(int i = 0; i < errq->count; i++)
+        error_serial("%s -> %d,\"%s\"", cmd, errq->errors[i].code, errq->errors[i].message);
+    if(errq->truncated)
+        error_serial("%s -> more than %d errors queued", cmd, SCPI_ERROR_QUEUE_DEPTH);
+
+    //keep handing the first error back in result like :SYST:ERR? would
+    if((result != NULL) && (errq->count > 0))
+    {
+        int n = snprintf(result, result_size, "%d,\"%s\"", errq->errors[0].code, errq->errors[0].message);
+        if(num_result_read != NULL)
+            *num_result_read = n + 1;
+    }
+    return false;
+}
+
+bool serial_fd_do(const int fd, const char *cmd, void *result, size_t result_size, int *num_result_read)
+{
+    return serial_fd_transact(fd, cmd, result, result_size, num_result_read, NULL);
+}
+
+//*OPC? is only answered once every pending operation has finished, so reading its 1 is the sync point.
+//Returns false if the device replied ERROR or the 1 didn't come by the deadline
+bool serial_fd_wait_complete(const int fd, const uint64_t timeout)
+{
+    char buf[64];
+    bool bRet = false;
+    bool error = false;
+    const uint64_t deadline = time_in_ms() + timeout;
+    serial_lock(fd);
+    if(serial_write(fd, "*OPC?"))
+    {
+        uint64_t now;
+        while(!bRet && !error && ((now = time_in_ms()) < deadline))
+        {
+            if(serial_read_or_timeout(fd, buf, sizeof(buf), deadline - now) > 0)
+            {
+                error = (strncmp(buf, "ERROR", strlen("ERROR")) == 0);
+                bRet = !error && (atoi(buf) == 1);
+            }
+        }
+    }
+    if(error)
+    {
+        SCPIErrorQueue errq;
+        serial_drain_error_queue_locked(fd, &errq);
+        for(int i = 0; i < errq.count; i++)
+            error_serial("*OPC? -> %d,\"%s\"", errq.errors[i].code, errq.errors[i].message);
+    }
+    else if(!bRet)
+    {
+        //a 1 arriving now would be read as the reply to the next exchange
+        tcflush(fd, TCIFLUSH);
+        error_serial("Operation not complete after %llu ms", (long long unsigned)timeout);
+    }
+    serial_unlock(fd);
+    return bRet;
 }
 
 void serial_close(SCPIDeviceManager *sdm)
@@ -386,6 +786,9 @@ void serial_close(SCPIDeviceManager *sdm)
     close(sdm->master.fd);
     close(sdm->slave.fd);
     close(sdm->lsu.fd);
+    status_forget_device(sdm->master.fd);
+    status_forget_device(sdm->slave.fd);
+    status_forget_device(sdm->lsu.fd);
 
     #ifdef LOG_SERIAL
         FDM_close(FDM_SER_LOG);        
@@ -1,5 +1,7 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 typedef enum SCPIType {
     SCPIType_ADTS = 1 << 0,
@@ -15,6 +17,7 @@ typedef _SCPIDevice SCPIDevice;
 
 typedef struct ADTS {
     _SCPIDevice;
+    char sn[32];
 } ADTS;
 
 typedef struct SCPIDeviceManager
@@ -26,10 +29,39 @@ typedef struct SCPIDeviceManager
 
 SCPIDeviceManager *serial_get_SDM();
 
+//Opens every port and asks for *IDN? and *TST? in the background, false if there are no ports
+bool serial_discover_start();
+//Waits for the discovery and picks the master and slave by the serial numbers entered
 bool serial_init(SCPIDeviceManager *sdm, const char *master_sn, const char *slave_sn);
 
 bool serial_fd_do(int fd, const char *cmd, void *result, size_t result_size, int *num_result_read);
+
+//SCPI error queue, drained in batches of SCPI_ERROR_BATCH :SYST:ERR? queries up to SCPI_ERROR_QUEUE_DEPTH entries
+#define SCPI_ERROR_QUEUE_DEPTH 8
+#define SCPI_ERROR_BATCH       4
+#define SCPI_ERROR_MSG_LEN     96
+typedef struct SCPIError {
+    int  code;
+    char message[SCPI_ERROR_MSG_LEN];
+} SCPIError;
+
+typedef struct SCPIErrorQueue {
+    int       count;
+    bool      truncated; //the depth was reached before the device reported 0,"No error"
+    SCPIError errors[SCPI_ERROR_QUEUE_DEPTH];
+} SCPIErrorQueue;
+
+//Same as serial_fd_do, but if the device replies ERROR the whole error queue is drained into errq
+bool serial_fd_transact(const int fd, const char *cmd, void *result, size_t result_size, int *num_result_read, SCPIErrorQueue *errq);
+int serial_drain_error_queue(const int fd, SCPIErrorQueue *errq);
+bool serial_parse_error(SCPIError *error, const char *src);
+
+//Send several queries joined with ';' and split the reply into fields, returns the number of fields or -1
+#define SERIAL_COMPOUND_MAX 16
+int serial_fd_query_compound(const int fd, const char *const *queries, const int num_queries, char *buf, const size_t bufsize, char **fields);
 bool serial_integer_cmd(const int fd, const char *cmd, int *result);
+//Block until the device reports every previous command complete, or timeout ms
+bool serial_fd_wait_complete(const int fd, const uint64_t timeout);
 void serial_close(SCPIDeviceManager *sdm);
 
 
@@ -54,3 +86,7 @@ void serial_close(SCPIDeviceManager *sdm);
 /* Set your desired serial device when compiling here */
 #define SERIAL_MODE SERIAL_MODE_USB
 
+/* Comment out if the connected devices do not accept ';' separated compound queries,
+   compound queries are then issued one at a time */
+#define SERIAL_COMPOUND_QUERIES
+
@@ -0,0 +1,166 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "stability.h"
+#include "utility.h"
+
+#define log_stability(fmt, ...) log_format_line(FDM_TEST_LOG, "STABILITY|" fmt, ##__VA_ARGS__)
+
+#define STABILITY_MIN_SAMPLES 16
+
+typedef struct UnitsCriteria {
+    const char *units;
+    StabilityCriteria criteria;
+} UnitsCriteria;
+
+//Defaults per unit, {max stddev, max slope/min, max offset, drift slope/min}
+static const UnitsCriteria Default_Criteria[] = {
+    {"FT",   {3.0,   10.0,  10.0,  60.0}},
+    {"KTS",  {0.3,   1.0,   1.0,   6.0}},
+    {"INHG", {0.002, 0.005, 0.005, 0.03}},
+};
+
+static inline void stability_kernel(const double *t, const double *y, const int n, StabilityStats *stats);
+static inline bool stability_channel_ok(const StabilityChannel *channel);
+static inline bool stability_channel_drift(const StabilityChannel *channel);
+
+bool stability_default_criteria(StabilityCriteria *criteria, const char *units)
+{
+    for(uint i = 0; i < LENGTH_2D(Default_Criteria); i++)
+    {
+        if(strcmp(units, Default_Criteria[i].units) == 0)
+        {
+            *criteria = Default_Criteria[i].criteria;
+            return true;
+        }
+    }
+    return false;
+}
+
+void stability_init(StabilityDetector *sd, const uint64_t window_ms)
+{
+    sd->window_ms = window_ms;
+    sd->min_samples = STABILITY_MIN_SAMPLES;
+    sd->start_ms = time_in_ms();
+    sd->first = 0;
+    sd->count = 0;
+    sd->ps_channel.enabled = false;
+    sd->pt_channel.enabled = false;
+}
+
+void stability_set_channel(StabilityChannel *channel, const double setpoint, const StabilityCriteria *criteria)
+{
+    channel->enabled = true;
+    channel->setpoint = setpoint;
+    channel->criteria = *criteria;
+}
+
+void stability_add(StabilityDetector *sd, const TelemetrySample *sample)
+{
+    if(sample->time_ms < sd->start_ms)
+        return;
+
+    //drop samples that fell out of the window
+    const double now = (double)(sample->time_ms - sd->start_ms) / 60000.0;
+    const double window = (double)sd->window_ms / 60000.0;
+    while((sd->count > 0) && ((now - sd->t[sd->first]) > window))
+    {
+        sd->first++;
+        sd->count--;
+    }
+
+    //keep the window contiguous for the kernels
+    if((sd->first + sd->count) == STABILITY_MAX_SAMPLES)
+    {
+        if(sd->count == STABILITY_MAX_SAMPLES)
+        {
+            sd->first++;
+            sd->count--;
+        }
+        memmove(sd->t, &sd->t[sd->first], sd->count * sizeof(double));
+        memmove(sd->ps, &sd->ps[sd->first], sd->count * sizeof(double));
+        memmove(sd->pt, &sd->pt[sd->first], sd->count * sizeof(double));
+        sd->first = 0;
+    }
+
+    const int i = sd->first + sd->count++;
+    sd->t[i] = now;
+    sd->ps[i] = sample->ps;
+    sd->pt[i] = sample->pt;
+}
+
+//Mean, standard deviation and least squares slope in two passes over contiguous arrays. The sums are reordered by
+//the simd pragmas, built with SIMD_CFLAGS, so the loops vectorize without -ffast-math
+void stability_kernel(const double *t, const double *y, const int n, StabilityStats *stats)
+{
+    double sum_t = 0, sum_y = 0;
+    #pragma omp simd reduction(+:sum_t, sum_y)
+    for(int i = 0; i < n; i++)
+    {
+        sum_t += t[i];
+        sum_y += y[i];
+    }
+    const double mean_t = sum_t / n;
+    const double mean_y = sum_y / n;
+
+    double stt = 0, sty = 0, syy = 0;
+    #pragma omp simd reduction(+:stt, sty, syy)
+    for(int i = 0; i < n; i++)
+    {
+        const double dt = t[i] - mean_t;
+        const double dy = y[i] - mean_y;
+        stt += dt * dt;
+        sty += dt * dy;
+        syy += dy * dy;
+    }
+
+    stats->mean = mean_y;
+    stats->stddev = (n > 1) ? sqrt(syy / (n - 1)) : 0;
+    stats->slope = (stt > 0) ? (sty / stt) : 0;
+}
+
+bool stability_channel_ok(const StabilityChannel *channel)
+{
+    return (channel->stats.stddev <= channel->criteria.max_stddev) &&
+           (fabs(channel->stats.slope) <= channel->criteria.max_slope) &&
+           (fabs(channel->stats.mean - channel->setpoint) <= channel->criteria.max_offset);
+}
+
+bool stability_channel_drift(const StabilityChannel *channel)
+{
+    return fabs(channel->stats.slope) > channel->criteria.drift_slope;
+}
+
+//Only decides once the samples span a whole window
+STABILITY stability_evaluate(StabilityDetector *sd)
+{
+    if(sd->count < sd->min_samples)
+        return STABILITY_PENDING;
+
+    const double span_ms = (sd->t[sd->first + sd->count - 1] - sd->t[sd->first]) * 60000.0;
+    if(span_ms < (0.9 * sd->window_ms))
+        return STABILITY_PENDING;
+
+    bool ok = true, drift = false;
+    StabilityChannel *channels[2] = {&sd->ps_channel, &sd->pt_channel};
+    const double *values[2] = {&sd->ps[sd->first], &sd->pt[sd->first]};
+    for(int i = 0; i < 2; i++)
+    {
+        if(!channels[i]->enabled)
+            continue;
+        stability_kernel(&sd->t[sd->first], values[i], sd->count, &channels[i]->stats);
+        ok = ok && stability_channel_ok(channels[i]);
+        drift = drift || stability_channel_drift(channels[i]);
+    }
+
+    log_stability("t=%llu|n=%d|ps mean=%f sd=%f slope=%f|pt mean=%f sd=%f slope=%f", (long long unsigned)(time_in_ms() - sd->start_ms), sd->count,
+        sd->ps_channel.stats.mean, sd->ps_channel.stats.stddev, sd->ps_channel.stats.slope,
+        sd->pt_channel.stats.mean, sd->pt_channel.stats.stddev, sd->pt_channel.stats.slope);
+
+    if(drift)
+        return STABILITY_DRIFT;
+    return ok ? STABILITY_STABLE : STABILITY_PENDING;
+}
@@ -0,0 +1,54 @@
+#pragma once
+//Client side stability detection over telemetry samples
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "telemetry.h"
+
+#define STABILITY_MAX_SAMPLES 256
+
+typedef enum {
+    STABILITY_PENDING = 0,
+    STABILITY_STABLE  = 1 << 0,
+    STABILITY_DRIFT   = 1 << 1
+} STABILITY;
+
+//Limits for one channel, slopes are in units per minute
+typedef struct StabilityCriteria {
+    double max_stddev;
+    double max_slope;
+    double max_offset;  //from the setpoint
+    double drift_slope; //fail once the slope over a full window is above this
+} StabilityCriteria;
+
+typedef struct StabilityStats {
+    double mean;
+    double stddev;
+    double slope;
+} StabilityStats;
+
+typedef struct StabilityChannel {
+    bool   enabled;
+    double setpoint;
+    StabilityCriteria criteria;
+    StabilityStats    stats;
+} StabilityChannel;
+
+typedef struct StabilityDetector {
+    uint64_t window_ms;
+    int      min_samples;
+    uint64_t start_ms;
+    int      first;
+    int      count;
+    double   t[STABILITY_MAX_SAMPLES]; //minutes since start_ms
+    double   ps[STABILITY_MAX_SAMPLES];
+    double   pt[STABILITY_MAX_SAMPLES];
+    StabilityChannel ps_channel;
+    StabilityChannel pt_channel;
+} StabilityDetector;
+
+bool stability_default_criteria(StabilityCriteria *criteria, const char *units);
+void stability_init(StabilityDetector *sd, const uint64_t window_ms);
+void stability_set_channel(StabilityChannel *channel, const double setpoint, const StabilityCriteria *criteria);
+void stability_add(StabilityDetector *sd, const TelemetrySample *sample);
+STABILITY stability_evaluate(StabilityDetector *sd);
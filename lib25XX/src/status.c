@@ -3,144 +3,227 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "status.h"
 #include "serial.h"
 #include "command.h"
 #include "utility.h"
 
-typedef struct LastStatus {
-    STB stb;
-    QUE que;
-    ESB esb;
-    OPR opr;
-} LastStatus;
-
-// to do, list form for these macros?
-#define CHECK_ERROR_BIT(INT, COND) \
-do { if(INT & COND) \
-         ERROR_PRINT("Error: " #COND); } \
-while(0)           
-
-#define CHECK_OPR_BIT(INT, COND) \
-do { if(INT & COND) \
-         OUTPUT_PRINT("OPR: " #COND); } \
-while(0)
+#define STATUS_DEVICES 64
+
+#define STATUS_BIT(REG, BIT, KIND) {REG, BIT, #BIT, KIND}
+static const StatusBitName Status_Bits[] = {
+    STATUS_BIT(STATUS_REG_STB, STB_QUE,           STATUS_BIT_SILENT),
+    STATUS_BIT(STATUS_REG_STB, STB_ESB,           STATUS_BIT_SILENT),
+    STATUS_BIT(STATUS_REG_STB, STB_OPR,           STATUS_BIT_SILENT),
+    STATUS_BIT(STATUS_REG_QUE, QUE_PS_OVER,       STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_QUE, QUE_PT_OVER,       STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_QUE, QUE_PS_TRACK_LOSS, STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_QUE, QUE_PT_TRACK_LOSS, STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_QUE, QUE_PS_COEFF_ERR,  STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_QUE, QUE_PT_COEFF_ERR,  STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_ESB, ESB_OPC,           STATUS_BIT_SILENT),
+    STATUS_BIT(STATUS_REG_ESB, ESB_DDE,           STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_ESB, ESB_EXE,           STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_ESB, ESB_CME,           STATUS_BIT_ERROR),
+    STATUS_BIT(STATUS_REG_OPR, OPR_STABLE,        STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_RAMPING,       STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_LEAKT_STABLE,  STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_VOLUMET_DONE,  STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_PS_STABLE,     STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_PS_RAMPING,    STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_PT_STABLE,     STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_PT_RAMPING,    STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_SELFT_DONE,    STATUS_BIT_OUTPUT),
+    STATUS_BIT(STATUS_REG_OPR, OPR_GTG,           STATUS_BIT_OUTPUT),
+};
+
+//Last register values of one device
+typedef struct StatusTracker {
+    bool     valid;
+    uint32_t regs[STATUS_REG_MAX];
+    bool     have_pressure;
+    double   last_ps;
+    double   last_pt;
+} StatusTracker;
+
+typedef struct StatusSubscription {
+    bool            used;
+    STATUS_REG      reg;
+    uint32_t        mask;
+    Status_Listener listener;
+    void           *ctx;
+} StatusSubscription;
+
+static StatusTracker Trackers[STATUS_DEVICES];
+static StatusSubscription Subscriptions[STATUS_MAX_LISTENERS];
+static pthread_mutex_t Status_Lock = PTHREAD_MUTEX_INITIALIZER;
+//Held while the listeners are called so one that unsubscribed is never called after, recursive so a listener can
+//unsubscribe or take a snapshot itself
+static pthread_mutex_t Listener_Lock;
+static pthread_once_t Listener_Lock_Once = PTHREAD_ONCE_INIT;
+
+static inline void status_decode_changes(const int fd, const uint32_t *regs, const uint32_t *changed);
+static void status_listener_lock_init();
+static inline void status_listener_lock();
+
 STATUS status_check_event_registers(const OPR opr_goal, const int adts_fd)
 {
-    static LastStatus lastStatus;
-    STBCommand stbc = command_STB(adts_fd);
+    StatusSnapshot snapshot;
+    command_status_snapshot(adts_fd, NULL, NULL, &snapshot);
+    return status_check_snapshot(opr_goal, &snapshot, adts_fd);
+}
+
+void status_listener_lock_init()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&Listener_Lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void status_listener_lock()
+{
+    pthread_once(&Listener_Lock_Once, status_listener_lock_init);
+    pthread_mutex_lock(&Listener_Lock);
+}
+
+//Print the bits that turned on and tell the listeners about every change
+void status_decode_changes(const int fd, const uint32_t *regs, const uint32_t *changed)
+{
+    const StatusSubscription *subs = Subscriptions;
+    status_listener_lock();
+    for(uint i = 0; i < LENGTH_2D(Status_Bits); i++)
+    {
+        const StatusBitName *bit = &Status_Bits[i];
+        if(!(changed[bit->reg] & bit->bit))
+            continue;
+
+        const bool set = (regs[bit->reg] & bit->bit) != 0;
+        if(set && (bit->kind == STATUS_BIT_ERROR))
+            ERROR_PRINT("Error: %s", bit->name);
+        else if(set && (bit->kind == STATUS_BIT_OUTPUT))
+            OUTPUT_PRINT("OPR: %s", bit->name);
+
+        for(uint j = 0; j < STATUS_MAX_LISTENERS; j++)
+        {
+            if(subs[j].used && (subs[j].reg == bit->reg) && (subs[j].mask & bit->bit))
+                subs[j].listener(fd, bit, set, subs[j].ctx);
+        }
+    }
+    pthread_mutex_unlock(&Listener_Lock);
+}
+
+STATUS status_check_snapshot(const OPR opr_goal, const StatusSnapshot *snapshot, const int adts_fd)
+{
     STATUS status = ST_AT_GOAL;
-    if(!stbc.succeed)
+    if(!snapshot->succeed)
         return ST_ERR;
 
+    //all the event registers are read, and cleared, every time. What they held is used even when the event came after
+    //the STB reply, it wouldn't be reported again
+    uint32_t regs[STATUS_REG_MAX];
+    regs[STATUS_REG_STB] = snapshot->stb;
+    regs[STATUS_REG_QUE] = snapshot->que;
+    regs[STATUS_REG_ESB] = snapshot->esb;
+    regs[STATUS_REG_OPR] = snapshot->opr;
+
+    uint32_t changed[STATUS_REG_MAX];
+    pthread_mutex_lock(&Status_Lock);
+    StatusTracker *tracker = &Trackers[adts_fd & (STATUS_DEVICES-1)];
+    for(uint i = 0; i < STATUS_REG_MAX; i++)
+    {
+        changed[i] = tracker->valid ? (regs[i] ^ tracker->regs[i]) : regs[i];
+        tracker->regs[i] = regs[i];
+    }
+    //ESR is cleared by reading it, every error in it is a new one
+    changed[STATUS_REG_ESB] = regs[STATUS_REG_ESB];
+    tracker->regs[STATUS_REG_ESB] = 0;
+    tracker->valid = true;
+    pthread_mutex_unlock(&Status_Lock);
+
     //if STB isn't 0 we aren't idle in most cases
-    //if(stbc.stb & STB_ALL)
-    if(stbc.stb != 0)
+    if(regs[STATUS_REG_STB] != 0)
     {
         status = ST_NOT_IDLE;
-        if(stbc.stb != lastStatus.stb)
+        if(changed[STATUS_REG_STB])
             OUTPUT_PRINT("________________________________________________");
     }
+    status_decode_changes(adts_fd, regs, changed);
 
-    StatQuesEven sqe = {{{0}}};
-    if(stbc.stb & STB_QUE)
-    {        
-        sqe = command_StatQuesEven(adts_fd);
-        if(!sqe.succeed || (sqe.que & QUE_ALL))
-        {
-            status = ST_ERR;
-            if(sqe.que != lastStatus.que)
-            {
-                CHECK_ERROR_BIT(sqe.que, QUE_PS_OVER);
-                CHECK_ERROR_BIT(sqe.que, QUE_PT_OVER);
-                CHECK_ERROR_BIT(sqe.que, QUE_PS_TRACK_LOSS);
-                CHECK_ERROR_BIT(sqe.que, QUE_PT_TRACK_LOSS);
-                CHECK_ERROR_BIT(sqe.que, QUE_PS_COEFF_ERR);
-                CHECK_ERROR_BIT(sqe.que, QUE_PT_COEFF_ERR); 
-            }                                                                                                                                                                
-        } 
-    }
+    if(regs[STATUS_REG_QUE] & QUE_ALL)
+        status = ST_ERR;
 
-    ESR esr = {{{0}}};
-    if(stbc.stb & STB_ESB)
-    {        
-        esr = command_ESR(adts_fd);        
-        if(!esr.succeed || (esr.esb & ESB_ERR))
-        {
-            status = ST_ERR;
-            //if(esr.esb != lastStatus.esb)
-            {
-                CHECK_ERROR_BIT(esr.esb, ESB_DDE);
-                CHECK_ERROR_BIT(esr.esb, ESB_EXE);
-                CHECK_ERROR_BIT(esr.esb, ESB_CME); 
-                serial_fd_do(adts_fd, ":SYST:ERR?", NULL, 0, NULL);
-            }            
-        }
+    if(regs[STATUS_REG_ESB] & ESB_ERR)
+    {
+        status = ST_ERR;
+        SCPIErrorQueue errq;
+        serial_drain_error_queue(adts_fd, &errq);
+        for(int i = 0; i < errq.count; i++)
+            ERROR_PRINT("Error: %d,\"%s\"", errq.errors[i].code, errq.errors[i].message);
     }
 
-    StatOperEven soe = {{{0}}};
-    if(stbc.stb & STB_OPR)
-    {        
-        soe = command_StatOperEven(adts_fd);         
-        if(!soe.succeed) 
-        {
-            status = ST_ERR;
-            ERROR_PRINT("OPR READ ERROR\n");            
-        } 
-        else if(soe.opr & OPR_ALL)
-        {
-            if(soe.opr != lastStatus.opr)
-            {
-                CHECK_OPR_BIT(soe.opr, OPR_STABLE);
-                CHECK_OPR_BIT(soe.opr, OPR_RAMPING);
-                CHECK_OPR_BIT(soe.opr, OPR_LEAKT_STABLE);
-                CHECK_OPR_BIT(soe.opr, OPR_VOLUMET_DONE);
-                CHECK_OPR_BIT(soe.opr, OPR_PS_STABLE);
-                CHECK_OPR_BIT(soe.opr, OPR_PS_RAMPING);
-                CHECK_OPR_BIT(soe.opr, OPR_PT_STABLE);
-                CHECK_OPR_BIT(soe.opr, OPR_PT_RAMPING);
-                CHECK_OPR_BIT(soe.opr, OPR_SELFT_DONE);
-                CHECK_OPR_BIT(soe.opr, OPR_GTG);
-            }
-
-            //if only OPR is set in STB and OPR only reports that it hit ground
-            //we also qualify as idle
-            if(soe.opr & opr_goal)
-            {               
-                status = ST_AT_GOAL;
-            }
-        }              
-    }
-    //printf("Exiting %s, status is %d\n", __func__, status);
-    lastStatus.stb = stbc.stb;
-    lastStatus.esb = esr.esb;
-    lastStatus.opr = soe.opr;
-    lastStatus.que = sqe.que;
+    //if only OPR is set in STB and OPR only reports that it hit ground
+    //we also qualify as idle
+    if((regs[STATUS_REG_OPR] & OPR_ALL) && (regs[STATUS_REG_OPR] & opr_goal))
+        status = ST_AT_GOAL;
+
     return status;    
 }       
 
-
-void status_dump_pressure_data_if_different(const char *ps_units, const char *pt_units, const int adts_fd)
+//Returns the id to unsubscribe with, or -1 if all slots are taken
+int status_subscribe(const STATUS_REG reg, const uint32_t mask, Status_Listener listener, void *ctx)
 {
-    static char last_ps[12], last_pt[12];
-    char ps[12], pt[12];
+    int id = -1;
+    status_listener_lock();
+    for(int i = 0; i < STATUS_MAX_LISTENERS; i++)
+    {
+        if(!Subscriptions[i].used)
+        {
+            Subscriptions[i] = (StatusSubscription){true, reg, mask, listener, ctx};
+            id = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Listener_Lock);
+    return id;
+}
 
-    char ps_cmd[16] = ":MEAS:PS? ";    
-    strcpy(ps_cmd + 10, ps_units);   
-    if(!serial_fd_do(adts_fd, ps_cmd, ps, LENGTH_2D(ps), NULL))
+void status_unsubscribe(const int id)
+{
+    if((id < 0) || (id >= STATUS_MAX_LISTENERS))
         return;
+    //waits for a listener being called on another thread
+    status_listener_lock();
+    Subscriptions[id].used = false;
+    pthread_mutex_unlock(&Listener_Lock);
+}
 
-    char pt_cmd[16] = ":MEAS:PT? ";
-    strcpy(pt_cmd + 10, pt_units);
-    if(!serial_fd_do(adts_fd, pt_cmd, pt, LENGTH_2D(pt), NULL))
-        return;    
+//The next snapshot of fd is compared against nothing, call when fd is closed or reused
+void status_forget_device(const int fd)
+{
+    pthread_mutex_lock(&Status_Lock);
+    Trackers[fd & (STATUS_DEVICES-1)].valid = false;
+    Trackers[fd & (STATUS_DEVICES-1)].have_pressure = false;
+    pthread_mutex_unlock(&Status_Lock);
+}
+
+
+void status_dump_pressure_data_if_different(const StatusSnapshot *snapshot, const char *ps_units, const char *pt_units, const int adts_fd)
+{
+    if(!snapshot->succeed || !snapshot->has_pressure)
+        return;
     
-    if((strcmp(ps, last_ps) != 0)|| (strcmp(pt, last_pt)!= 0))
-        OUTPUT_PRINT("PS: %s %s PT: %s %s", ps, ps_units, pt, pt_units);
+    pthread_mutex_lock(&Status_Lock);
+    StatusTracker *tracker = &Trackers[adts_fd & (STATUS_DEVICES-1)];
+    const bool different = !tracker->have_pressure || (snapshot->ps != tracker->last_ps) || (snapshot->pt != tracker->last_pt);
+    tracker->have_pressure = true;
+    tracker->last_ps = snapshot->ps;
+    tracker->last_pt = snapshot->pt;
+    pthread_mutex_unlock(&Status_Lock);
 
-    memcpy(last_ps, ps, LENGTH_2D(last_ps));
-    memcpy(last_pt, pt, LENGTH_2D(last_ps));
+    if(different)
+        OUTPUT_PRINT("PS: %.3f %s PT: %.3f %s", snapshot->ps, ps_units, snapshot->pt, pt_units);
 }
-
- 
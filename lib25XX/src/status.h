@@ -11,5 +11,37 @@ typedef enum {
 } STATUS;
 
 STATUS status_check_event_registers(const OPR opr_goal, const int adts_fd);
+STATUS status_check_snapshot(const OPR opr_goal, const StatusSnapshot *snapshot, const int adts_fd);
 
-void status_dump_pressure_data_if_different(const char *ps_units, const char *pt_units, const int adts_fd);
\ No newline at end of file
+//Register values are tracked per device, changed bits are found by XOR with the last snapshot of that device
+typedef enum {
+    STATUS_REG_STB = 0,
+    STATUS_REG_QUE = 1,
+    STATUS_REG_ESB = 2,
+    STATUS_REG_OPR = 3,
+    STATUS_REG_MAX
+} STATUS_REG;
+
+typedef enum {
+    STATUS_BIT_SILENT = 0,
+    STATUS_BIT_OUTPUT = 1 << 0,
+    STATUS_BIT_ERROR  = 1 << 1
+} STATUS_BIT_KIND;
+
+typedef struct StatusBitName {
+    STATUS_REG      reg;
+    uint32_t        bit;
+    const char     *name;
+    STATUS_BIT_KIND kind;
+} StatusBitName;
+
+//Called for every bit in the subscribed mask that changed, set is the new state of the bit. Once status_unsubscribe
+//returns the listener isn't called again
+typedef void (*Status_Listener)(const int fd, const StatusBitName *bit, const bool set, void *ctx);
+
+#define STATUS_MAX_LISTENERS 8
+int status_subscribe(const STATUS_REG reg, const uint32_t mask, Status_Listener listener, void *ctx);
+void status_unsubscribe(const int id);
+void status_forget_device(const int fd);
+
+void status_dump_pressure_data_if_different(const StatusSnapshot *snapshot, const char *ps_units, const char *pt_units, const int adts_fd);
\ No newline at end of file
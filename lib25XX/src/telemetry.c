@@ -0,0 +1,265 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "telemetry.h"
+#include "serial.h"
+#include "utility.h"
+
+#define log_telemetry(fmt, ...) log_format_line(FDM_TEST_LOG, "TELEMETRY|" fmt, ##__VA_ARGS__)
+
+#define TELEMETRY_RING_MASK (TELEMETRY_RING_SIZE - 1)
+//time off the port after each sample so the control thread can get its exchanges in
+#define TELEMETRY_YIELD_MS  20
+#define TELEMETRY_RETRY_MS  500
+
+static_assert((TELEMETRY_RING_SIZE & TELEMETRY_RING_MASK) == 0, "TELEMETRY_RING_SIZE must be a power of 2");
+
+static TelemetrySampler Samplers[TELEMETRY_MAX_SAMPLERS];
+static pthread_mutex_t Samplers_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *telemetry_thread(void *_sampler);
+static inline void telemetry_push(TelemetrySampler *sampler, const TelemetrySample *sample);
+static inline bool telemetry_copy_slot(TelemetrySampler *sampler, const uint64_t pos, TelemetrySample *sample);
+
+void telemetry_push(TelemetrySampler *sampler, const TelemetrySample *sample)
+{
+    const uint64_t pos = atomic_load_explicit(&sampler->head, memory_order_relaxed);
+    TelemetrySlot *slot = &sampler->ring[pos & TELEMETRY_RING_MASK];
+
+    atomic_store_explicit(&slot->seq, 2*pos + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->sample = *sample;
+    atomic_store_explicit(&slot->seq, 2*pos + 2, memory_order_release);
+    atomic_store_explicit(&sampler->head, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&sampler->num_samples, 1, memory_order_relaxed);
+}
+
+//false if the slot doesn't hold sample pos anymore, or it was overwritten while copying
+bool telemetry_copy_slot(TelemetrySampler *sampler, const uint64_t pos, TelemetrySample *sample)
+{
+    const TelemetrySlot *slot = &sampler->ring[pos & TELEMETRY_RING_MASK];
+    const uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if(seq != (2*pos + 2))
+        return false;
+
+    *sample = slot->sample;
+    atomic_thread_fence(memory_order_acquire);
+    return (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq);
+}
+
+void *telemetry_thread(void *_sampler)
+{
+    TelemetrySampler *sampler = (TelemetrySampler*)_sampler;
+    struct timespec ts;
+
+    char ps_query[32], pt_query[32];
+    snprintf(ps_query, sizeof(ps_query), ":MEAS:PS? %s", sampler->ps_units);
+    snprintf(pt_query, sizeof(pt_query), ":MEAS:PT? %s", sampler->pt_units);
+    const char *queries[2] = {ps_query, pt_query};
+
+    while(atomic_load(&sampler->running))
+    {
+        char buf[64];
+        char *fields[2];
+        if(serial_fd_query_compound(sampler->fd, queries, 2, buf, sizeof(buf), fields) == 2)
+        {
+            TelemetrySample sample;
+            sample.time_ms = time_in_ms();
+            sample.ps = strtod(fields[0], NULL);
+            sample.pt = strtod(fields[1], NULL);
+            telemetry_push(sampler, &sample);
+            SLEEP_MS(&ts, TELEMETRY_YIELD_MS);
+        }
+        else
+        {
+            atomic_fetch_add_explicit(&sampler->num_errors, 1, memory_order_relaxed);
+            SLEEP_MS(&ts, TELEMETRY_RETRY_MS);
+        }
+    }
+    return NULL;
+}
+
+//Starts sampling fd, a sampler already running on fd in the same units is shared. One running in other units belongs
+//to someone else, NULL and the caller queries the unit itself
+TelemetrySampler *telemetry_start(const int fd, const char *name, const char *ps_units, const char *pt_units)
+{
+    TelemetrySampler *sampler = NULL;
+    pthread_mutex_lock(&Samplers_Lock);
+    for(uint i = 0; i < TELEMETRY_MAX_SAMPLERS; i++)
+    {
+        if(atomic_load(&Samplers[i].running) && (Samplers[i].fd == fd))
+        {
+            sampler = &Samplers[i];
+            break;
+        }
+    }
+    if(sampler != NULL)
+    {
+        const bool same_units = (strcmp(sampler->ps_units, ps_units) == 0) && (strcmp(sampler->pt_units, pt_units) == 0);
+        if(same_units)
+            sampler->refs++;
+        pthread_mutex_unlock(&Samplers_Lock);
+        if(!same_units)
+            ERROR_PRINT("The %s sampler is in use in %s %s, not sampling in %s %s", name, sampler->ps_units, sampler->pt_units, ps_units, pt_units);
+        return same_units ? sampler : NULL;
+    }
+
+    //a slot being stopped is still in use until its thread is joined
+    for(uint i = 0; i < TELEMETRY_MAX_SAMPLERS; i++)
+    {
+        if(!Samplers[i].in_use)
+        {
+            sampler = &Samplers[i];
+            break;
+        }
+    }
+    if(sampler == NULL)
+    {
+        pthread_mutex_unlock(&Samplers_Lock);
+        ERROR_PRINT("No free telemetry sampler for %s", name);
+        return NULL;
+    }
+
+    sampler->fd = fd;
+    sampler->name = name;
+    snprintf(sampler->ps_units, sizeof(sampler->ps_units), "%s", ps_units);
+    snprintf(sampler->pt_units, sizeof(sampler->pt_units), "%s", pt_units);
+    sampler->refs = 1;
+    sampler->started_ms = time_in_ms();
+    atomic_store(&sampler->num_samples, 0);
+    atomic_store(&sampler->num_errors, 0);
+    atomic_store(&sampler->num_dropped, 0);
+    atomic_store(&sampler->head, 0);
+    for(uint i = 0; i < TELEMETRY_RING_SIZE; i++)
+        atomic_store(&sampler->ring[i].seq, 0);
+
+    sampler->in_use = true;
+    atomic_store(&sampler->running, true);
+    if(pthread_create(&sampler->thread, NULL, &telemetry_thread, sampler) != 0)
+    {
+        atomic_store(&sampler->running, false);
+        sampler->in_use = false;
+        sampler = NULL;
+    }
+    pthread_mutex_unlock(&Samplers_Lock);
+
+    if(sampler != NULL)
+        log_telemetry("%s|start|ps_units=%s|pt_units=%s", name, ps_units, pt_units);
+    return sampler;
+}
+
+//The sampler keeps running until everyone who started it has stopped it
+void telemetry_stop(TelemetrySampler *sampler)
+{
+    if((sampler == NULL) || !atomic_load(&sampler->running))
+        return;
+
+    pthread_mutex_lock(&Samplers_Lock);
+    const bool last = (sampler->refs > 0) && (--sampler->refs == 0);
+    if(last)
+        atomic_store(&sampler->running, false);
+    pthread_mutex_unlock(&Samplers_Lock);
+    if(!last)
+        return;
+
+    pthread_join(sampler->thread, NULL);
+    log_telemetry("%s|stop|samples=%llu|rate=%.2f|errors=%llu|dropped=%llu", sampler->name, (long long unsigned)atomic_load(&sampler->num_samples),
+        telemetry_sample_rate(sampler), (long long unsigned)atomic_load(&sampler->num_errors), (long long unsigned)atomic_load(&sampler->num_dropped));
+    pthread_mutex_lock(&Samplers_Lock);
+    sampler->in_use = false;
+    pthread_mutex_unlock(&Samplers_Lock);
+}
+
+TelemetrySampler *telemetry_get(const int fd)
+{
+    TelemetrySampler *sampler = NULL;
+    pthread_mutex_lock(&Samplers_Lock);
+    for(uint i = 0; i < TELEMETRY_MAX_SAMPLERS; i++)
+    {
+        if(atomic_load(&Samplers[i].running) && (Samplers[i].fd == fd))
+        {
+            sampler = &Samplers[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Samplers_Lock);
+    return sampler;
+}
+
+//Readers start at the newest sample
+void telemetry_reader_init(TelemetryReader *reader, TelemetrySampler *sampler)
+{
+    reader->sampler = sampler;
+    reader->tail = (sampler != NULL) ? atomic_load_explicit(&sampler->head, memory_order_acquire) : 0;
+    reader->dropped = 0;
+}
+
+//Never blocks, returns false if there is no new sample
+bool telemetry_read(TelemetryReader *reader, TelemetrySample *sample)
+{
+    TelemetrySampler *sampler = reader->sampler;
+    if(sampler == NULL)
+        return false;
+
+    const uint64_t head = atomic_load_explicit(&sampler->head, memory_order_acquire);
+    //the reader fell more than a ring behind, skip to the oldest sample still held
+    if((head - reader->tail) > TELEMETRY_RING_SIZE)
+    {
+        const uint64_t lost = head - reader->tail - TELEMETRY_RING_SIZE;
+        reader->dropped += lost;
+        atomic_fetch_add_explicit(&sampler->num_dropped, lost, memory_order_relaxed);
+        reader->tail = head - TELEMETRY_RING_SIZE;
+    }
+
+    while(reader->tail < head)
+    {
+        const uint64_t pos = reader->tail++;
+        if(telemetry_copy_slot(sampler, pos, sample))
+            return true;
+
+        //overwritten before we got to it
+        reader->dropped++;
+        atomic_fetch_add_explicit(&sampler->num_dropped, 1, memory_order_relaxed);
+    }
+    return false;
+}
+
+//false if there is no sample newer than max_age_ms, a stalled port keeps its last one forever
+bool telemetry_latest(TelemetrySampler *sampler, const uint64_t max_age_ms, TelemetrySample *sample)
+{
+    for(int attempt = 0; attempt < 4; attempt++)
+    {
+        const uint64_t head = atomic_load_explicit(&sampler->head, memory_order_acquire);
+        if(head == 0)
+            return false;
+        if(telemetry_copy_slot(sampler, head - 1, sample))
+            return (time_in_ms() - sample->time_ms) <= max_age_ms;
+    }
+    return false;
+}
+
+//Fill in the pressures of a snapshot read without them, false if the sampler has nothing recent
+bool telemetry_fill_snapshot(TelemetrySampler *sampler, StatusSnapshot *snapshot)
+{
+    TelemetrySample sample;
+    if((sampler == NULL) || !telemetry_latest(sampler, TELEMETRY_MAX_AGE_MS, &sample))
+        return false;
+
+    snapshot->ps = sample.ps;
+    snapshot->pt = sample.pt;
+    snapshot->has_pressure = true;
+    return true;
+}
+
+double telemetry_sample_rate(const TelemetrySampler *sampler)
+{
+    const uint64_t elapsed = time_in_ms() - sampler->started_ms;
+    if(elapsed == 0)
+        return 0;
+    return (double)atomic_load(&sampler->num_samples) * 1000.0 / (double)elapsed;
+}
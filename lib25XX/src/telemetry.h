@@ -0,0 +1,61 @@
+#pragma once
+//Background PS/PT sampling, one thread per ADTS
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "command.h"
+
+#define TELEMETRY_RING_SIZE    1024 //must be a power of 2
+#define TELEMETRY_MAX_SAMPLERS 2
+//a newer sample than this stands in for a query of the unit
+#define TELEMETRY_MAX_AGE_MS   1000
+
+typedef struct TelemetrySample {
+    uint64_t time_ms;
+    double   ps;
+    double   pt;
+} TelemetrySample;
+
+//Written by the sampler thread only, a slot's seq is odd while it is being written
+typedef struct TelemetrySlot {
+    atomic_uint_fast64_t seq;
+    TelemetrySample sample;
+} TelemetrySlot;
+
+typedef struct TelemetrySampler {
+    int fd;
+    const char *name;
+    char ps_units[8];
+    char pt_units[8];
+    pthread_t thread;
+    atomic_bool running;
+    bool in_use;        //from telemetry_start until the thread is joined, under the samplers lock
+    unsigned int refs;  //every telemetry_start until its telemetry_stop, under the samplers lock
+    uint64_t started_ms;
+    //counters
+    atomic_uint_fast64_t num_samples;
+    atomic_uint_fast64_t num_errors;
+    atomic_uint_fast64_t num_dropped;
+    //single producer ring, every reader keeps its own cursor
+    atomic_uint_fast64_t head;
+    TelemetrySlot ring[TELEMETRY_RING_SIZE];
+} TelemetrySampler;
+
+typedef struct TelemetryReader {
+    TelemetrySampler *sampler;
+    uint64_t tail;
+    uint64_t dropped;
+} TelemetryReader;
+
+TelemetrySampler *telemetry_start(const int fd, const char *name, const char *ps_units, const char *pt_units);
+void telemetry_stop(TelemetrySampler *sampler);
+TelemetrySampler *telemetry_get(const int fd);
+
+void telemetry_reader_init(TelemetryReader *reader, TelemetrySampler *sampler);
+bool telemetry_read(TelemetryReader *reader, TelemetrySample *sample);
+bool telemetry_latest(TelemetrySampler *sampler, const uint64_t max_age_ms, TelemetrySample *sample);
+bool telemetry_fill_snapshot(TelemetrySampler *sampler, StatusSnapshot *snapshot);
+
+double telemetry_sample_rate(const TelemetrySampler *sampler);
@@ -2,8 +2,12 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdatomic.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "serial.h"
 #include "status.h"
@@ -12,6 +16,8 @@
 #include "utility.h"
 #include "command.h"
 #include "lsu.h"
+#include "recorder.h"
+#include "script.h"
 
 typedef _TEST TEST;
 typedef bool (*test_func)(const TEST *test);
@@ -19,383 +25,1506 @@ typedef enum TEST_T{
     TEST_T_CTRL,
     TEST_T_MEAS,
     TEST_T_LSUV,
-    TEST_T_LEAK
+    TEST_T_LEAK,
+    TEST_T_LEAK_PAIR,
+    TEST_T_PROC,
+    NUM_TEST_T
 } TEST_T;
 
-#define _TEST_SET struct { \
-    const TEST_T type; \
-    test_func test_func; \
-    const char *name; \
-    const bool init_master_before_each_test; \
-}
-typedef _TEST_SET TEST_SET;
-static inline int testset_get_num_tests(const TEST_SET *test_set);
-static inline TEST *testset_get_test(const TEST_SET *test_set, const uint index);
-
-typedef struct ControlTestSet{
-    _TEST_SET;
-    //It is awful we have to hardcode this here, but gcc doesn't let us take the _sizeof_ a flexible array in a struct
-    //even after creating one statically, so the choices were make the TEST array a pointer to a tests array
-    //or put the whole array in a macro so we can take the _sizeof_ the macro for the calculation of array elements
-    //or just specify the number of elements as a constant here ... 
-    ControlTest tests[8]; 
-} ControlTestSet;
+//Every test lives in one flat array of records, a test set is a run of consecutive records
+typedef struct TestRecord TestRecord;
+typedef struct TestSet {
+    TEST_T type;
+    const char *name;
+    bool init_master_before_each_test;
+    bool direct_transitions; //the master may go from one test's setpoint to the next without ground
+    TestRecord *tests;
+    uint num_tests;
+} TEST_SET;
+
+//The test comes first, so a TEST pointer is also a pointer to its record
+struct TestRecord {
+    union {
+        TEST              test;
+        ControlTest       control;
+        SingleChannelTest single;
+        LSUValveTest      lsu;
+        LeakTest          leak;
+        LeakPairTest      pair;
+        ProcTest          proc;
+    };
+    const TEST_SET *set;
+    bool paired; //a LEAK test a PAIR test runs
+};
+
+//What a test needs to itself while it runs, tests that don't share any of it can run at the same time
+typedef enum TEST_RES {
+    TEST_RES_MASTER      = 1 << 0, //the unit's serial port
+    TEST_RES_SLAVE       = 1 << 1,
+    TEST_RES_LSU         = 1 << 2,
+    TEST_RES_MASTER_PNEU = 1 << 3, //whatever is connected to the unit's Ps and Pt
+    TEST_RES_SLAVE_PNEU  = 1 << 4,
+    TEST_RES_LSU_VALVES  = 1 << 5, //opening and closing the LSU valves
+    TEST_RES_LSU_LINES   = 1 << 6, //pressure through the LSU, shared by any number of tests while the valves stay put
+    TEST_RES_OPERATOR    = 1 << 7  //someone answers questions while it runs, the operator queue takes them one at a time
+} TEST_RES;
+
+//Fields of a test record after TYPE|name|setup|task
+typedef bool (*table_parse_func)(TestRecord *record, char **fields);
+typedef uint64_t (*plan_func)(const TEST *test);
+typedef TEST_RES (*resource_func)(const TEST *test);
+//The unit and units a test controls with, false if there is nothing to prepare
+typedef bool (*prepare_func)(const TEST *test, int *adts_fd, CTRL_UNITS *units);
+
+typedef struct TestType {
+    const char *tag;
+    test_func run;
+    int num_fields;
+    table_parse_func parse;
+    plan_func estimate;  //NULL for PLAN_OTHER_MS
+    plan_func ramp;      //NULL if the test doesn't leave the master at a setpoint
+    resource_func resources;
+    prepare_func prepare;  //NULL if the test has no control setup to prepare
+} TestType;
+
+static bool table_parse_control(TestRecord *record, char **fields);
+static bool table_parse_single(TestRecord *record, char **fields);
+static bool table_parse_lsu(TestRecord *record, char **fields);
+static bool table_parse_leak(TestRecord *record, char **fields);
+static bool table_parse_pair(TestRecord *record, char **fields);
+static bool table_parse_proc(TestRecord *record, char **fields);
+static uint64_t plan_control_ms(const TEST *test);
+static uint64_t plan_single_ms(const TEST *test);
+static uint64_t plan_leak_test_ms(const TEST *test);
+static uint64_t plan_pair_ms(const TEST *test);
+static uint64_t plan_control_ramp_ms(const TEST *test);
+static TEST_RES test_res_control(const TEST *test);
+static TEST_RES test_res_single(const TEST *test);
+static TEST_RES test_res_lsu(const TEST *test);
+static TEST_RES test_res_leak(const TEST *test);
+static TEST_RES test_res_pair(const TEST *test);
+static TEST_RES test_res_proc(const TEST *test);
+static bool test_prep_control(const TEST *test, int *adts_fd, CTRL_UNITS *units);
+static bool test_prep_single(const TEST *test, int *adts_fd, CTRL_UNITS *units);
+static bool test_prep_leak(const TEST *test, int *adts_fd, CTRL_UNITS *units);
+
+static const TestType Test_Types[NUM_TEST_T] = {
+    [TEST_T_CTRL]      = {"CTRL", (test_func)control_run_test,            6,  table_parse_control, plan_control_ms,   plan_control_ramp_ms, test_res_control, test_prep_control},
+    [TEST_T_MEAS]      = {"MEAS", (test_func)control_single_channel_test, 7,  table_parse_single,  plan_single_ms,    NULL,                 test_res_single,  test_prep_single},
+    [TEST_T_LSUV]      = {"LSUV", (test_func)lsu_valve_test,              1,  table_parse_lsu,     NULL,              NULL,                 test_res_lsu,     NULL},
+    [TEST_T_LEAK]      = {"LEAK", (test_func)control_run_leak_test,       11, table_parse_leak,    plan_leak_test_ms, NULL,                 test_res_leak,    test_prep_leak},
+    [TEST_T_LEAK_PAIR] = {"PAIR", (test_func)control_run_leak_test_pair,  2,  table_parse_pair,    plan_pair_ms,      NULL,                 test_res_pair,    NULL},
+    [TEST_T_PROC]      = {"PROC", (test_func)script_run_test,             1,  table_parse_proc,    NULL,              NULL,                 test_res_proc,    NULL},
+};
+
+#define TEST_MAX_SETS    8
+#define TEST_MAX_RECORDS 64
+#define TABLE_MAX_FIELDS 16
+
+static TEST_SET   TestSets[TEST_MAX_SETS];
+static uint       Num_Test_Sets;
+static TestRecord Test_Records[TEST_MAX_RECORDS];
+static uint       Num_Tests;
+//the records point into the text of the table
+static char      *Table_Text;
+static const char *Table_Path;
+static uint       Table_Line;
+static const char *Table_File = TEST_TABLE_FILE;
+//the names and setups made for PAIR tests that leave them empty, by record
+static char       Pair_Text[TEST_MAX_RECORDS][2][256];
+
+typedef enum TEST_RESULT {
+    TEST_RESULT_NONE = 0,
+    TEST_RESULT_PASS = 1 << 0,
+    TEST_RESULT_FAIL = 1 << 1,
+    TEST_RESULT_SKIP = 1 << 2
+} TEST_RESULT;
+
+//The outcome of every record in this run, each test is only written by the thread running it
+typedef struct TestResult {
+    TEST_RESULT result;
+    uint64_t ms;
+    const char *reason; //why it was skipped
+} TestResult;
+static TestResult Test_Results[TEST_MAX_RECORDS];
+
+#define table_error(fmt, ...) ERROR_PRINT("%s:%u: " fmt, Table_Path, Table_Line, ##__VA_ARGS__)
 
 #define strRemoveVolumes "Remove all volumes/loads, cap all ports and close all valves on LSU"
 #define strConnect60     "Connect 60 cubic inch volume to both Ps and Pt"
 #define strConnect100    "Connect 100 cubic inch volume to both Ps and Pt."
-static ControlTestSet ControlTests = {
+#define strLSUOpenAndClose "LSU Valve Open and Close"
+#define strLSUSetup        "No additional setup required"
+#define strLSUTask         "Answer the prompts"
+#define strCACD            "Connect CACD or volume to LSU straight-through"
+#define strPSA             "Connect PSA or volume to LSU, turn on the valves in use on the LSU"
+
+/* The tests used when there is no TEST_TABLE_FILE, in the same format. One record per line, fields separated by |,
+ * empty lines and lines starting with # are ignored. A set starts with
+ *   SET|type|name|GTG the master before each test 0/1|direct transitions 0/1
+ * followed by its tests, all of that type
+ *   CTRL|name|setup|task|units FK/INHG|duration ms|ps|ps rate|pt|pt rate
+ *   MEAS|name|setup|task|units|duration ms|channel PS|setpoint|rate|expected rate|rate tolerance
+ *   LSUV|name|setup|task|valve 1-8 or ALL
+ *   LEAK|name|setup|task|units|duration ms|ps|ps rate|pt|pt rate|ps tolerance|pt tolerance|delay minutes|delay seconds|master 0/1
+ *   PAIR|name|setup|task|name of the master LEAK test|name of the slave LEAK test, both defined above it. An empty
+ *        name or setup is made from the two tests'. A set of LEAK tests that are all in pairs only runs when a batch
+ *        selects it
+ *   PROC|name|setup|task|device MASTER/SLAVE/LSU
+ * A PROC test is the STEP lines right after it, compiled to bytecode (see script.h)
+ *   STEP|DEVICE|MASTER/SLAVE/LSU       the following steps talk to that device
+ *   STEP|SEND|command
+ *   STEP|EXPECT|query|reply            the reply as a string
+ *   STEP|EXPECTF|query|value|tolerance the reply as a number
+ *   STEP|WAIT|OPR bit|timeout ms       STABLE, LEAKT_STABLE, VOLUMET_DONE, PS_STABLE, PT_STABLE, SELFT_DONE or GTG
+ *   STEP|SAMPLE|query|count            the mean of count readings
+ *   STEP|ASSERT|value|tolerance        on the last SAMPLE
+ *   STEP|PROMPT|question               the operator answers yes or no
+ * An empty task shows the default one */
+static const char Default_Table[] =
+    "SET|CTRL|ADTS Control|1|1\n"
+    "CTRL|Control Pressure - Aeronautical Units No Volume|"           strRemoveVolumes "||FK|120000|-2000|50000|1000|800\n"
+    "CTRL|Control Pressure - Aeronautical Units 60 Cubic Inch Volume|"  strConnect60 "||FK|200000|-2000|25000|1000|400\n"
+    "CTRL|Control Pressure - Aeronautical Units 100 Cubic Inch Volume|" strConnect100 "||FK|390000|-2000|10000|1000|200\n"
+    "CTRL|Control Vacuum - Aeronautical Units No Volume|"             strRemoveVolumes "||FK|150000|92000|50000|0|800\n"
+    "CTRL|Control Vacuum - Aeronautical Units 60 Cubic Inch Volume|"    strConnect60 "||FK|300000|92000|25000|0|400\n"
+    "CTRL|Control Vacuum - Aeronautical Units 100 Cubic Inch Volume|"   strConnect100 "||FK|635000|92000|10000|0|200\n"
+    "CTRL|Control Vacuum - INHG Pressure Units 60 Cubic Inch Volume|"   strConnect60 "||INHG|250000|0.815|15.000|0.815|15.000\n"
+    "CTRL|Control Pressure - INHG Pressure Units 60 Cubic Inch Volume|" strConnect60 "||INHG|160000|32.148|30.000|73.545|50.000\n"
+    "SET|LEAK|ADTS Leak Test|0|0\n"
+    "LEAK|Low Pressure Leak Test with CACD|"  strCACD "||INHG|200000|3.425|40|3.425|40|0.010|0.010|2|0|0\n"
+    "LEAK|High Pressure Leak Test with CACD|" strCACD "||INHG|200000|3.425|40|73.500|40|0.010|0.020|2|0|0\n"
+    "LEAK|Low Pressure Leak Test with PSA|"   strPSA "||INHG|200000|3.425|40|3.425|40|0.010|0.012|2|0|1\n"
+    "LEAK|High Pressure Leak Test with PSA|"  strPSA "||INHG|200000|3.425|40|73.500|40|0.010|0.025|2|0|1\n"
+    "#The tests above in pairs, the PSA test on the master while the CACD test runs on the slave\n"
+    "SET|PAIR|ADTS Leak Test - Master and Slave Together|0|0\n"
+    "PAIR|Low Pressure Leak Test with PSA on Master and CACD on Slave|||Low Pressure Leak Test with PSA|Low Pressure Leak Test with CACD\n"
+    "PAIR|High Pressure Leak Test with PSA on Master and CACD on Slave|||High Pressure Leak Test with PSA|High Pressure Leak Test with CACD\n"
+    "SET|MEAS|ADTS Control and Measure|1|0\n"
+    "MEAS|Control Rate of Climb - Aeronautical Units|Connect the PS and the PT units from unit to another on the LSU||FK|160000|PS|80000|50000|50000|3000\n"
+    "SET|LSUV|" strLSUOpenAndClose "|0|0\n"
+    "LSUV|" strLSUOpenAndClose " All Valves|" strLSUSetup "|" strLSUTask "|ALL\n"
+    "LSUV|" strLSUOpenAndClose " PS #1|"      strLSUSetup "|" strLSUTask "|1\n"
+    "LSUV|" strLSUOpenAndClose " PS #2|"      strLSUSetup "|" strLSUTask "|2\n"
+    "LSUV|" strLSUOpenAndClose " PS #3|"      strLSUSetup "|" strLSUTask "|3\n"
+    "LSUV|" strLSUOpenAndClose " PS #4|"      strLSUSetup "|" strLSUTask "|4\n"
+    "LSUV|" strLSUOpenAndClose " PT #1|"      strLSUSetup "|" strLSUTask "|5\n"
+    "LSUV|" strLSUOpenAndClose " PT #2|"      strLSUSetup "|" strLSUTask "|6\n"
+    "LSUV|" strLSUOpenAndClose " PT #3|"      strLSUSetup "|" strLSUTask "|7\n"
+    "LSUV|" strLSUOpenAndClose " PT #4|"      strLSUSetup "|" strLSUTask "|8\n";
+
+//Estimates for planning the test order, ramps are estimated from the setpoints and rates
+#define PLAN_SETUP_MS     90000 //the operator swaps volumes or connections
+#define PLAN_VERIFY_MS    10000
+#define PLAN_LEAK_MS      60000 //leak readings after the delay
+#define PLAN_OTHER_MS     30000
+#define PLAN_GROUND_INHG  29.921
+//a direct transition may take this much longer than the ramp from ground
+#define DIRECT_SLACK      1.1
+
+typedef struct PlanStep {
+    TEST_SET *test_set;
+    uint index;
+    TEST *test;
+    uint64_t est_ms;
+    uint64_t ramp_ms;   //from ground, part of est_ms each way
+} PlanStep;
+
+typedef struct TestPlan {
+    uint num_steps;
+    PlanStep steps[TEST_MAX_RECORDS];
+} TestPlan;
+
+static inline int testset_get_num_tests(const TEST_SET *test_set)
 {
-    TEST_T_CTRL,
-    (test_func)(control_run_test),
-    "ADTS Control",
-    true
-}, 
-{
-    { 
-      {  "Control Pressure - Aeronautical Units No Volume",
-         strRemoveVolumes,
-         NULL,         
-      }, CTRL_UNITS_FK, 120000, "-2000", "50000", "1000", "800"
-    },
-    {
-      {  "Control Pressure - Aeronautical Units 60 Cubic Inch Volume",
-         strConnect60,
-         NULL,         
-      }, CTRL_UNITS_FK, 200000, "-2000", "25000", "1000", "400"
-    },
-    {
-      {  "Control Pressure - Aeronautical Units 100 Cubic Inch Volume",
-         strConnect100,
-         NULL,         
-      }, CTRL_UNITS_FK, 390000, "-2000", "10000", "1000", "200"
-    },
-    {
-      {  "Control Vacuum - Aeronautical Units No Volume",
-         strRemoveVolumes,
-         NULL,         
-      }, CTRL_UNITS_FK, 150000, "92000", "50000", "0", "800" 
-    },
-    {
-      {  "Control Vacuum - Aeronautical Units 60 Cubic Inch Volume",
-         strConnect60,
-         NULL,        
-      }, CTRL_UNITS_FK, 300000, "92000", "25000", "0", "400"
-    },
-    {
-      {  "Control Vacuum - Aeronautical Units 100 Cubic Inch Volume",
-         strConnect100,
-         NULL,         
-      }, CTRL_UNITS_FK, 635000, "92000", "10000", "0", "200"
-    },
-    {
-      {  "Control Vacuum - INHG Pressure Units 60 Cubic Inch Volume",
-         strConnect60,
-         NULL,        
-      }, CTRL_UNITS_INHG, 250000, "0.815", "15.000", "0.815", "15.000"
-    },
-    {
-      {  "Control Pressure - INHG Pressure Units 60 Cubic Inch Volume",
-         strConnect60,
-         NULL,         
-      }, CTRL_UNITS_INHG, 160000, "32.148", "30.000", "73.545", "50.000"
-    },
-}};
-#define NUM_CONTROL_TESTS LENGTH_2D(ControlTests.tests)
-
-typedef struct SingleChannelTestSet {
-    _TEST_SET;
-    SingleChannelTest tests[1];
-} SingleChannelTestSet;
-
-static SingleChannelTestSet SingleChannelTests = {
+    return (int)test_set->num_tests;
+}
+
+static inline TEST *testset_get_test(const TEST_SET *test_set, const uint index)
+{
+    return (index < test_set->num_tests) ? &test_set->tests[index].test : NULL;
+}
+
+//Every test of the set runs in a PAIR, running the set too would do them twice
+static bool testset_paired(const TEST_SET *test_set)
+{
+    for(uint i = 0; i < test_set->num_tests; i++)
+    {
+        if(!test_set->tests[i].paired)
+            return false;
+    }
+    return true;
+}
+
+//The tests run when no one picks them, the ones of paired sets aren't
+static uint test_num_default()
+{
+    uint num_tests = 0;
+    for(uint i = 0; i < Num_Test_Sets; i++)
+        num_tests += testset_paired(&TestSets[i]) ? 0 : TestSets[i].num_tests;
+    return num_tests;
+}
+
+static bool table_number(const char *field, double *value)
+{
+    char *end;
+    *value = strtod(field, &end);
+    return (end != field) && (*end == '\0');
+}
+
+static bool table_uint(const char *field, uint64_t *value)
+{
+    char *end;
+    *value = strtoull(field, &end, 10);
+    return (end != field) && (*end == '\0') && (field[0] != '-');
+}
+
+static inline bool table_duration(const char *field, uint64_t *value)
+{
+    return table_uint(field, value) && (*value > 0);
+}
+
+static bool table_flag(const char *field, bool *value)
+{
+    *value = (strcmp(field, "1") == 0);
+    return *value || (strcmp(field, "0") == 0);
+}
+
+static bool table_units(const char *field, CTRL_UNITS *units)
+{
+    if(strcmp(field, "FK") == 0)
+        *units = CTRL_UNITS_FK;
+    else if(strcmp(field, "INHG") == 0)
+        *units = CTRL_UNITS_INHG;
+    else
+    {
+        table_error("Unknown units %s, expected FK or INHG", field);
+        return false;
+    }
+    return true;
+}
+
+//units, duration and the setpoints and rates that follow it
+static bool table_control_fields(char **fields, const int num_setpoints, CTRL_UNITS *units, uint64_t *duration)
+{
+    if(!table_units(fields[0], units))
+        return false;
+    if(!table_duration(fields[1], duration))
+    {
+        table_error("Invalid duration %s", fields[1]);
+        return false;
+    }
+    double value;
+    for(int i = 2; i < 2 + num_setpoints; i++)
+    {
+        if(!table_number(fields[i], &value))
+        {
+            table_error("Invalid setpoint or rate %s", fields[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool table_parse_control(TestRecord *record, char **fields)
+{
+    CTRL_UNITS units;
+    uint64_t duration;
+    if(!table_control_fields(fields, 4, &units, &duration))
+        return false;
+    const ControlTest test = {{record->test.test_name, record->test.setup, record->test.user_task}, units, duration, fields[2], fields[3], fields[4], fields[5], {0}};
+    memcpy(&record->control, &test, sizeof(test));
+    return true;
+}
+
+bool table_parse_single(TestRecord *record, char **fields)
+{
+    CTRL_UNITS units;
+    uint64_t duration;
+    double expected_rate, rate_tolerance, value;
+    if(!table_units(fields[0], &units))
+        return false;
+    if(!table_duration(fields[1], &duration))
+    {
+        table_error("Invalid duration %s", fields[1]);
+        return false;
+    }
+    //only PS is implemented by control_single_channel_test
+    if(strcmp(fields[2], "PS") != 0)
+    {
+        table_error("Unsupported channel %s, expected PS", fields[2]);
+        return false;
+    }
+    if(!table_number(fields[3], &value) || !table_number(fields[4], &value) || !table_number(fields[5], &expected_rate) ||
+       !table_number(fields[6], &rate_tolerance) || (rate_tolerance <= 0))
+    {
+        table_error("Invalid setpoint, rate or expected rate");
+        return false;
+    }
+    const SingleChannelTest test = {{record->test.test_name, record->test.setup, record->test.user_task}, units, duration, CTRL_OP_PS, {.ps = fields[3]},
+        {.ps_rate = fields[4]}, expected_rate, rate_tolerance, {0}};
+    memcpy(&record->single, &test, sizeof(test));
+    return true;
+}
+
+bool table_parse_lsu(TestRecord *record, char **fields)
+{
+    char *end;
+    const long valve = strtol(fields[0], &end, 10);
+    const bool numbered = (end != fields[0]) && (*end == '\0') && (valve >= 1) && (valve <= 8);
+    if((strcmp(fields[0], "ALL") != 0) && !numbered)
+    {
+        table_error("Invalid valve %s, expected 1-8 or ALL", fields[0]);
+        return false;
+    }
+    const LSUValveTest test = {{record->test.test_name, record->test.setup, record->test.user_task}, fields[0]};
+    memcpy(&record->lsu, &test, sizeof(test));
+    return true;
+}
+
+bool table_parse_leak(TestRecord *record, char **fields)
+{
+    CTRL_UNITS units;
+    uint64_t duration, delay;
+    double ps_tolerance, pt_tolerance;
+    bool master;
+    if(!table_control_fields(fields, 4, &units, &duration))
+        return false;
+    if(!table_number(fields[6], &ps_tolerance) || !table_number(fields[7], &pt_tolerance) || (ps_tolerance <= 0) || (pt_tolerance <= 0))
+    {
+        table_error("Invalid leak tolerances %s %s", fields[6], fields[7]);
+        return false;
+    }
+    if(!table_uint(fields[8], &delay) || !table_uint(fields[9], &delay))
+    {
+        table_error("Invalid delay %s minutes %s seconds", fields[8], fields[9]);
+        return false;
+    }
+    if(!table_flag(fields[10], &master))
+    {
+        table_error("Invalid master flag %s, expected 0 or 1", fields[10]);
+        return false;
+    }
+    const LeakTest test = {{{record->test.test_name, record->test.setup, record->test.user_task}, units, duration, fields[2], fields[3], fields[4], fields[5], {0}},
+        ps_tolerance, pt_tolerance, fields[8], fields[9], master};
+    memcpy(&record->leak, &test, sizeof(test));
+    return true;
+}
+
+static LeakTest *table_find_leak(const char *name)
+{
+    for(uint i = 0; i < Num_Tests; i++)
+    {
+        if((Test_Records[i].set->type == TEST_T_LEAK) && (strcmp(Test_Records[i].test.test_name, name) == 0))
+            return &Test_Records[i].leak;
+    }
+    table_error("No LEAK test named %s above this line", name);
+    return NULL;
+}
+
+bool table_parse_pair(TestRecord *record, char **fields)
+{
+    LeakTest *master_test, *slave_test;
+    if(((master_test = table_find_leak(fields[0])) == NULL) || ((slave_test = table_find_leak(fields[1])) == NULL))
+        return false;
+    if(!master_test->testing_master_unit || slave_test->testing_master_unit)
+    {
+        table_error("The first test must be a master unit test and the second a slave unit test");
+        return false;
+    }
+    //the two tests already say what they are and what to connect
+    char (*text)[sizeof(Pair_Text[0][0])] = Pair_Text[record - Test_Records];
+    if(record->test.test_name[0] == '\0')
+    {
+        snprintf(text[0], sizeof(text[0]), "%s on Master and %s on Slave", master_test->test_name, slave_test->test_name);
+        record->test.test_name = text[0];
+    }
+    if(record->test.setup[0] == '\0')
+    {
+        snprintf(text[1], sizeof(text[1]), "Master: %s. Slave: %s", master_test->setup, slave_test->setup);
+        record->test.setup = text[1];
+    }
+    ((TestRecord*)master_test)->paired = true;
+    ((TestRecord*)slave_test)->paired = true;
+    const LeakPairTest test = {{record->test.test_name, record->test.setup, record->test.user_task}, master_test, slave_test};
+    memcpy(&record->pair, &test, sizeof(test));
+    return true;
+}
+
+bool table_parse_proc(TestRecord *record, char **fields)
+{
+    if(!script_begin(&record->proc.script, fields[0]))
+    {
+        table_error("Unknown device %s, expected MASTER, SLAVE or LSU, or out of procedure space", fields[0]);
+        return false;
+    }
+    return true;
+}
+
+//A step of the PROC test on the line above
+static bool table_parse_step(char **fields, const int num_fields)
+{
+    TestRecord *record = (Num_Tests > 0) ? &Test_Records[Num_Tests - 1] : NULL;
+    if((record == NULL) || (record->set->type != TEST_T_PROC) || (record->set != &TestSets[Num_Test_Sets - 1]) || (num_fields < 2))
+    {
+        table_error("A STEP has to follow a PROC test");
+        return false;
+    }
+    char err[128];
+    if(!script_compile_step(&record->proc.script, &fields[1], num_fields - 1, err, sizeof(err)))
+    {
+        table_error("%s", err);
+        return false;
+    }
+    return true;
+}
+
+//Split a line on | in place, returns the number of fields
+static int table_split(char *line, char **fields, const int max_fields)
+{
+    int num_fields = 0;
+    fields[num_fields++] = line;
+    for(char *c = line; *c != '\0'; c++)
+    {
+        if(*c == '|')
+        {
+            if(num_fields == max_fields)
+                return -1;
+            *c = '\0';
+            fields[num_fields++] = c + 1;
+        }
+    }
+    return num_fields;
+}
+
+static bool table_parse_set(char **fields, const int num_fields)
+{
+    if(num_fields != 5)
+    {
+        table_error("A SET has 5 fields, found %d", num_fields);
+        return false;
+    }
+    if(Num_Test_Sets == TEST_MAX_SETS)
+    {
+        table_error("More than %d test sets", TEST_MAX_SETS);
+        return false;
+    }
+
+    TEST_SET *test_set = &TestSets[Num_Test_Sets];
+    for(test_set->type = 0; test_set->type < NUM_TEST_T; test_set->type++)
+    {
+        if(strcmp(fields[1], Test_Types[test_set->type].tag) == 0)
+            break;
+    }
+    if(test_set->type == NUM_TEST_T)
+    {
+        table_error("Unknown test type %s", fields[1]);
+        return false;
+    }
+    if(!table_flag(fields[3], &test_set->init_master_before_each_test) || !table_flag(fields[4], &test_set->direct_transitions))
+    {
+        table_error("Invalid SET flags %s %s, expected 0 or 1", fields[3], fields[4]);
+        return false;
+    }
+    //only control tests leave the master where the next one can pick it up
+    if(test_set->direct_transitions && (test_set->type != TEST_T_CTRL))
+    {
+        table_error("Only a CTRL set can have direct transitions");
+        return false;
+    }
+    test_set->name = fields[2];
+    test_set->tests = &Test_Records[Num_Tests];
+    test_set->num_tests = 0;
+    Num_Test_Sets++;
+    return true;
+}
+
+static bool table_parse_test(char **fields, const int num_fields)
+{
+    if(Num_Test_Sets == 0)
+    {
+        table_error("%s test before any SET", fields[0]);
+        return false;
+    }
+    TEST_SET *test_set = &TestSets[Num_Test_Sets - 1];
+    const TestType *type = &Test_Types[test_set->type];
+    if(strcmp(fields[0], type->tag) != 0)
+    {
+        table_error("%s test in a %s set", fields[0], type->tag);
+        return false;
+    }
+    if(num_fields != (4 + type->num_fields))
+    {
+        table_error("A %s test has %d fields, found %d", type->tag, 4 + type->num_fields, num_fields);
+        return false;
+    }
+    if(Num_Tests == TEST_MAX_RECORDS)
+    {
+        table_error("More than %d tests", TEST_MAX_RECORDS);
+        return false;
+    }
+
+    TestRecord *record = &Test_Records[Num_Tests];
+    memset(record, 0, sizeof(*record));
+    record->set = test_set;
+    record->test.test_name = fields[1];
+    record->test.setup = fields[2];
+    record->test.user_task = (fields[3][0] != '\0') ? fields[3] : NULL;
+    if(!type->parse(record, &fields[4]))
+        return false;
+    if((record->test.test_name[0] == '\0') || (record->test.setup[0] == '\0'))
+    {
+        table_error("A test needs a name and a setup");
+        return false;
+    }
+    test_set->num_tests++;
+    Num_Tests++;
+    return true;
+}
+
+static bool table_parse(char *text)
+{
+    Num_Test_Sets = 0;
+    Num_Tests = 0;
+    Table_Line = 0;
+    script_clear();
+    char *next = text;
+    while(next != NULL)
+    {
+        char *line = next;
+        if((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        Table_Line++;
+        line[strcspn(line, "\r")] = '\0';
+        if((line[0] == '\0') || (line[0] == '#'))
+            continue;
+
+        char *fields[TABLE_MAX_FIELDS];
+        const int num_fields = table_split(line, fields, TABLE_MAX_FIELDS);
+        if(num_fields < 0)
+        {
+            table_error("More than %d fields", TABLE_MAX_FIELDS);
+            return false;
+        }
+        bool bRet;
+        if(strcmp(fields[0], "SET") == 0)
+            bRet = table_parse_set(fields, num_fields);
+        else if(strcmp(fields[0], "STEP") == 0)
+            bRet = table_parse_step(fields, num_fields);
+        else
+            bRet = table_parse_test(fields, num_fields);
+        if(!bRet)
+            return false;
+    }
+
+    for(uint i = 0; i < Num_Test_Sets; i++)
+    {
+        if(TestSets[i].num_tests == 0)
+        {
+            ERROR_PRINT("%s: test set %s has no tests", Table_Path, TestSets[i].name);
+            return false;
+        }
+    }
+    for(uint i = 0; i < Num_Tests; i++)
+    {
+        if((Test_Records[i].set->type == TEST_T_PROC) && (Test_Records[i].proc.script.num_steps == 0))
+        {
+            ERROR_PRINT("%s: procedure %s has no steps", Table_Path, Test_Records[i].test.test_name);
+            return false;
+        }
+    }
+    return true;
+}
+
+//Read and validate the test definitions, the built in ones if path doesn't exist. Nothing is kept if it is invalid
+bool test_load_table(const char *path)
+{
+    lsu_batch_forget();
+    char *text = NULL;
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        OUTPUT_PRINT("No test table %s, using the built in tests", path);
+        Table_Path = "built in tests";
+        text = strdup(Default_Table);
+    }
+    else
+    {
+        Table_Path = path;
+        long size;
+        if((fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) >= 0) && (fseek(file, 0, SEEK_SET) == 0) && ((text = malloc((size_t)size + 1)) != NULL))
+        {
+            text[fread(text, 1, (size_t)size, file)] = '\0';
+        }
+        fclose(file);
+    }
+    if(text == NULL)
+    {
+        ERROR_PRINT("Unable to read the test table %s", path);
+        return false;
+    }
+
+    const bool bRet = table_parse(text);
+    free(Table_Text);
+    Table_Text = text;
+    if(!bRet)
+    {
+        Num_Test_Sets = 0;
+        Num_Tests = 0;
+        return false;
+    }
+    log_format_line(FDM_TEST_LOG, "TABLE|%s|sets=%u|tests=%u", Table_Path, Num_Test_Sets, Num_Tests);
+    return true;
+}
+
+//Minutes to move from one point to the target at the target's rates
+static double plan_move_minutes(const ControlTarget *target, const double from_ps, const double from_pt)
+{
+    double minutes = 0;
+    if(target->ps_rate > 0)
+        minutes = fmax(minutes, fabs(target->ps - from_ps) / target->ps_rate);
+    if(target->pt_rate > 0)
+        minutes = fmax(minutes, fabs(target->pt - from_pt) / target->pt_rate);
+    return minutes;
+}
+
+static inline double plan_ground(const CTRL_UNITS units)
+{
+    return (units & CTRL_UNITS_INHG) ? PLAN_GROUND_INHG : 0;
+}
+
+//Estimated time of a ramp from ground to the setpoints
+static uint64_t plan_ramp_ms(const CTRL_UNITS units, const char *ps, const char *ps_rate, const char *pt, const char *pt_rate)
+{
+    ControlTarget target;
+    if(!ControlTarget_construct(&target, ps, ps_rate, pt, pt_rate)->valid)
+        return 0;
+    return (uint64_t)(plan_move_minutes(&target, plan_ground(units), plan_ground(units)) * 60000);
+}
+
+//A control test can start from the last one's setpoint with the same setup, as long as
+//getting there takes about as long as it would from ground, the test duration assumes ground
+static bool test_can_go_direct(const TEST_SET *test_set, const TEST *from, const TEST *to, uint64_t *move_ms)
+{
+    if(!test_set->direct_transitions || (test_set->type != TEST_T_CTRL) || (from == NULL) || (strcmp(from->setup, to->setup) != 0))
+        return false;
+
+    //from is the last test that ran, make sure it is from this set too
+    if(((const TestRecord*)from)->set != test_set)
+        return false;
+
+    const ControlTest *ct_from = (const ControlTest*)from;
+    const ControlTest *ct_to = (const ControlTest*)to;
+    ControlTarget start, target;
+    if((ct_from->units != ct_to->units) || !ControlTarget_construct(&start, ct_from->ps, ct_from->ps_rate, ct_from->pt, ct_from->pt_rate)->valid ||
+       !ControlTarget_construct(&target, ct_to->ps, ct_to->ps_rate, ct_to->pt, ct_to->pt_rate)->valid)
+        return false;
+
+    const double ground = plan_ground(ct_to->units);
+    const double minutes = plan_move_minutes(&target, start.ps, start.pt);
+    if(move_ms != NULL)
+        *move_ms = (uint64_t)(minutes * 60000);
+    return minutes <= (DIRECT_SLACK * plan_move_minutes(&target, ground, ground));
+}
+
+//GTG before each test that involves the master, unless it can move straight from the last test's setpoint
+static inline bool test_prepare_master(const TEST_SET *test_set, const TEST *test, const TEST **from, bool *at_ground)
+{
+    if(!test_set->init_master_before_each_test)
+        return true;
+
+    if(!*at_ground)
+    {        
+        if(test_can_go_direct(test_set, *from, test, NULL))
+            OUTPUT_PRINT("Test setup - Moving directly from the setpoint of %s", (*from)->test_name);
+        else
+        {
+            OUTPUT_PRINT("Test setup - Controlling to ground");
+            command_GTG_eventually(serial_get_SDM()->master.fd);
+            *from = NULL;
+        }
+    }
+    *at_ground = false;
+
+    //get rid of leftovers
+    return serial_fd_do(serial_get_SDM()->master.fd, "*CLS", NULL, 0, NULL);
+}
+
+//Show the setup and task, the user chooses what to do with the test
+static const char *test_result_name(const TEST_RESULT result)
+{
+    switch(result)
+    {
+        case TEST_RESULT_PASS: return "PASS";
+        case TEST_RESULT_FAIL: return "FAIL";
+        case TEST_RESULT_SKIP: return "SKIP";
+        default:               return "NOT RUN";
+    }
+}
+
+static void test_record_result(const TEST_SET *test_set, const uint index, const TEST_RESULT result, const uint64_t ms, const char *reason)
+{
+    const TEST *test = testset_get_test(test_set, index);
+    TestResult *tr = &Test_Results[(const TestRecord*)test - Test_Records];
+    tr->result = result;
+    tr->ms = ms;
+    tr->reason = reason;
+    log_format_line(FDM_TEST_LOG, "RESULT|%s|%u|%s|%s|ms=%llu%s%s", test_set->name, index+1, test->test_name, test_result_name(result),
+        (long long unsigned)ms, (reason != NULL) ? "|reason=" : "", (reason != NULL) ? reason : "");
+}
+
+static inline TEST_CHOICE test_prompt(const TEST_SET *test_set, const uint index, const tc_choice tc)
+{
+    TEST *test;
+    assert((test = testset_get_test(test_set, index)) != NULL); 
+    OUTPUT_PRINT("Test set %s - Test #%u: %s", test_set->name, index+1, test->test_name);            
+
+    OUTPUT_PRINT("SETUP: %s", test->setup);
+    if(test->user_task == NULL)
+    {
+        test->user_task = "Please wait for test to complete";
+    }
+  
+    OUTPUT_PRINT("TASK: %s",test->user_task);
+    return tc();
+}
+
+static bool test_table_has(const TEST_T type)
+{
+    for(uint i = 0; i < Num_Test_Sets; i++)
+    {
+        if((TestSets[i].type == type) && (TestSets[i].num_tests > 0))
+            return true;
+    }
+    return false;
+}
+
+//A test that ramps a unit leaves the LSU port idle, the valve tests' checks that need no operator are done meanwhile
+static inline void test_start_lsu_precheck(const TEST_SET *test_set, const TEST *test)
+{
+    const TEST_RES res = Test_Types[test_set->type].resources(test);
+    if((res & (TEST_RES_MASTER | TEST_RES_SLAVE)) && !(res & (TEST_RES_LSU | TEST_RES_LSU_VALVES | TEST_RES_LSU_LINES)) && test_table_has(TEST_T_LSUV))
+        lsu_precheck_start();
+}
+
+//The control setup of the test the operator is reading about, done on its own thread
+typedef struct TestPrepare {
+    pthread_t thread;
+    bool started;
+    int adts_fd;
+    CTRL_UNITS units;
+} TestPrepare;
+
+static void *test_prepare_thread(void *_prep)
+{
+    TestPrepare *prep = (TestPrepare*)_prep;
+    control_prepare(prep->adts_fd, prep->units);
+    return NULL;
+}
+
+static inline void test_prepare_start(const TEST_SET *test_set, const TEST *test, TestPrepare *prep)
+{
+    const prepare_func prepare = Test_Types[test_set->type].prepare;
+    prep->started = (prepare != NULL) && prepare(test, &prep->adts_fd, &prep->units) &&
+                    (pthread_create(&prep->thread, NULL, &test_prepare_thread, prep) == 0);
+}
+
+//Once the operator has chosen, a test that doesn't run leaves the unit as it was
+static inline void test_prepare_wait(TestPrepare *prep, const TEST_CHOICE tcvar)
+{
+    if(!prep->started)
+        return;
+    pthread_join(prep->thread, NULL);
+    if(!(tcvar & TC_RUN))
+        control_prepare_end(true);
+}
+
+//Show the setup and task, then run the test if the user chooses to
+static inline TEST_CHOICE test_prompt_and_run(const TEST_SET *test_set, const uint index, const tc_choice tc, bool *passed)
+{
+    TEST *test = testset_get_test(test_set, index);
+    TestPrepare prep;
+    test_prepare_start(test_set, test, &prep);
+    TEST_CHOICE tcvar = test_prompt(test_set, index, tc);
+    test_prepare_wait(&prep, tcvar);
+    //OUTPUT_PRINT("tc is %u", tcvar);
+
+    *passed = false;
+    if(tcvar & TC_RUN)
+    {
+        recorder_begin_segment(test->test_name);
+        test_start_lsu_precheck(test_set, test);
+        const uint64_t start_ms = time_in_ms();
+        //Finally run the test function
+        if(Test_Types[test_set->type].run(test))
+        {
+            OUTPUT_PRINT("Test set %s - Test #%u PASSED\n", test_set->name, index+1);
+            *passed = true;
+        }
+        else
+        {
+            ERROR_PRINT("Test set %s - Test #%u FAILED\n", test_set->name, index+1);                
+        }
+        test_record_result(test_set, index, *passed ? TEST_RESULT_PASS : TEST_RESULT_FAIL, time_in_ms() - start_ms, NULL);
+        //a test that stopped before its control setup leaves the preparation behind
+        control_prepare_end(false);
+    }
+    else if(tcvar & TC_SKIP)
+    {
+        OUTPUT_PRINT("Skipping test %u", index+1);                
+        test_record_result(test_set, index, TEST_RESULT_SKIP, 0, "operator");
+    }
+    return tcvar;
+}
+
+//Run the test sets in order, the user chooses each set as it comes up
+static void test_run_sets(UserFunc *user_func, bool *at_ground, uint *passed_cnt)
+{
+    const tc_choice tc = user_func->tc;
+    uint current_test = 0;
+    const TEST *from = NULL; //the last test that ran and left the master at its setpoint
+    for(uint i = 0; i < Num_Test_Sets; i++)
+    {
+        if(testset_paired(&TestSets[i]))
+            continue;
+        //Setup the test set
+        OUTPUT_PRINT("\nEntering test set: %s (%u/%u)", TestSets[i].name, i+1,Num_Test_Sets); 
+        if(!user_func->yes_no())
+        {
+            OUTPUT_PRINT("No - OK, skipping test set: %s (%u/%u)", TestSets[i].name, i+1,Num_Test_Sets); 
+            continue;
+        }
+        else
+            OUTPUT_PRINT("Yes");
+        uint test_set_passed_cnt = 0;
+        int num_tests = testset_get_num_tests(&TestSets[i]);
+
+        //Run the test set tests
+        for(int jsigned = 0; jsigned < num_tests; jsigned++)
+        {
+            uint j = (uint)jsigned; //jsigned will never be signed here
+            //if the tests involve the master, we will GTG before each test
+            if(!test_prepare_master(&TestSets[i], testset_get_test(&TestSets[i], j), &from, at_ground))
+                return;
+
+            bool passed;
+            TEST_CHOICE tcvar = test_prompt_and_run(&TestSets[i], j, tc, &passed);
+            if(passed)
+                test_set_passed_cnt++;
+            if(tcvar & TC_RUN)
+                from = passed ? testset_get_test(&TestSets[i], j) : NULL;
+            
+            if(tcvar & TC_PREV)
+            {                
+                if(current_test > 0)
+                {
+                    //can mess with test_set_passed_cnt, if a passed test is redone or testsets are switched
+                    OUTPUT_PRINT("Going to previous test\n");
+                    current_test--;
+                    jsigned -= 2;
+                    //if the previous test is outside of this test set
+                    if(jsigned < -1)
+                    {
+                        //set to the last test of the last testset, a paired one was never run
+                        do
+                            i--;
+                        while(testset_paired(&TestSets[i]));
+                        test_set_passed_cnt = 0;
+                        num_tests = testset_get_num_tests(&TestSets[i]);
+                        jsigned = num_tests - 1;                        
+                    } 
+                }
+                else
+                {
+                    OUTPUT_PRINT("Can't go back, on first test!\n");
+                }                
+            }
+            else
+            {
+                ++current_test;
+            }            
+        }
+        
+
+        OUTPUT_PRINT("\nTest set: %s complete, (%u/%u) tests PASSED", TestSets[i].name, test_set_passed_cnt, (uint)num_tests); 
+        *passed_cnt += test_set_passed_cnt;
+
+                
+        //go to ground if the test set involved leaving ground
+        if(TestSets[i].init_master_before_each_test)
+        {
+            OUTPUT_PRINT("Test set complete - Controlling to ground");
+            command_GTG_eventually(serial_get_SDM()->master.fd);
+            *at_ground = true;
+        }
+    }
+}
+
+uint64_t plan_control_ramp_ms(const TEST *test)
+{
+    const ControlTest *ct = (const ControlTest*)test;
+    return plan_ramp_ms(ct->units, ct->ps, ct->ps_rate, ct->pt, ct->pt_rate);
+}
+
+uint64_t plan_control_ms(const TEST *test)
+{
+    return 2 * plan_control_ramp_ms(test) + PLAN_VERIFY_MS;
+}
+
+uint64_t plan_single_ms(const TEST *test)
+{
+    const SingleChannelTest *st = (const SingleChannelTest*)test;
+    return 2 * plan_ramp_ms(st->units, st->ps, st->ps_rate, "0", "0") + PLAN_VERIFY_MS;
+}
+
+//Out to the setpoint, verified, and back to ground
+static uint64_t plan_leak_ms(const LeakTest *test)
+{
+    const uint64_t delay_ms = (strtoull(test->delay_minutes, NULL, 10) * 60 + strtoull(test->delay_seconds, NULL, 10)) * 1000;
+    return 2 * plan_ramp_ms(test->units, test->ps, test->ps_rate, test->pt, test->pt_rate) + PLAN_VERIFY_MS + delay_ms + PLAN_LEAK_MS;
+}
+
+uint64_t plan_leak_test_ms(const TEST *test)
+{
+    return plan_leak_ms((const LeakTest*)test);
+}
+
+uint64_t plan_pair_ms(const TEST *test)
+{
+    const LeakPairTest *pt = (const LeakPairTest*)test;
+    const uint64_t master_ms = plan_leak_ms(pt->master_test);
+    const uint64_t slave_ms = plan_leak_ms(pt->slave_test);
+    return (master_ms > slave_ms) ? master_ms : slave_ms;
+}
+
+TEST_RES test_res_control(const TEST *test)
+{
+    (void)test;
+    return TEST_RES_MASTER | TEST_RES_MASTER_PNEU;
+}
+
+//The units are plumbed to each other through the LSU
+TEST_RES test_res_single(const TEST *test)
+{
+    (void)test;
+    return TEST_RES_MASTER | TEST_RES_MASTER_PNEU | TEST_RES_SLAVE | TEST_RES_SLAVE_PNEU | TEST_RES_LSU_LINES;
+}
+
+TEST_RES test_res_lsu(const TEST *test)
+{
+    (void)test;
+    return TEST_RES_LSU | TEST_RES_LSU_VALVES | TEST_RES_OPERATOR;
+}
+
+//The PSA or CACD is connected through the LSU
+TEST_RES test_res_leak(const TEST *test)
+{
+    if(((const LeakTest*)test)->testing_master_unit)
+        return TEST_RES_MASTER | TEST_RES_MASTER_PNEU | TEST_RES_LSU_LINES;
+    return TEST_RES_SLAVE | TEST_RES_SLAVE_PNEU | TEST_RES_LSU_LINES;
+}
+
+TEST_RES test_res_pair(const TEST *test)
+{
+    const LeakPairTest *pt = (const LeakPairTest*)test;
+    return test_res_leak((const TEST*)pt->master_test) | test_res_leak((const TEST*)pt->slave_test);
+}
+
+//Everything on the devices the script talks to
+TEST_RES test_res_proc(const TEST *test)
+{
+    const uint32_t devices = script_devices(&((const ProcTest*)test)->script);
+    TEST_RES res = 0;
+    if(devices & (1u << SCRIPT_DEV_MASTER))
+        res |= TEST_RES_MASTER | TEST_RES_MASTER_PNEU;
+    if(devices & (1u << SCRIPT_DEV_SLAVE))
+        res |= TEST_RES_SLAVE | TEST_RES_SLAVE_PNEU;
+    if(devices & (1u << SCRIPT_DEV_LSU))
+        res |= TEST_RES_LSU | TEST_RES_LSU_VALVES;
+    if(script_asks_operator(&((const ProcTest*)test)->script))
+        res |= TEST_RES_OPERATOR;
+    return res;
+}
+
+bool test_prep_control(const TEST *test, int *adts_fd, CTRL_UNITS *units)
+{
+    *adts_fd = serial_get_SDM()->master.fd;
+    *units = ((const ControlTest*)test)->units;
+    return true;
+}
+
+bool test_prep_single(const TEST *test, int *adts_fd, CTRL_UNITS *units)
+{
+    *adts_fd = serial_get_SDM()->master.fd;
+    *units = ((const SingleChannelTest*)test)->units;
+    return true;
+}
+
+bool test_prep_leak(const TEST *test, int *adts_fd, CTRL_UNITS *units)
+{
+    const LeakTest *lt = (const LeakTest*)test;
+    *adts_fd = lt->testing_master_unit ? serial_get_SDM()->master.fd : serial_get_SDM()->slave.fd;
+    *units = lt->units;
+    return true;
+}
+
+static uint64_t plan_estimate_ms(const TEST_SET *test_set, const TEST *test)
+{
+    const TestType *type = &Test_Types[test_set->type];
+    return (type->estimate != NULL) ? type->estimate(test) : PLAN_OTHER_MS;
+}
+
+//Tests without a setup of their own run with whatever is connected
+static inline bool plan_needs_setup(const TEST *test)
 {
-    TEST_T_MEAS,
-    (test_func)(control_single_channel_test),
-    "ADTS Control and Measure",
-    true
-}, .tests =
-{
-    { 
-      {  "Control Rate of Climb - Aeronautical Units",
-         "Connect the PS and the PT units from unit to another on the LSU",
-         NULL,         
-      }, CTRL_UNITS_FK, 160000, CTRL_OP_PS, {.ps = "80000"}, {.ps_rate = "50000"}
-    },
-}};
-#define NUM_MEAS_TESTS LENGTH_2D(SingleChannelTests.tests)
-
-typedef struct LSUValveTestSet {
-    _TEST_SET;
-    LSUValveTest tests[9];
-} LSUValveTestSet;
+    return strcmp(test->setup, strLSUSetup) != 0;
+}
 
-#define strLSUOpenAndClose "LSU Valve Open and Close"
-#define strLSUSetup        "No additional setup required"
-#define strLSUTask         "Answer the prompts"
-static LSUValveTestSet LSUValveTests = {
+//Total estimate of running the steps in order, counting the setup changes and direct transitions
+static uint64_t plan_cost_ms(const TestPlan *plan, uint *num_changes, uint *num_direct)
 {
-    TEST_T_LSUV,
-    (test_func)(lsu_valve_test),
-    strLSUOpenAndClose,
-    false
-}, .tests = 
-{
-    {
-      {  strLSUOpenAndClose " All Valves",
-         strLSUSetup,
-         strLSUTask,
-      }, "ALL"
-    },
-    {
-      {  strLSUOpenAndClose " PS #1",
-         strLSUSetup,
-         strLSUTask,
-      }, "1"
-    },
-    {
-      {  strLSUOpenAndClose " PS #2",
-         strLSUSetup,
-         strLSUTask,
-      }, "2"
-    },
-    {
-      {  strLSUOpenAndClose " PS #3",
-         strLSUSetup,
-         strLSUTask,
-      }, "3"
-    },
-    {
-      {  strLSUOpenAndClose " PS #4",
-         strLSUSetup,
-         strLSUTask,
-      }, "4"
-    },
-    {
-      {  strLSUOpenAndClose " PT #1",
-         strLSUSetup,
-         strLSUTask,
-      }, "5"
-    },
-    {
-      {  strLSUOpenAndClose " PT #2",
-         strLSUSetup,
-         strLSUTask,
-      }, "6"
-    },
-    {
-      {  strLSUOpenAndClose " PT #3",
-         strLSUSetup,
-         strLSUTask,
-      }, "7"
-    },
-    {
-      {  strLSUOpenAndClose " PT #4",
-         strLSUSetup,
-         strLSUTask,
-      }, "8"
-    },
-}};
-#define NUM_LSUV_TESTS LENGTH_2D(LSUValveTests.tests)
-
-
-typedef struct LeakTestSet {
-    _TEST_SET;
-    LeakTest tests[4];
-} LeakTestSet;
-
-LeakTestSet LeakTests = {
+    uint64_t total_ms = 0;
+    const char *setup = NULL;
+    *num_changes = 0;
+    *num_direct = 0;
+    for(uint i = 0; i < plan->num_steps; i++)
+    {
+        const PlanStep *step = &plan->steps[i];
+        total_ms += step->est_ms;
+        if(plan_needs_setup(step->test) && ((setup == NULL) || (strcmp(setup, step->test->setup) != 0)))
+        {
+            setup = step->test->setup;
+            total_ms += PLAN_SETUP_MS;
+            (*num_changes)++;
+        }
+
+        //no trip back to ground for the last test, and a different trip out for this one
+        uint64_t move_ms;
+        if((i > 0) && test_can_go_direct(step->test_set, plan->steps[i-1].test, step->test, &move_ms))
+        {
+            total_ms = total_ms - plan->steps[i-1].ramp_ms - step->ramp_ms + move_ms;
+            (*num_direct)++;
+        }
+    }
+    return total_ms;
+}
+
+//Groups the steps by setup in the order each setup first comes up, shortest test first within a group
+static void plan_optimize(const TestPlan *in, TestPlan *out)
 {
-    TEST_T_LEAK,
-    (test_func)control_run_leak_test,
-    "ADTS Leak Test",
-    false    
-}, {
-    {{ 
-      {  "Low Pressure Leak Test with CACD",
-         "Connect CACD or volume to LSU straight-through",
-         NULL,         
-      }, CTRL_UNITS_INHG, 200000, "3.425", "40", "3.425", "40"
-    }, 0.010, 0.010, "2", "0", false
-    },
-    {{ 
-      {  "High Pressure Leak Test with CACD",
-         "Connect CACD or volume with LSU straight-through",
-         NULL,         
-      }, CTRL_UNITS_INHG, 200000, "3.425", "40", "73.500", "40"
-    }, 0.010, 0.020, "2", "0", false
-    },
-    {{ 
-      {  "Low Pressure Leak Test with PSA",
-         "Connect PSA or volume to LSU, turn on the valves in use on the LSU",
-         NULL,         
-      }, CTRL_UNITS_INHG, 200000, "3.425", "40", "3.425", "40"
-    }, 0.010, 0.012, "2", "0", true
-    },
-    {{ 
-      {  "High Pressure Leak Test with PSA",
-         "Connect PSA or volume to LSU, turn on the valves in use on the LSU",
-         NULL,         
-      }, CTRL_UNITS_INHG, 200000, "3.425", "40", "73.500", "40"
-    }, 0.010, 0.025, "2", "0", true
-    },
-}};
-#define NUM_LEAK_TESTS LENGTH_2D(LeakTests.tests)
-
-static TEST_SET *TestSets[] = 
-{
-    (TEST_SET*)&ControlTests,
-    (TEST_SET*)&LeakTests,
-    (TEST_SET*)&SingleChannelTests,
-    (TEST_SET*)&LSUValveTests,    
-};
-#define NUM_TEST_SETS LENGTH_2D(TestSets)
+    bool placed[TEST_MAX_RECORDS] = {false};
+    out->num_steps = 0;
+    for(uint i = 0; i < in->num_steps; i++)
+    {
+        if(placed[i])
+            continue;
 
-#define NUM_TESTS (NUM_CONTROL_TESTS + NUM_MEAS_TESTS + NUM_LSUV_TESTS + NUM_LEAK_TESTS)
+        const uint first = out->num_steps;
+        for(uint j = i; j < in->num_steps; j++)
+        {
+            if(placed[j] || (strcmp(in->steps[i].test->setup, in->steps[j].test->setup) != 0))
+                continue;
+            placed[j] = true;
 
-static inline int testset_get_num_tests(const TEST_SET *test_set)
+            //insertion sort, ties keep their default order
+            uint k = out->num_steps++;
+            while((k > first) && (out->steps[k-1].est_ms > in->steps[j].est_ms))
+            {
+                out->steps[k] = out->steps[k-1];
+                k--;
+            }
+            out->steps[k] = in->steps[j];
+        }
+    }
+}
+
+static void plan_add_test(TestPlan *plan, TEST_SET *test_set, const uint index)
 {
-    if(test_set->type == TEST_T_CTRL)
-        return NUM_CONTROL_TESTS;
-    else if(test_set->type == TEST_T_MEAS)
-        return NUM_MEAS_TESTS;
-    else if(test_set->type == TEST_T_LSUV)
-        return NUM_LSUV_TESTS;
-    else if(test_set->type == TEST_T_LEAK)
-        return NUM_LEAK_TESTS;
-    else return -1;
+    PlanStep *step = &plan->steps[plan->num_steps++];
+    step->test_set = test_set;
+    step->index = index;
+    step->test = testset_get_test(test_set, index);
+    step->est_ms = plan_estimate_ms(test_set, step->test);
+    step->ramp_ms = (Test_Types[test_set->type].ramp != NULL) ? Test_Types[test_set->type].ramp(step->test) : 0;
 }
 
-static inline TEST *testset_get_test(const TEST_SET *test_set, const uint index)
-{    
-    if(test_set->type == TEST_T_CTRL)
-        return (TEST*)&(((ControlTestSet*)test_set)->tests[index]);
-    else if(test_set->type == TEST_T_MEAS)
-        return (TEST*)&(((SingleChannelTestSet*)test_set)->tests[index]);
-    else if(test_set->type == TEST_T_LSUV)
-        return (TEST*)&(((LSUValveTestSet*)test_set)->tests[index]);
-    else if(test_set->type == TEST_T_LEAK)
-        return (TEST*)&(((LeakTestSet*)test_set)->tests[index]);
-    else return NULL;
+static void plan_report(const TestPlan *default_plan, const TestPlan *plan)
+{
+    uint default_changes, planned_changes, default_direct, planned_direct;
+    const uint64_t default_ms = plan_cost_ms(default_plan, &default_changes, &default_direct);
+    const uint64_t planned_ms = plan_cost_ms(plan, &planned_changes, &planned_direct);
+    OUTPUT_PRINT("\nPlanned order of %u tests:", plan->num_steps);
+    for(uint i = 0; i < plan->num_steps; i++)
+        OUTPUT_PRINT("%2u. %s (about %llu s) - %s", i+1, plan->steps[i].test->test_name, (long long unsigned)(plan->steps[i].est_ms / 1000), plan->steps[i].test->setup);
+    OUTPUT_PRINT("Estimated %.1f minutes with %u setup changes and %u direct transitions, %.1f minutes with %u and %u in the default order, saves %.1f minutes",
+        planned_ms / 60000.0, planned_changes, planned_direct, default_ms / 60000.0, default_changes, default_direct, ((double)default_ms - (double)planned_ms) / 60000.0);
+    log_format_line(FDM_TEST_LOG, "PLAN|tests=%u|planned_ms=%llu|planned_changes=%u|planned_direct=%u|default_ms=%llu|default_changes=%u|default_direct=%u", plan->num_steps,
+        (long long unsigned)planned_ms, planned_changes, planned_direct, (long long unsigned)default_ms, default_changes, default_direct);
 }
 
-//Run all the tests, pass in a callback of your waiting function
-void test_run_all(UserFunc *user_func)
-{   
-    const tc_choice tc = user_func->tc;
-    //Run the test sets
-    uint passed_cnt = 0;      
-    uint current_test = 0;
-    bool at_ground = false;
-    for(uint i = 0; i < NUM_TEST_SETS; i++)
+//The chosen test sets grouped by setup, so volumes are swapped as few times as possible
+static void test_plan(UserFunc *user_func, TestPlan *plan)
+{
+    TestPlan default_plan;
+    default_plan.num_steps = 0;
+    for(uint i = 0; i < Num_Test_Sets; i++)
     {
-        //Setup the test set
-        OUTPUT_PRINT("\nEntering test set: %s (%u/%u)", TestSets[i]->name, i+1,NUM_TEST_SETS); 
+        if(testset_paired(&TestSets[i]))
+            continue;
+        OUTPUT_PRINT("\nInclude test set: %s (%u/%u)", TestSets[i].name, i+1, Num_Test_Sets); 
         if(!user_func->yes_no())
         {
-            OUTPUT_PRINT("No - OK, skipping test set: %s (%u/%u)", TestSets[i]->name, i+1,NUM_TEST_SETS); 
+            OUTPUT_PRINT("No - OK, skipping test set: %s (%u/%u)", TestSets[i].name, i+1, Num_Test_Sets); 
             continue;
         }
-        else
-            OUTPUT_PRINT("Yes");
-        uint test_set_passed_cnt = 0;
-        int num_tests = testset_get_num_tests(TestSets[i]);
+        OUTPUT_PRINT("Yes");
+        for(int j = 0; j < testset_get_num_tests(&TestSets[i]); j++)
+            plan_add_test(&default_plan, &TestSets[i], (uint)j);
+    }
+    plan_optimize(&default_plan, plan);
+    plan_report(&default_plan, plan);
+}
 
-        //Run the test set tests
-        for(int jsigned = 0; jsigned < num_tests; jsigned++)
+//Run the planned steps one at a time
+static void test_run_planned(UserFunc *user_func, const TestPlan *plan, bool *at_ground, uint *passed_cnt)
+{
+    const TEST *from = NULL; //the last test that ran and left the master at its setpoint
+    for(int isigned = 0; isigned < (int)plan->num_steps; isigned++)
+    {
+        const PlanStep *step = &plan->steps[isigned];
+        //leaving a master test, the next test may need the master at ground or a new setup
+        if(!step->test_set->init_master_before_each_test && (isigned > 0) && plan->steps[isigned-1].test_set->init_master_before_each_test && !*at_ground)
         {
-            uint j = (uint)jsigned; //jsigned will never be signed here
-            //if the tests involve the master, we will GTG before each test
-            if(TestSets[i]->init_master_before_each_test)
-            {        
-                if(!at_ground)
-                {        
-                    OUTPUT_PRINT("Test setup - Controlling to ground");
-                    command_GTG_eventually(serial_get_SDM()->master.fd);
-                }
-                at_ground = false;
+            OUTPUT_PRINT("Test setup - Controlling to ground");
+            command_GTG_eventually(serial_get_SDM()->master.fd);
+            *at_ground = true;
+        }
+        if(!test_prepare_master(step->test_set, step->test, &from, at_ground))
+            return;
 
-                //get rid of leftovers
-                if(!serial_fd_do(serial_get_SDM()->master.fd, "*CLS", NULL, 0, NULL))
-                    return;                
-            }
-            
-            TEST *test;
-            assert((test = testset_get_test(TestSets[i], j)) != NULL); 
-            OUTPUT_PRINT("Test set %s - Test #%u: %s", TestSets[i]->name, j+1, test->test_name);            
+        bool passed;
+        const TEST_CHOICE tcvar = test_prompt_and_run(step->test_set, step->index, user_func->tc, &passed);
+        if(passed)
+            (*passed_cnt)++;
+        if(tcvar & TC_RUN)
+            from = passed ? step->test : NULL;
 
-            OUTPUT_PRINT("SETUP: %s", test->setup);
-            if(test->user_task == NULL)
+        if(tcvar & TC_PREV)
+        {
+            if(isigned > 0)
             {
-                test->user_task = "Please wait for test to complete";
+                //can mess with passed_cnt, if a passed test is redone
+                OUTPUT_PRINT("Going to previous test\n");
+                isigned -= 2;
             }
-      
-            OUTPUT_PRINT("TASK: %s",test->user_task);
-            TEST_CHOICE tcvar = tc();
-            //OUTPUT_PRINT("tc is %u", tcvar);
-
-            if(tcvar & TC_RUN)
+            else
             {
-                //Finally run the test function
-                if(TestSets[i]->test_func(test))
-                {
-                    OUTPUT_PRINT("Test set %s - Test #%u PASSED\n", TestSets[i]->name, j+1);
-                    test_set_passed_cnt++;                         
-                }
-                else
-                {
-                    ERROR_PRINT("Test set %s - Test #%u FAILED\n", TestSets[i]->name, j+1);                
-                }
+                OUTPUT_PRINT("Can't go back, on first test!\n");
+                isigned--;
             }
-            else if(tcvar & TC_SKIP)
+        }
+    }
+
+    //go to ground if the last test left it
+    if((plan->num_steps > 0) && plan->steps[plan->num_steps-1].test_set->init_master_before_each_test)
+    {
+        OUTPUT_PRINT("Tests complete - Controlling to ground");
+        command_GTG_eventually(serial_get_SDM()->master.fd);
+        *at_ground = true;
+    }
+}
+
+//One step of the plan in the parallel run, the steps it depends on come before it in the plan
+typedef struct Scheduler Scheduler;
+typedef struct SchedStep {
+    Scheduler *sched;
+    const PlanStep *plan;
+    TEST_RES resources;
+    uint64_t deps;      //bit i is set if step i has to finish first
+    uint64_t finish_ms; //estimated, along the longest chain of steps leading to it
+    pthread_t thread;
+    bool passed;
+} SchedStep;
+
+struct Scheduler {
+    SchedStep steps[TEST_MAX_RECORDS];
+    uint num_steps;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    uint64_t done;      //bit i is set once step i is over, run or skipped
+    //only touched by the step holding TEST_RES_MASTER, or by the scheduler while no step holds it
+    const TEST *from;
+    bool *at_ground;
+    bool master_left;   //the last master step left it at a setpoint
+};
+
+//Tests conflict over the same device or connections. Any number of tests may rely on the pressure through the LSU,
+//as long as none of them moves the valves
+static bool test_res_conflict(const TEST_RES a, const TEST_RES b)
+{
+    if((a & b & ~(TEST_RES_LSU_LINES | TEST_RES_OPERATOR)) != 0)
+        return true;
+    return ((a & TEST_RES_LSU_VALVES) && (b & TEST_RES_LSU_LINES)) || ((b & TEST_RES_LSU_VALVES) && (a & TEST_RES_LSU_LINES));
+}
+
+//Only one setup is connected at a time, tests that don't need one go along with any of them
+static bool test_setup_conflict(const TEST *a, const TEST *b)
+{
+    return plan_needs_setup(a) && plan_needs_setup(b) && (strcmp(a->setup, b->setup) != 0);
+}
+
+static const char *test_res_name(const TEST_RES res)
+{
+    switch(res & (TEST_RES_MASTER | TEST_RES_SLAVE | TEST_RES_LSU))
+    {
+        case TEST_RES_MASTER: return "master";
+        case TEST_RES_SLAVE:  return "slave";
+        case TEST_RES_LSU:    return "LSU";
+        default:              return "station";
+    }
+}
+
+static inline uint popcount64(uint64_t x)
+{
+    return (uint)__builtin_popcountll(x);
+}
+
+//A step depends on every step before it in the plan that it conflicts with, so the steps of one device or
+//one setup keep their planned order. Returns the estimated time of the longest chain
+static uint64_t sched_build(Scheduler *sched, const TestPlan *plan, uint *num_edges)
+{
+    uint64_t critical_ms = 0;
+    const char *setup = NULL;
+    *num_edges = 0;
+    sched->num_steps = plan->num_steps;
+    for(uint i = 0; i < plan->num_steps; i++)
+    {
+        SchedStep *step = &sched->steps[i];
+        step->sched = sched;
+        step->plan = &plan->steps[i];
+        step->resources = Test_Types[step->plan->test_set->type].resources(step->plan->test);
+        step->deps = 0;
+
+        uint64_t start_ms = 0;
+        for(uint j = 0; j < i; j++)
+        {
+            if(test_res_conflict(step->resources, sched->steps[j].resources) || test_setup_conflict(step->plan->test, sched->steps[j].plan->test))
             {
-                OUTPUT_PRINT("Skipping test %u", j+1);                
+                step->deps |= 1ull << j;
+                if(sched->steps[j].finish_ms > start_ms)
+                    start_ms = sched->steps[j].finish_ms;
             }
-            
-            if(tcvar & TC_PREV)
-            {                
-                if(current_test > 0)
-                {
-                    //can mess with test_set_passed_cnt, if a passed test is redone or testsets are switched
-                    OUTPUT_PRINT("Going to previous test\n");
-                    current_test--;
-                    jsigned -= 2;
-                    //if the previous test is outside of this test set
-                    if(jsigned < -1)
-                    {
-                        //set to the last test of the last testset
-                        i--;
-                        test_set_passed_cnt = 0;
-                        num_tests = testset_get_num_tests(TestSets[i]);
-                        jsigned = num_tests - 1;                        
-                    } 
-                }
-                else
-                {
-                    OUTPUT_PRINT("Can't go back, on first test!\n");
-                }                
+        }
+        *num_edges += popcount64(step->deps);
+
+        if(plan_needs_setup(step->plan->test) && ((setup == NULL) || (strcmp(setup, step->plan->test->setup) != 0)))
+        {
+            setup = step->plan->test->setup;
+            start_ms += PLAN_SETUP_MS;
+        }
+        step->finish_ms = start_ms + step->plan->est_ms;
+        if(step->finish_ms > critical_ms)
+            critical_ms = step->finish_ms;
+    }
+    return critical_ms;
+}
+
+//The step holding the master prepares it the way test_run_planned does between steps
+static bool sched_prepare_master(Scheduler *sched, const PlanStep *step)
+{
+    if(!step->test_set->init_master_before_each_test && sched->master_left && !*sched->at_ground)
+    {
+        OUTPUT_PRINT("Test setup - Controlling to ground");
+        command_GTG_eventually(serial_get_SDM()->master.fd);
+        *sched->at_ground = true;
+    }
+    return test_prepare_master(step->test_set, step->test, &sched->from, sched->at_ground);
+}
+
+static void *sched_thread(void *_step)
+{
+    SchedStep *step = (SchedStep*)_step;
+    Scheduler *sched = step->sched;
+    const PlanStep *plan = step->plan;
+    const bool master = (step->resources & TEST_RES_MASTER) != 0;
+    log_set_unit(test_res_name(step->resources), FDM_INVALID);
+
+    step->passed = false;
+    const uint64_t start_ms = time_in_ms();
+    if(!master || sched_prepare_master(sched, plan))
+    {
+        //the recorder has one current segment, it follows the master's tests, which never overlap
+        if(master)
+            recorder_begin_segment(plan->test->test_name);
+        step->passed = Test_Types[plan->test_set->type].run(plan->test);
+    }
+    if(step->passed)
+        OUTPUT_PRINT("Test set %s - Test #%u PASSED\n", plan->test_set->name, plan->index+1);
+    else
+        ERROR_PRINT("Test set %s - Test #%u FAILED\n", plan->test_set->name, plan->index+1);
+    test_record_result(plan->test_set, plan->index, step->passed ? TEST_RESULT_PASS : TEST_RESULT_FAIL, time_in_ms() - start_ms, NULL);
+    if(master)
+    {
+        sched->from = step->passed ? plan->test : NULL;
+        sched->master_left = plan->test_set->init_master_before_each_test;
+    }
+    log_set_unit(NULL, FDM_INVALID);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->done |= 1ull << (step - sched->steps);
+    pthread_cond_signal(&sched->finished);
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+static void sched_mark_done(Scheduler *sched, const uint i)
+{
+    pthread_mutex_lock(&sched->lock);
+    sched->done |= 1ull << i;
+    pthread_mutex_unlock(&sched->lock);
+}
+
+//Shown while nobody else is asking the operator anything. A new setup is only shown once the master is back at ground
+static TEST_CHOICE sched_prompt(Scheduler *sched, const SchedStep *step, const tc_choice tc, const bool new_setup)
+{
+    if(new_setup && !*sched->at_ground)
+    {
+        OUTPUT_PRINT("Test setup - Controlling to ground");
+        command_GTG_eventually(serial_get_SDM()->master.fd);
+        *sched->at_ground = true;
+        sched->from = NULL;
+    }
+
+    operator_queue_enter();
+    TEST_CHOICE tcvar;
+    while((tcvar = test_prompt(step->plan->test_set, step->plan->index, tc)) & TC_PREV)
+        OUTPUT_PRINT("Can't go back while tests run at the same time\n");
+    if(!(tcvar & TC_RUN))
+    {
+        OUTPUT_PRINT("Skipping test %u", step->plan->index+1);
+        test_record_result(step->plan->test_set, step->plan->index, TEST_RESULT_SKIP, 0, "operator");
+    }
+    operator_queue_leave();
+    return tcvar;
+}
+
+//Run the planned steps, each as soon as the steps it depends on are over. The station takes about as long as its
+//longest chain of dependent steps, instead of the sum of them all
+static void test_run_parallel(UserFunc *user_func, const TestPlan *plan, bool *at_ground, uint *passed_cnt)
+{
+    Scheduler sched;
+    memset(&sched, 0, sizeof(sched));
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.finished, NULL);
+    sched.at_ground = at_ground;
+
+    uint num_edges, num_changes, num_direct;
+    const uint64_t critical_ms = sched_build(&sched, plan, &num_edges);
+    const uint64_t serial_ms = plan_cost_ms(plan, &num_changes, &num_direct);
+    OUTPUT_PRINT("Estimated %.1f minutes running tests that don't share a unit or connection at the same time, %.1f minutes one at a time",
+        critical_ms / 60000.0, serial_ms / 60000.0);
+    log_format_line(FDM_TEST_LOG, "SCHED|tests=%u|edges=%u|critical_ms=%llu|serial_ms=%llu", sched.num_steps, num_edges,
+        (long long unsigned)critical_ms, (long long unsigned)serial_ms);
+
+    //the cross check would read the slave while another test may be using it, the LSU tests run alongside the ramps anyway
+    control_set_cross_check(false);
+    lsu_precheck_wait();
+    //registering a log isn't thread safe, the PAIR tests find theirs open
+    for(uint i = 0; i < plan->num_steps; i++)
+    {
+        if(plan->steps[i].test_set->type == TEST_T_LEAK_PAIR)
+        {
+            log_open_unit(serial_get_SDM()->master.sn);
+            log_open_unit(serial_get_SDM()->slave.sn);
+            break;
+        }
+    }
+    const uint64_t start_ms = time_in_ms();
+    const uint64_t all = (sched.num_steps == 64) ? ~0ull : ((1ull << sched.num_steps) - 1);
+    const char *setup = NULL;
+    uint64_t started = 0, running = 0, done = 0;
+    uint max_running = 0;
+    while(done != all)
+    {
+        bool progress = false;
+        for(uint i = 0; i < sched.num_steps; i++)
+        {
+            SchedStep *step = &sched.steps[i];
+            const uint64_t bit = 1ull << i;
+            if((started & bit) || (step->deps & ~done))
+                continue;
+
+            //the dependencies keep conflicting steps apart, a setup change still has to wait for the master
+            const bool new_setup = plan_needs_setup(step->plan->test) && ((setup == NULL) || (strcmp(setup, step->plan->test->setup) != 0));
+            bool master_busy = false;
+            for(uint j = 0; j < sched.num_steps; j++)
+                master_busy |= ((running >> j) & 1) && (sched.steps[j].resources & TEST_RES_MASTER);
+            if(new_setup && master_busy)
+                continue;
+
+            started |= bit;
+            progress = true;
+            if(!(sched_prompt(&sched, step, user_func->tc, new_setup) & TC_RUN))
+            {
+                sched_mark_done(&sched, i);
+                continue;
             }
-            else
+            if(plan_needs_setup(step->plan->test))
+                setup = step->plan->test->setup;
+
+            if(pthread_create(&step->thread, NULL, &sched_thread, step) != 0)
             {
-                ++current_test;
-            }            
+                ERROR_PRINT("Could not start the thread for %s, running it here", step->plan->test->test_name);
+                sched_thread(step);
+                if(step->passed)
+                    (*passed_cnt)++;
+                continue;
+            }
+            running |= bit;
+            if(popcount64(running) > max_running)
+                max_running = popcount64(running);
         }
-        
 
-        OUTPUT_PRINT("\nTest set: %s complete, (%u/%u) tests PASSED", TestSets[i]->name, test_set_passed_cnt, (uint)num_tests); 
-        passed_cnt += test_set_passed_cnt;
+        pthread_mutex_lock(&sched.lock);
+        while(!progress && (sched.done == done) && (running != 0))
+            pthread_cond_wait(&sched.finished, &sched.lock);
+        done = sched.done;
+        pthread_mutex_unlock(&sched.lock);
 
-                
-        //go to ground if the test set involved leaving ground
-        if(TestSets[i]->init_master_before_each_test)
+        for(uint i = 0; i < sched.num_steps; i++)
         {
-            OUTPUT_PRINT("Test set complete - Controlling to ground");
-            command_GTG_eventually(serial_get_SDM()->master.fd);
-            at_ground = true;
+            if((running & done) & (1ull << i))
+            {
+                pthread_join(sched.steps[i].thread, NULL);
+                running &= ~(1ull << i);
+                if(sched.steps[i].passed)
+                    (*passed_cnt)++;
+            }
         }
     }
+    control_set_cross_check(true);
+
+    const uint64_t elapsed_ms = time_in_ms() - start_ms;
+    OUTPUT_PRINT("Tests complete in %.1f minutes, up to %u at the same time", elapsed_ms / 60000.0, max_running);
+    log_format_line(FDM_TEST_LOG, "SCHED|elapsed_ms=%llu|max_running=%u", (long long unsigned)elapsed_ms, max_running);
+
+    //go to ground if the last master test left it
+    if(sched.master_left)
+    {
+        OUTPUT_PRINT("Tests complete - Controlling to ground");
+        command_GTG_eventually(serial_get_SDM()->master.fd);
+        *at_ground = true;
+    }
+    pthread_cond_destroy(&sched.finished);
+    pthread_mutex_destroy(&sched.lock);
+}
 
-    OUTPUT_PRINT("All test set tests: complete, (%u/%u) total tests PASSED", passed_cnt, NUM_TESTS); 
+//The units go back to ground and local control once the tests are over
+static void test_run_finish(const bool at_ground, const uint passed_cnt, const uint num_tests)
+{
+    lsu_precheck_wait();
+    lsu_batch_forget();
+    OUTPUT_PRINT("All test set tests: complete, (%u/%u) total tests PASSED", passed_cnt, num_tests); 
     
     //control to ground, remote mode is no longer needed
     if(!at_ground)
@@ -410,3 +1539,217 @@ void test_run_all(UserFunc *user_func)
     serial_fd_do(serial_get_SDM()->slave.fd, ":SYST:REMOTE DISABLE", NULL, 0, NULL); 
 }
 
+void test_set_table(const char *path)
+{
+    Table_File = path;
+}
+
+const char *test_get_table()
+{
+    return Table_File;
+}
+
+//Run all the tests, pass in a callback of your waiting function
+void test_run_all(UserFunc *user_func)
+{   
+    if((Num_Test_Sets == 0) && !test_load_table(Table_File))
+        return;
+    memset(Test_Results, 0, sizeof(Test_Results));
+
+    //Run the test sets
+    uint passed_cnt = 0;      
+    bool at_ground = false;
+    OUTPUT_PRINT("\nPlan the test order to reduce volume swaps?"); 
+    if(user_func->yes_no())
+    {
+        OUTPUT_PRINT("Yes");
+        TestPlan plan;
+        test_plan(user_func, &plan);
+        OUTPUT_PRINT("\nRun tests that don't share a unit or connection at the same time?");
+        if(user_func->yes_no())
+        {
+            OUTPUT_PRINT("Yes");
+            test_run_parallel(user_func, &plan, &at_ground, &passed_cnt);
+        }
+        else
+        {
+            OUTPUT_PRINT("No - OK, one test at a time");
+            test_run_planned(user_func, &plan, &at_ground, &passed_cnt);
+        }
+    }
+    else
+    {
+        OUTPUT_PRINT("No - OK, running the test sets in order");
+        test_run_sets(user_func, &at_ground, &passed_cnt);
+    }
+
+    test_run_finish(at_ground, passed_cnt, test_num_default());
+}
+
+//Every test the batch chose is run, there is no one to ask
+static TEST_CHOICE batch_tc()
+{
+    return TC_RUN;
+}
+
+//A question that slipped past the operator policy is answered No, so the test asking it fails
+static bool batch_unanswered()
+{
+    OUTPUT_PRINT("No one to answer in batch mode - No");
+    log_format_line(FDM_TEST_LOG, "BATCH|unanswered");
+    return false;
+}
+
+//A selection names a test set or a single test
+static bool batch_selected(const BatchJob *job, const TEST_SET *test_set, const TEST *test, bool *matched)
+{
+    if(job->num_select == 0)
+        return !testset_paired(test_set);
+    bool selected = false;
+    for(int i = 0; i < job->num_select; i++)
+    {
+        if((strcasecmp(job->select[i], test_set->name) == 0) || (strcasecmp(job->select[i], test->test_name) == 0))
+        {
+            matched[i] = true;
+            selected = true;
+        }
+    }
+    return selected;
+}
+
+static void batch_write_summary(const BatchJob *job, const TestPlan *chosen, const BATCH_STATUS status, const uint64_t elapsed_ms)
+{
+    FILE *file = (job->summary != NULL) ? fopen(job->summary, "w") : stdout;
+    if(file == NULL)
+    {
+        ERROR_PRINT("Unable to write the batch summary %s", job->summary);
+        file = stdout;
+    }
+
+    uint num_passed = 0, num_failed = 0, num_skipped = 0, num_not_run = 0;
+    for(uint i = 0; i < chosen->num_steps; i++)
+    {
+        const PlanStep *step = &chosen->steps[i];
+        const TestResult *tr = &Test_Results[(const TestRecord*)step->test - Test_Records];
+        num_passed += (tr->result == TEST_RESULT_PASS);
+        num_failed += (tr->result == TEST_RESULT_FAIL);
+        num_skipped += (tr->result == TEST_RESULT_SKIP);
+        num_not_run += (tr->result == TEST_RESULT_NONE);
+        fprintf(file, "RESULT|%s|%u|%s|%s|ms=%llu%s%s\n", step->test_set->name, step->index+1, step->test->test_name, test_result_name(tr->result),
+            (long long unsigned)tr->ms, (tr->reason != NULL) ? "|reason=" : "", (tr->reason != NULL) ? tr->reason : "");
+    }
+    const char *status_name = "PASSED";
+    if(status == BATCH_FAILED)
+        status_name = "FAILED";
+    else if(status == BATCH_REFUSED)
+        status_name = "REFUSED";
+    else if(status == BATCH_NOT_RUN)
+        status_name = "NOT_RUN";
+    else if(status == BATCH_ERROR)
+        status_name = "ERROR";
+    fprintf(file, "SUMMARY|status=%s|master=%s|slave=%s|table=%s|selected=%u|passed=%u|failed=%u|skipped=%u|not_run=%u|elapsed_ms=%llu\n", status_name,
+        serial_get_SDM()->master.sn, serial_get_SDM()->slave.sn, (Table_Path != NULL) ? Table_Path : Table_File, chosen->num_steps, num_passed, num_failed, num_skipped, num_not_run,
+        (long long unsigned)elapsed_ms);
+    log_format_line(FDM_TEST_LOG, "BATCH|status=%s|selected=%u|passed=%u|failed=%u|skipped=%u|not_run=%u|elapsed_ms=%llu", status_name,
+        chosen->num_steps, num_passed, num_failed, num_skipped, num_not_run, (long long unsigned)elapsed_ms);
+    if(file != stdout)
+        fclose(file);
+}
+
+//Run the tests the job selects with no one at the station. Tests that need someone to answer their questions are skipped
+//or refuse the whole job, by the job's policy
+BATCH_STATUS test_batch_error(const BatchJob *job)
+{
+    TestPlan none;
+    none.num_steps = 0;
+    batch_write_summary(job, &none, BATCH_ERROR, 0);
+    return BATCH_ERROR;
+}
+
+BATCH_STATUS test_run_batch(const BatchJob *job)
+{
+    if((Num_Test_Sets == 0) && !test_load_table(Table_File))
+        return test_batch_error(job);
+    memset(Test_Results, 0, sizeof(Test_Results));
+    const uint64_t start_ms = time_in_ms();
+
+    //chosen is every selected test for the summary, default_plan the ones that will run
+    TestPlan chosen, default_plan;
+    chosen.num_steps = 0;
+    default_plan.num_steps = 0;
+    bool matched[BATCH_MAX_SELECT] = {false};
+    uint num_operator = 0;
+    for(uint i = 0; i < Num_Test_Sets; i++)
+    {
+        for(int j = 0; j < testset_get_num_tests(&TestSets[i]); j++)
+        {
+            const TEST *test = testset_get_test(&TestSets[i], (uint)j);
+            if(!batch_selected(job, &TestSets[i], test, matched))
+                continue;
+            plan_add_test(&chosen, &TestSets[i], (uint)j);
+            if(Test_Types[TestSets[i].type].resources(test) & TEST_RES_OPERATOR)
+            {
+                num_operator++;
+                test_record_result(&TestSets[i], (uint)j, TEST_RESULT_SKIP, 0, "needs an operator");
+                continue;
+            }
+            plan_add_test(&default_plan, &TestSets[i], (uint)j);
+        }
+    }
+
+    BATCH_STATUS status = BATCH_PASSED;
+    for(int i = 0; i < job->num_select; i++)
+    {
+        if(!matched[i])
+        {
+            ERROR_PRINT("No test set or test named %s in %s", job->select[i], Table_Path);
+            status = BATCH_REFUSED;
+        }
+    }
+    if((num_operator > 0) && (job->operator_policy & BATCH_OPERATOR_REFUSE))
+    {
+        ERROR_PRINT("%u of the selected tests need an operator, the batch is refused", num_operator);
+        status = BATCH_REFUSED;
+    }
+    else if(num_operator > 0)
+    {
+        OUTPUT_PRINT("Skipping %u of the selected tests, they need an operator", num_operator);
+    }
+    //nothing left to run, the units are left as they are
+    if((status != BATCH_REFUSED) && (default_plan.num_steps == 0))
+    {
+        ERROR_PRINT("None of the selected tests can run without an operator");
+        status = BATCH_NOT_RUN;
+    }
+    if(status != BATCH_PASSED)
+    {
+        batch_write_summary(job, &chosen, status, time_in_ms() - start_ms);
+        return status;
+    }
+
+    //the operator questions of the tests that do run are only the ones the policy can't see
+    const yes_or_no_func yes_no = Yes_No;
+    Yes_No = batch_unanswered;
+    UserFunc user_func = {batch_tc, batch_unanswered};
+    uint passed_cnt = 0;
+    bool at_ground = false;
+    TestPlan plan;
+    if(job->plan)
+    {
+        plan_optimize(&default_plan, &plan);
+        plan_report(&default_plan, &plan);
+    }
+    else
+        plan = default_plan;
+    if(job->parallel)
+        test_run_parallel(&user_func, &plan, &at_ground, &passed_cnt);
+    else
+        test_run_planned(&user_func, &plan, &at_ground, &passed_cnt);
+    test_run_finish(at_ground, passed_cnt, plan.num_steps);
+    Yes_No = yes_no;
+
+    if(passed_cnt < plan.num_steps)
+        status = BATCH_FAILED;
+    batch_write_summary(job, &chosen, status, time_in_ms() - start_ms);
+    return status;
+}
@@ -25,6 +25,42 @@ typedef int(*get_data_func)(const IN_DATA_ID data_id, char *buf, const size_t bu
 
 void test_run_all(UserFunc *user_func);
 
+//Test definitions are read from this file at startup, the built in tests are used when there is none
+#define TEST_TABLE_FILE "25XXTests.tbl"
+bool test_load_table(const char *path);
+//Another table instead of TEST_TABLE_FILE, set before lib_init
+void test_set_table(const char *path);
+const char *test_get_table();
+
+//What a batch does with the tests that need someone to answer questions, like the LSU indicator lights
+typedef enum {
+    BATCH_OPERATOR_SKIP   = 1 << 0, //run the rest without them
+    BATCH_OPERATOR_REFUSE = 1 << 1  //run nothing
+} BATCH_OPERATOR;
+
+typedef enum {
+    BATCH_PASSED  = 0,
+    BATCH_FAILED  = 1 << 0,
+    BATCH_REFUSED = 1 << 1,
+    BATCH_NOT_RUN = 1 << 2, //every selected test needed an operator
+    BATCH_ERROR   = 1 << 3  //the station or the table couldn't be set up
+} BATCH_STATUS;
+
+//Tests run with no one at the station. A selection is the name of a test set or of a test, no selection runs them all
+#define BATCH_MAX_SELECT 32
+typedef struct BatchJob {
+    const char *select[BATCH_MAX_SELECT];
+    int num_select;
+    bool plan;
+    bool parallel;
+    BATCH_OPERATOR operator_policy;
+    const char *summary; //RESULT and SUMMARY lines, stdout if NULL
+} BatchJob;
+
+BATCH_STATUS test_run_batch(const BatchJob *job);
+//The SUMMARY of a batch that couldn't start, returns BATCH_ERROR
+BATCH_STATUS test_batch_error(const BatchJob *job);
+
 #define _TEST struct { \
     const char *test_name; \
     const char *setup; \
@@ -7,9 +7,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "utility.h"
 #include "serial.h"
+#include "recorder.h"
+#include "test.h"
 
 typedef struct {
     FD_MASK mask;
@@ -22,11 +25,22 @@ int vbuild_debug(char *dest, size_t dest_len ,const char * func_src, const char
 static int add_newline(char *dest, const char *src, size_t dest_size);
 static int vformat_and_newline(char *dest, size_t dest_size, const char *const _format, va_list arg);
 ssize_t FDM_write(FD_MASK mask, const void *buf, size_t count);
-static inline bool build_filename_from_sn(char *filename, const char *sn);
+static inline bool build_filename_from_sn(char *filename, const char *sn, const char *ext);
+static void operator_queue_wait(const bool held);
 
 #define FDM_MAX 8
 #define FD_INVALID -1
 static int FD_MAP_Free_Pos = 2;
+
+//one log per unit S/N, opened the first time a test runs on its own thread for that unit
+#define UNIT_LOGS_MAX 2
+typedef struct UnitLog {
+    char    sn[32];
+    FD_MASK mask;
+} UnitLog;
+static UnitLog Unit_Logs[UNIT_LOGS_MAX];
+static __thread const char *Log_Unit_Name;
+static __thread FD_MASK Log_Unit_Mask;
 FD_MAP Fd_Map[FDM_MAX] = {{FDM_STDOUT, STDOUT_FILENO}, {FDM_STDERR, STDERR_FILENO}, {FDM_FREE0, FD_INVALID}, {FDM_FREE1, FD_INVALID}, {FDM_FREE2, FD_INVALID}, {FDM_FREE3, FD_INVALID}, {FDM_FREE4, FD_INVALID}, {FDM_FREE5, FD_INVALID}};
 
 FD_MASK FDM_register_fd(const int fd)
@@ -118,21 +132,122 @@ static inline int vformat_and_newline(char *dest, size_t dest_size, const char *
 ssize_t log_format_debug(const FD_MASK fdm, const char * const function_src, const char* const _format, ...)
 {
     char message[1024];
+    int prefix = (Log_Unit_Name != NULL) ? snprintf(message, sizeof(message), "[%s] ", Log_Unit_Name) : 0;
     va_list arg;    
     va_start (arg, _format); 
-    int len = vbuild_debug(message, sizeof(message), function_src, _format, arg);      
+    int len = vbuild_debug(&message[prefix], sizeof(message) - prefix, function_src, _format, arg);      
     va_end (arg);
-    return FDM_write(fdm, message, len);
+    if(len < 0)
+        return -1;
+    return FDM_write((fdm & FDM_TEST_LOG) ? (fdm | Log_Unit_Mask) : fdm, message, prefix + len);
 }
 
 ssize_t log_format_line(const FD_MASK fdm, const char *const _format, ...)
 {
     char dest[1024]; 
+    int prefix = (Log_Unit_Name != NULL) ? snprintf(dest, sizeof(dest), "[%s] ", Log_Unit_Name) : 0;
     va_list arg;    
     va_start (arg, _format);
-    int len = vformat_and_newline(dest, LENGTH_2D(dest), _format, arg); 
+    int len = vformat_and_newline(&dest[prefix], LENGTH_2D(dest) - prefix, _format, arg); 
     va_end (arg);
-    return FDM_write(fdm, dest, len);     
+    if(len < 0)
+        return -1;
+    return FDM_write((fdm & FDM_TEST_LOG) ? (fdm | Log_Unit_Mask) : fdm, dest, prefix + len);     
+}
+
+void log_set_unit(const char *name, const FD_MASK unit_log)
+{
+    Log_Unit_Name = name;
+    Log_Unit_Mask = unit_log;
+}
+
+//Call before starting the unit threads, FDM_register_fd isn't thread safe. A log already open is only looked up
+FD_MASK log_open_unit(const char *sn)
+{
+    for(uint i = 0; i < UNIT_LOGS_MAX; i++)
+    {
+        if(Unit_Logs[i].mask == FDM_INVALID)
+        {
+            char filename[256];
+            build_filename_from_sn(filename, sn, "unit.log");
+            int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if(fd == -1)
+                return FDM_INVALID;
+            if((Unit_Logs[i].mask = FDM_register_fd(fd)) == FDM_INVALID)
+            {
+                close(fd);
+                return FDM_INVALID;
+            }
+            snprintf(Unit_Logs[i].sn, sizeof(Unit_Logs[i].sn), "%s", sn);
+            return Unit_Logs[i].mask;
+        }
+        if(strcmp(Unit_Logs[i].sn, sn) == 0)
+            return Unit_Logs[i].mask;
+    }
+    return FDM_INVALID;
+}
+
+//Tickets for the operator, tests running at the same time get their questions answered in the order they asked
+static pthread_mutex_t Operator_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  Operator_Turn = PTHREAD_COND_INITIALIZER;
+static uint Operator_Next_Ticket;
+static uint Operator_Serving;
+static uint Operator_Holds;
+
+//A held turn also waits out the ramps, under the same lock so no ramp can start between the check and the question
+static void operator_queue_wait(const bool held)
+{
+    pthread_mutex_lock(&Operator_Lock);
+    const uint ticket = Operator_Next_Ticket++;
+    while((ticket != Operator_Serving) || (held && (Operator_Holds > 0)))
+        pthread_cond_wait(&Operator_Turn, &Operator_Lock);
+    pthread_mutex_unlock(&Operator_Lock);
+}
+
+void operator_queue_enter(void)
+{
+    operator_queue_wait(false);
+}
+
+void operator_queue_leave(void)
+{
+    pthread_mutex_lock(&Operator_Lock);
+    Operator_Serving++;
+    pthread_cond_broadcast(&Operator_Turn);
+    pthread_mutex_unlock(&Operator_Lock);
+}
+
+//While a ramp is in progress the confirmations wait, they come up once it is over
+void operator_queue_hold(void)
+{
+    pthread_mutex_lock(&Operator_Lock);
+    Operator_Holds++;
+    pthread_mutex_unlock(&Operator_Lock);
+}
+
+void operator_queue_release(void)
+{
+    pthread_mutex_lock(&Operator_Lock);
+    Operator_Holds--;
+    pthread_cond_broadcast(&Operator_Turn);
+    pthread_mutex_unlock(&Operator_Lock);
+}
+
+//The question and its answer are shown together, nothing from another test's question gets in between
+bool operator_confirm(const char *fmt, ...)
+{
+    char question[512];
+    va_list arg;
+    va_start(arg, fmt);
+    vsnprintf(question, sizeof(question), fmt, arg);
+    va_end(arg);
+
+    operator_queue_wait(true);
+    OUTPUT_PRINT("%s", question);
+    const bool yes = Yes_No();
+    OUTPUT_PRINT("%s", yes ? "Yes" : "No");
+    operator_queue_leave();
+    return yes;
 }
 
 bool log_init(const char *filepath)
@@ -171,15 +286,15 @@ bool parse_sn(char *result, const char *src)
     return false;
 }
 
-static inline bool build_filename_from_sn(char *filename, const char *sn)
+static inline bool build_filename_from_sn(char *filename, const char *sn, const char *ext)
 {
     time_t now = time(NULL);
     struct tm *timenow;
     timenow = localtime(&now);
     
     char filetemp[256];
-    strftime(filetemp, sizeof(filetemp), "_%Y-%m-%d_%H:%M:%S.log", timenow);
-    snprintf(filename, 256, "SN_%s%s", sn, filetemp);
+    strftime(filetemp, sizeof(filetemp), "_%Y-%m-%d_%H:%M:%S", timenow);
+    snprintf(filename, 256, "SN_%s%s.%s", sn, filetemp, ext);
     DEBUG_PRINT("log filename: %s", filename);
     return true;
 }
@@ -197,13 +312,14 @@ uint64_t time_in_ms()
 
 bool lib_init(SCPIDeviceManager *sdm, get_buf_func master_sn, get_buf_func slave_sn, get_buf_func ask_name, yes_or_no_func yes_no)
 {
-    
+    //the station is identified while the operator types
+    serial_discover_start();
     const char *name = ask_name();
     const char *master = master_sn();
     const char *slave = slave_sn();
     //make the main log file named after the master sn
     char filename[256];
-    if(!build_filename_from_sn(filename, master))
+    if(!build_filename_from_sn(filename, master, "log"))
         return false;
     if(!log_init(filename))
         return false; 
@@ -213,16 +329,27 @@ bool lib_init(SCPIDeviceManager *sdm, get_buf_func master_sn, get_buf_func slave
     OUTPUT_PRINT("Master unit S/N: %s", master);     
     OUTPUT_PRINT("Slave unit S/N: %s", slave);
 
+    //the tests are checked before any device is touched
+    if(!test_load_table(test_get_table()))
+        return false;
+
     //Initialize serial   
     if(!serial_init(sdm, master, slave))
         return false;
 
+    //pressure data of the whole run goes to a binary file next to the log
+    if(!build_filename_from_sn(filename, master, "tlm"))
+        return false;
+    if(!recorder_start(filename, sdm->master.fd, sdm->slave.fd))
+        ERROR_PRINT("Could not create telemetry file %s, pressure data will not be recorded", filename);
+
     Yes_No = yes_no;
     return true;
 }
 
 void lib_close(SCPIDeviceManager *sdm)
 {
+    recorder_stop();
     serial_close(sdm);    
     log_close();
 }
\ No newline at end of file
@@ -48,8 +48,19 @@ void FDM_close(FD_MASK mask);
 ssize_t log_format_debug(const FD_MASK fdm, const char * const function_src, const char* const _format, ...);
 ssize_t log_format_line(const FD_MASK fdm, const char *const _format, ...);
 bool parse_sn(char *result, const char *src);
+
+//Lines logged by the calling thread are prefixed with name and also go to unit_log, for tests running on both units at once
+void log_set_unit(const char *name, const FD_MASK unit_log);
+FD_MASK log_open_unit(const char *sn);
 yes_or_no_func Yes_No;
 
+//Questions for the operator go through one queue, a test waits its turn while another test's question is up
+void operator_queue_enter(void);
+void operator_queue_leave(void);
+void operator_queue_hold(void);
+void operator_queue_release(void);
+bool operator_confirm(const char *fmt, ...);
+
 #define OUTPUT_PRINT(fmt, ...) log_format_line(FDM_STDOUT | FDM_TEST_LOG, fmt, ##__VA_ARGS__)
 
 #ifdef DEBUG /* Print debug messages to screen and print errors in debug form */
@@ -11,6 +11,8 @@
 #include <math.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <strings.h>
+#include <sysexits.h>
 
 #include "utility.h"
 #include "test.h"
@@ -43,6 +45,36 @@ TEST_CHOICE my_tc();
 int supply_predetermined_data(const IN_DATA_ID data_id, char *buf, const size_t bufsize);
 char *add_input(char *buf, size_t buflen);
 bool yes_no();
+bool job_set(const char *key, const char *value);
+bool job_read_file(const char *path);
+void usage(const char *prog);
+
+//Batch mode, any option on the command line turns it on. The options and a job file's key=value lines set the same things
+static BatchJob Job = {.plan = true, .operator_policy = BATCH_OPERATOR_SKIP};
+static const char *Batch_Master;
+static const char *Batch_Slave;
+static const char *Batch_Name = "batch";
+const char *get_batch_master(){ return Batch_Master;}
+const char *get_batch_slave(){  return Batch_Slave;}
+const char *get_batch_name(){   return Batch_Name;}
+bool batch_no(){ return false;}
+
+typedef struct JobOption {
+    int opt;
+    const char *key;
+} JobOption;
+
+static const JobOption Job_Options[] = {
+    {'m', "master"},
+    {'s', "slave"},
+    {'n', "name"},
+    {'t', "table"},
+    {'r', "run"},      //a test set or test name, repeat for more
+    {'o', "operator"}, //skip or refuse the tests that need an operator
+    {'p', "plan"},     //yes or no
+    {'P', "parallel"}, //yes or no
+    {'S', "summary"},
+};
 
 #ifdef SUPPLY_DBG_INPUT
     const char *get_master_id(){ return "231";}
@@ -66,6 +98,41 @@ bool yes_no();
 int main(int argc, char **argv)
 {    
     SCPIDeviceManager sdm;
+
+    bool batch = false;
+    int opt;
+    while((opt = getopt(argc, argv, "j:m:s:n:t:r:o:p:P:S:h")) != -1)
+    {
+        bool ok = false;
+        if(opt == 'j')
+            ok = job_read_file(optarg);
+        for(uint i = 0; i < sizeof(Job_Options)/sizeof(Job_Options[0]); i++)
+        {
+            if(Job_Options[i].opt == opt)
+                ok = job_set(Job_Options[i].key, optarg);
+        }
+        if(!ok)
+        {
+            usage(argv[0]);
+            return EX_USAGE;
+        }
+        batch = true;
+    }
+
+    if(batch)
+    {
+        if((Batch_Master == NULL) || (Batch_Slave == NULL))
+        {
+            fprintf(stderr, "The master and slave SN are needed in batch mode\n");
+            usage(argv[0]);
+            return EX_USAGE;
+        }
+        if(!lib_init(&sdm, get_batch_master, get_batch_slave, get_batch_name, batch_no))
+            return test_batch_error(&Job);
+        const BATCH_STATUS status = test_run_batch(&Job);
+        lib_close(&sdm);
+        return status;
+    }
     
     if(!lib_init(&sdm, get_master_id, get_slave_id, get_tester_name, yes_no))
     {
@@ -88,6 +155,131 @@ int main(int argc, char **argv)
     return 0;
 }
 
+bool job_set(const char *key, const char *value)
+{
+    if(strcmp(key, "master") == 0)
+        Batch_Master = value;
+    else if(strcmp(key, "slave") == 0)
+        Batch_Slave = value;
+    else if(strcmp(key, "name") == 0)
+        Batch_Name = value;
+    else if(strcmp(key, "table") == 0)
+    {
+        //the built in tests stand in for a missing table only when it wasn't asked for
+        if(access(value, R_OK) != 0)
+        {
+            fprintf(stderr, "Unable to read the test table %s\n", value);
+            return false;
+        }
+        test_set_table(value);
+    }
+    else if(strcmp(key, "run") == 0)
+    {
+        if(Job.num_select == BATCH_MAX_SELECT)
+        {
+            fprintf(stderr, "More than %d tests to run, select test sets instead\n", BATCH_MAX_SELECT);
+            return false;
+        }
+        Job.select[Job.num_select++] = value;
+    }
+    else if(strcmp(key, "operator") == 0)
+    {
+        if(strcasecmp(value, "skip") == 0)
+            Job.operator_policy = BATCH_OPERATOR_SKIP;
+        else if(strcasecmp(value, "refuse") == 0)
+            Job.operator_policy = BATCH_OPERATOR_REFUSE;
+        else
+            return false;
+    }
+    else if((strcmp(key, "plan") == 0) || (strcmp(key, "parallel") == 0))
+    {
+        bool *flag = (strcmp(key, "plan") == 0) ? &Job.plan : &Job.parallel;
+        if(strcasecmp(value, "yes") == 0)
+            *flag = true;
+        else if(strcasecmp(value, "no") == 0)
+            *flag = false;
+        else
+            return false;
+    }
+    else if(strcmp(key, "summary") == 0)
+        Job.summary = value;
+    else
+    {
+        fprintf(stderr, "Unknown job key %s\n", key);
+        return false;
+    }
+    return true;
+}
+
+static void trim_end(char *str)
+{
+    for(size_t len = strlen(str); (len > 0) && isspace((unsigned char)str[len-1]); len--)
+        str[len-1] = '\0';
+}
+
+//key=value lines, # starts a comment. The values are kept for the whole run
+bool job_read_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        fprintf(stderr, "Unable to open the job file %s\n", path);
+        return false;
+    }
+
+    bool bRet = true;
+    char line[256];
+    uint line_num = 0;
+    while(bRet && (fgets(line, sizeof(line), file) != NULL))
+    {
+        line_num++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *key = line;
+        while(isspace((unsigned char)*key))
+            key++;
+        if(*key == '\0')
+            continue;
+
+        char *value = strchr(key, '=');
+        if(value == NULL)
+        {
+            fprintf(stderr, "%s:%u: expected key=value\n", path, line_num);
+            bRet = false;
+            continue;
+        }
+        *value++ = '\0';
+        while(isspace((unsigned char)*value))
+            value++;
+        trim_end(key);
+        trim_end(value);
+
+        if(!job_set(key, strdup(value)))
+        {
+            fprintf(stderr, "%s:%u: bad value for %s\n", path, line_num, key);
+            bRet = false;
+        }
+    }
+    fclose(file);
+    return bRet;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s                 ask everything at the terminal\n"
+                    "       %s -m SN -s SN [options], or -j JOBFILE with the same keys\n"
+                    "  -m SN          master (bottom) unit, key master\n"
+                    "  -s SN          slave unit, key slave\n"
+                    "  -n NAME        tester name, key name\n"
+                    "  -t FILE        test table, key table\n"
+                    "  -r NAME        test set or test to run, repeat for more, key run, default all\n"
+                    "  -o skip|refuse tests that need an operator, key operator, default skip\n"
+                    "  -p yes|no      plan the test order, key plan, default yes\n"
+                    "  -P yes|no      run tests that don't share a unit at the same time, key parallel, default no\n"
+                    "  -S FILE        RESULT and SUMMARY lines, key summary, default stdout\n"
+                    "Exits 0 if every test run passed, 1 if any failed, 2 if the job was refused, 4 if every selected test needed\n"
+                    "an operator, 8 if the units or the test table couldn't be set up and %d on a usage error\n", prog, prog, EX_USAGE);
+}
+
 bool yes_no()
 {    
     #ifndef ENABLE_BASIC_INPUT